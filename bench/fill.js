@@ -0,0 +1,19 @@
+// 全屏填充测试：每帧清屏后叠加多层半透明全屏矩形，衡量像素填充和纹理上传
+function main() {
+    const canvas = new Canvas(800, 600)
+    const layers = 8
+
+    function frame() {
+        canvas.clear()
+        for (let i = 0; i < layers; i++) {
+            canvas.setFillColor(Math.random() * 255, Math.random() * 255, Math.random() * 255, 64)
+            canvas.fillRect(0, 0, canvas.width, canvas.height)
+        }
+        canvas.show()
+        requestAnimationFrame(frame)
+    }
+
+    requestAnimationFrame(frame)
+}
+
+main()
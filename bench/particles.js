@@ -0,0 +1,27 @@
+// 粒子压力测试：每帧在随机位置爆开一批粒子，画面上常驻数万个粒子
+const particles = new ParticleSystem()
+particles.seed(1)
+
+function main() {
+    const canvas = new Canvas(800, 600)
+
+    function frame() {
+        for (let i = 0; i < 4; i++) {
+            const x = Math.random() * canvas.width
+            const y = Math.random() * canvas.height * 0.6
+            particles.emit(x, y, 100, {
+                color: [Math.random() * 255, Math.random() * 255, Math.random() * 255],
+            })
+        }
+
+        canvas.fade(100 / 255)
+        particles.step(1)
+        particles.render(canvas)
+        canvas.show()
+        requestAnimationFrame(frame)
+    }
+
+    requestAnimationFrame(frame)
+}
+
+main()
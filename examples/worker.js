@@ -0,0 +1,54 @@
+// 在 worker 里跑粒子模拟，主线程只负责渲染
+// worker 把每帧的粒子写进 SharedFrames（共享内存上的三缓冲），
+// 主线程每帧取最新的完整一帧画出来，两边互不等待
+// 运行：./build/yanhua examples/worker.js
+const MAX_PARTICLES = 60000
+const CIRCLE_RECORD = 7 // x, y, radius, r, g, b, a，和 canvas.fillCircles 一致
+
+const EventType = {
+    QUIT: 0x100,
+    MouseButtonDown: 0x401,
+}
+
+function main() {
+    const canvas = new Canvas(800, 600)
+    const events = new Int32Array(256 * Canvas.EVENT_STRIDE)
+    const frames = new SharedFrames(MAX_PARTICLES * CIRCLE_RECORD * 4)
+    // 三个槽位各建一个视图，避免每帧创建 Float32Array
+    const views = [0, 1, 2].map((slot) =>
+        new Float32Array(frames.buffer, frames.offsetOf(slot), MAX_PARTICLES * CIRCLE_RECORD))
+
+    const worker = new os.Worker('./worker_sim.js')
+    worker.postMessage({ type: 'init', buffer: frames.buffer, width: canvas.width, height: canvas.height })
+    let lastTime = 0
+
+    function frame(time) {
+        const dt = lastTime ? Math.min((time - lastTime) / (1000 / 60), 4) : 1
+        lastTime = time
+
+        const count = canvas.pollEvents(events)
+        for (let i = 0; i < count * Canvas.EVENT_STRIDE; i += Canvas.EVENT_STRIDE) {
+            const type = events[i]
+            if (type === EventType.QUIT) {
+                worker.postMessage({ type: 'quit' })
+                canvas.quit()
+                return
+            }
+            else if (type === EventType.MouseButtonDown) {
+                worker.postMessage({ type: 'emit', x: events[i + 2], y: events[i + 3] })
+            }
+        }
+
+        // 先让 worker 算下一帧，主线程同时画已经算好的那一帧
+        worker.postMessage({ type: 'step', dt })
+        frames.acquire()
+        canvas.fade(100 / 255)
+        canvas.fillCircles(views[frames.readSlot], frames.count)
+        canvas.show()
+        requestAnimationFrame(frame)
+    }
+
+    requestAnimationFrame(frame)
+}
+
+main()
@@ -0,0 +1,38 @@
+// examples/worker.js 的模拟线程，只能用不依赖窗口的类（ParticleSystem、SharedFrames）
+import * as os from 'os'
+
+const parent = os.Worker.parent
+const particles = new ParticleSystem()
+let frames = null
+let views = null
+let width = 0
+let height = 0
+
+parent.onmessage = (message) => {
+    const data = message.data
+    switch (data.type) {
+        case 'init':
+            frames = new SharedFrames(data.buffer)
+            views = [0, 1, 2].map((slot) =>
+                new Float32Array(frames.buffer, frames.offsetOf(slot), frames.slotBytes / 4))
+            width = data.width
+            height = data.height
+            break
+        case 'emit':
+            particles.emit(data.x, data.y, 500)
+            break
+        case 'step':
+            if (Math.random() < 0.1) {
+                particles.emit(Math.random() * width, Math.random() * height * 0.6, 200, {
+                    color: [Math.random() * 255, Math.random() * 255, Math.random() * 255],
+                })
+            }
+            particles.step(data.dt)
+            // 写满当前槽位后发布，worker 换到另一个空闲槽位
+            frames.publish(particles.writeCircles(views[frames.writeSlot]))
+            break
+        case 'quit':
+            parent.onmessage = null
+            break
+    }
+}
@@ -1,7 +1,21 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <linux/joystick.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
@@ -15,6 +29,177 @@
 #include "quickjs-libc.h"
 #include "quickjs.h"
 
+// CMake reads it from extern/quickjs/VERSION
+#ifndef QUICKJS_VERSION
+#define QUICKJS_VERSION "unknown"
+#endif
+
+// #region random
+
+// xorshift64* generator, fast and good enough for visual effects
+static uint64_t xorshift64_next(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// The state must never be zero.
+static void xorshift64_seed(uint64_t *state, uint64_t seed) {
+  *state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// Returns a float in [0, 1).
+static float xorshift64_float(uint64_t *state) {
+  return (xorshift64_next(state) >> 40) * 0x1.0p-24f;
+}
+
+// #endregion
+
+// #region options
+
+typedef struct {
+  const char *script; // main.js unless given on the command line
+  int script_argc;    // scriptArgs, starting with the script itself
+  char **script_argv;
+
+  bool headless;      // canvases are offscreen and frames use a fixed timestep
+  const char *output; // frame output of offscreen canvases, see below
+  int frames;         // stop requesting frames after this many, 0 never stops
+  double fps;         // frame rate of the fixed timestep
+  bool no_cache;      // always compile scripts from source
+  const char *record; // drawing operations are written here
+  const char *replay; // recording played back instead of a script
+  const char *raster; // overrides the backend of replayed canvases
+  const char *trace;  // Chrome trace written here at exit, see trace_init()
+#ifdef YANHUA_BENCH
+  uint64_t seed;    // seeds Math.random and the synthetic clicks
+  int click_every;  // frames between synthetic clicks, 0 for none
+  const char *json; // report destination
+#endif
+} AppOptions;
+
+static AppOptions app_options = {.script = "main.js", .fps = 60};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] [script [args...]]\n"
+          "  --headless       render offscreen as fast as possible\n"
+          "  --output PATH    write the frames of offscreen canvases to PATH:\n"
+          "                   raw RGBA, '-' for stdout, or PNGs when PATH\n"
+          "                   ends in .png ('%%05d' numbers the frames)\n"
+          "  --frames N       stop after N frames\n"
+          "  --fps F          frame rate of the headless timestep (60)\n"
+          "  --no-cache       do not read or write bytecode caches\n"
+          "  --record PATH    write every drawing operation to PATH\n"
+          "  --replay PATH    play a recording back instead of a script\n"
+          "  --raster MODE    immediate, deferred or geometry rendering of\n"
+          "                   the replayed canvases, as recorded by default\n"
+          "  --trace PATH     trace from the start and write Chrome trace\n"
+          "                   JSON to PATH at exit (SIGUSR2 toggles tracing,\n"
+          "                   SIGUSR1 writes the trace so far)\n"
+#ifdef YANHUA_BENCH
+          "  --seed N         seed of Math.random and the clicks (1)\n"
+          "  --click-every N  click at a random spot every N frames\n"
+          "  --json PATH      write the timings as JSON to PATH\n"
+#endif
+          ,
+          prog);
+}
+
+// Parses a count such as --frames: a decimal integer from 0 to INT_MAX with
+// nothing after it.
+static int parse_count(const char *value, int *count) {
+  char *end;
+  errno = 0;
+  long n = strtol(value, &end, 10);
+  if (end == value || *end || errno || n < 0 || n > INT_MAX) {
+    return -1;
+  }
+  *count = (int)n;
+  return 0;
+}
+
+static int parse_options(AppOptions *opts, int argc, char *argv[]) {
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(arg, "--headless")) {
+      opts->headless = true;
+      continue;
+    }
+    if (!strcmp(arg, "--no-cache")) {
+      opts->no_cache = true;
+      continue;
+    }
+    if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      usage(argv[0]);
+      exit(0);
+    }
+    if (!value) {
+      fprintf(stderr, "%s: missing value for %s\n", argv[0], arg);
+      return -1;
+    }
+    if (!strcmp(arg, "--output")) {
+      opts->output = value;
+    } else if (!strcmp(arg, "--frames")) {
+      if (parse_count(value, &opts->frames)) {
+        fprintf(stderr, "%s: invalid frame count %s\n", argv[0], value);
+        return -1;
+      }
+    } else if (!strcmp(arg, "--record")) {
+      opts->record = value;
+    } else if (!strcmp(arg, "--replay")) {
+      opts->replay = value;
+    } else if (!strcmp(arg, "--raster")) {
+      if (strcmp(value, "immediate") && strcmp(value, "deferred") &&
+          strcmp(value, "geometry")) {
+        fprintf(stderr, "%s: invalid raster mode %s\n", argv[0], value);
+        return -1;
+      }
+      opts->raster = value;
+    } else if (!strcmp(arg, "--trace")) {
+      opts->trace = value;
+    } else if (!strcmp(arg, "--fps")) {
+      opts->fps = atof(value);
+      if (opts->fps <= 0) {
+        fprintf(stderr, "%s: invalid frame rate %s\n", argv[0], value);
+        return -1;
+      }
+#ifdef YANHUA_BENCH
+    } else if (!strcmp(arg, "--seed")) {
+      opts->seed = strtoull(value, NULL, 0);
+    } else if (!strcmp(arg, "--click-every")) {
+      if (parse_count(value, &opts->click_every)) {
+        fprintf(stderr, "%s: invalid click interval %s\n", argv[0], value);
+        return -1;
+      }
+    } else if (!strcmp(arg, "--json")) {
+      opts->json = value;
+#endif
+    } else {
+      fprintf(stderr, "%s: unknown option %s\n", argv[0], arg);
+      return -1;
+    }
+    i++;
+  }
+  if (opts->record && opts->replay) {
+    fprintf(stderr, "%s: --record and --replay do not mix\n", argv[0]);
+    return -1;
+  }
+  if (i < argc) {
+    opts->script = argv[i];
+  }
+  opts->script_argc = argc - i;
+  opts->script_argv = argv + i;
+  return 0;
+}
+
+// #endregion
+
 // #region Event
 
 static JSClassID js_event_class_id;
@@ -113,454 +298,8014 @@ static int js_event_init(JSContext *ctx) {
 
 // #endregion
 
-// #region JSCanvas
+// #region trace
+//
+// Chrome trace events ("Trace Event Format", for chrome://tracing or
+// Perfetto) in a ring buffer that keeps the last TRACE_CAPACITY events. It is
+// part of every build and costs a branch per span while off. --trace PATH
+// turns it on at startup and writes PATH at exit. On a running process
+// SIGUSR2 turns it on or off and SIGUSR1 writes the buffer, to the --trace
+// path or to yanhua-<pid>.trace.json; both take effect at the end of the
+// frame. Spans cover the Canvas methods and the phases of the bench region,
+// scripts add their own with performance.mark() and performance.measure(),
+// and every frame adds counters for draw calls, damaged pixels and events.
+
+#define TRACE_CAPACITY (1 << 16) // a power of two
+#define TRACE_MAX_NAMES 1024
+#define TRACE_HEAP_INTERVAL 60 // frames between JS_ComputeMemoryUsage() calls
 
 typedef struct {
-  SDL_Color color;
-} Style;
+  const char *name; // a literal, or interned by trace_intern()
+  uint64_t ts_ns;
+  union {
+    uint64_t dur_ns; // 'X', a complete span
+    double value;    // 'C', a counter
+  };
+  SDL_ThreadID tid;
+  char ph; // also 'i', an instant
+} TraceEvent;
 
 typedef struct {
-  int width;
-  int height;
-  Style fill_style;
+  const char *name;
+  uint64_t ns;
+} TraceMark;
 
-  SDL_Window *window;
-  SDL_Renderer *renderer;
+typedef struct {
+  TraceEvent *ring;
+  SDL_AtomicInt head; // events ever written, wraps around
+  char *names[TRACE_MAX_NAMES];
+  int name_count;
+  TraceMark *marks;
+  int mark_count;
+  int mark_capacity;
+  uint64_t start_ns; // when tracing was first turned on
+  int frame;
+  // counters of the current frame, main thread only
+  uint64_t draw_calls;
+  uint64_t pixels;
+  uint64_t events;
+} Trace;
 
-  SDL_Surface *surface;
-  void *pixels; // pointer to the pixel data of the surface
-  plutovg_surface_t *plutovg_surface;
-  plutovg_canvas_t *plutovg_canvas;
+static Trace trace;
+// set on the main thread, read by the raster threads as well
+static bool trace_enabled;
+static volatile sig_atomic_t trace_dump_requested;
+static volatile sig_atomic_t trace_toggle_requested;
 
-} JSCanvas;
+#define TRACE_COUNT(counter, n)                                                \
+  (trace_enabled ? (void)(trace.counter += (n)) : (void)0)
 
-static JSClassID js_canvas_class_id;
+// Start of a span, or 0 while tracing is off.
+static inline uint64_t trace_now(void) {
+  return trace_enabled ? SDL_GetTicksNS() : 0;
+}
 
-static void canvas_finalizer(JSCanvas *s) {
-  if (s->renderer != NULL) {
-    SDL_DestroyRenderer(s->renderer);
-  }
-  if (s->window != NULL) {
-    SDL_DestroyWindow(s->window);
-  }
-  if (s->surface != NULL) {
-    SDL_DestroySurface(s->surface);
-  }
-  if (s->pixels != NULL) {
-    free(s->pixels);
-  }
-  if (s->plutovg_surface != NULL) {
-    plutovg_surface_destroy(s->plutovg_surface);
-  }
-  if (s->plutovg_canvas != NULL) {
-    plutovg_canvas_destroy(s->plutovg_canvas);
+static TraceEvent *trace_push(const char *name, char ph, uint64_t ts_ns) {
+  unsigned i = SDL_AddAtomicInt(&trace.head, 1);
+  TraceEvent *e = &trace.ring[i % TRACE_CAPACITY];
+  e->name = name;
+  e->ph = ph;
+  e->ts_ns = ts_ns;
+  e->tid = SDL_GetCurrentThreadID();
+  return e;
+}
+
+// Ends a span started with trace_now(). name must outlive the buffer.
+static void trace_span(const char *name, uint64_t start_ns) {
+  if (start_ns != 0) {
+    uint64_t now = SDL_GetTicksNS();
+    trace_push(name, 'X', start_ns)->dur_ns = now - start_ns;
   }
 }
 
-static void js_canvas_finalizer(JSRuntime *rt, JSValue val) {
-  JSCanvas *s = JS_GetOpaque(val, js_canvas_class_id);
-  canvas_finalizer(s);
-  /* Note: 's' can be NULL in case JS_SetOpaque() was not called */
-  js_free_rt(rt, s);
+static void trace_counter(const char *name, double value) {
+  trace_push(name, 'C', SDL_GetTicksNS())->value = value;
 }
 
-static int canvas_initializer(JSCanvas *s) {
-  s->window =
-      SDL_CreateWindow("Canvas", s->width, s->height, SDL_WINDOW_RESIZABLE);
-  if (!s->window) {
-    fprintf(stderr, "SDL could not create window! SDL_Error: %s\n",
-            SDL_GetError());
-    return 1;
+// Returns a copy of name that lives as long as the trace, or NULL.
+static const char *trace_intern(const char *name) {
+  for (int i = 0; i < trace.name_count; i++) {
+    if (!strcmp(trace.names[i], name)) {
+      return trace.names[i];
+    }
   }
-  s->renderer = SDL_CreateRenderer(s->window, NULL);
-  if (!s->renderer) {
-    fprintf(stderr, "SDL could not create renderer! SDL_Error: %s\n",
-            SDL_GetError());
-    return 1;
+  if (trace.name_count == TRACE_MAX_NAMES) {
+    return NULL;
   }
+  char *copy = strdup(name);
+  if (copy) {
+    trace.names[trace.name_count++] = copy;
+  }
+  return copy;
+}
 
-  int width = s->width;
-  int height = s->height;
-  int pitch = width * 4; // 4 bytes per pixel (RGBA)
-
-  // Allocate memory for pixel data
-  void *pixels = malloc(height * pitch);
-  assert(pixels != NULL && "Failed to allocate memory for pixel buffer");
-
-  // Fill pixels with a default color (e.g., white with full alpha)
-  SDL_memset(pixels, 0xFF, s->height * pitch);
+static void trace_start(void) {
+  if (!trace.ring) {
+    trace.ring = calloc(TRACE_CAPACITY, sizeof(TraceEvent));
+    if (!trace.ring) {
+      fprintf(stderr, "trace: out of memory\n");
+      return;
+    }
+    trace.start_ns = SDL_GetTicksNS();
+  }
+  trace_enabled = true;
+}
 
-  // Create an SDL surface from the pixel buffer
-  SDL_Surface *surface = SDL_CreateSurfaceFrom(
-      width, height, SDL_PIXELFORMAT_ARGB8888, pixels, pitch);
-  if (!surface) {
-    free(pixels);
-    fprintf(stderr, "SDL could not create surface! SDL_Error: %s\n",
-            SDL_GetError());
-    return 1;
+// Writes s as a JSON string literal.
+static void json_write_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(f, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(f, "\\u%04x", *s);
+    } else {
+      fputc(*s, f);
+    }
   }
-  s->pixels = pixels;
-  s->surface = surface;
+  fputc('"', f);
+}
 
-  s->plutovg_surface =
-      plutovg_surface_create_for_data(pixels, width, height, pitch);
-  if (s->plutovg_surface == NULL) {
-    fprintf(stderr, "PlutoVG could not create surface!\n");
-    return 1;
+static int trace_write(const char *path) {
+  unsigned head = SDL_GetAtomicInt(&trace.head);
+  unsigned count = SDL_min(head, TRACE_CAPACITY);
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return -1;
   }
-  s->plutovg_canvas = plutovg_canvas_create(s->plutovg_surface);
-  if (s->plutovg_canvas == NULL) {
-    fprintf(stderr, "PlutoVG could not create canvas!\n");
-    return 1;
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (unsigned i = head - count; i != head; i++) {
+    const TraceEvent *e = &trace.ring[i % TRACE_CAPACITY];
+    fprintf(f, "%s\n{\"name\": ", i != head - count ? "," : "");
+    json_write_string(f, e->name);
+    fprintf(f, ", \"ph\": \"%c\", \"pid\": %d, \"tid\": %" PRIu64
+            ", \"ts\": %.3f", e->ph, (int)getpid(), (uint64_t)e->tid,
+            (double)e->ts_ns / 1000);
+    if (e->ph == 'X') {
+      fprintf(f, ", \"dur\": %.3f", (double)e->dur_ns / 1000);
+    } else if (e->ph == 'C') {
+      fprintf(f, ", \"args\": {\"value\": %.17g}", e->value);
+    } else {
+      fprintf(f, ", \"s\": \"t\"");
+    }
+    fputc('}', f);
   }
-
-  if (!SDL_SetRenderDrawBlendMode(s->renderer, SDL_BLENDMODE_NONE)) {
-    fprintf(stderr, "SDL could not set blend mode! SDL_Error: %s\n",
-            SDL_GetError());
-    return 1;
+  fprintf(f, "\n]}\n");
+  if (fclose(f)) {
+    perror(path);
+    return -1;
   }
+  fprintf(stderr, "trace: %u events written to %s\n", count, path);
   return 0;
 }
 
-static JSValue js_canvas_ctor(JSContext *ctx, JSValueConst new_target, int argc,
-                              JSValueConst *argv) {
-  JSCanvas *s;
-  JSValue obj = JS_UNDEFINED;
-  JSValue proto;
+#ifdef SIGUSR1
+static void trace_signal(int sig) {
+  if (sig == SIGUSR1) {
+    trace_dump_requested = 1;
+  } else {
+    trace_toggle_requested = 1;
+  }
+}
+#endif
 
-  s = js_mallocz(ctx, sizeof(*s));
-  if (!s) {
-    return JS_EXCEPTION;
+static void trace_init(void) {
+#ifdef SIGUSR1
+  signal(SIGUSR1, trace_signal);
+  signal(SIGUSR2, trace_signal);
+#endif
+  if (app_options.trace) {
+    trace_start();
   }
-  if (JS_ToInt32(ctx, &s->width, argv[0])) {
-    goto fail;
+}
+
+// Handles the signals and writes the counters of the frame that started at
+// start_ns. rt is NULL when no script runs.
+static void trace_frame_end(JSRuntime *rt, uint64_t start_ns) {
+  if (trace_toggle_requested) {
+    trace_toggle_requested = 0;
+    if (trace_enabled) {
+      trace_enabled = false;
+    } else {
+      trace_start();
+    }
+    fprintf(stderr, "trace: %s\n", trace_enabled ? "on" : "off");
   }
-  if (JS_ToInt32(ctx, &s->height, argv[1])) {
-    goto fail;
+  if (trace_enabled) {
+    trace_span("frame", start_ns);
+    trace_counter("draw calls", trace.draw_calls);
+    trace_counter("pixels", trace.pixels);
+    trace_counter("events", trace.events);
+    trace.draw_calls = trace.pixels = trace.events = 0;
+    // walks the whole heap, so only now and then
+    if (rt && trace.frame++ % TRACE_HEAP_INTERVAL == 0) {
+      JSMemoryUsage usage;
+      JS_ComputeMemoryUsage(rt, &usage);
+      trace_counter("js heap", usage.memory_used_size);
+    }
   }
-
-  /* using new_target to get the prototype is necessary when the
-   class is extended. */
-  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
-  if (JS_IsException(proto)) {
-    goto fail;
+  if (trace_dump_requested) {
+    trace_dump_requested = 0;
+    char path[64];
+    if (!app_options.trace) {
+      snprintf(path, sizeof(path), "yanhua-%d.trace.json", (int)getpid());
+    }
+    if (trace.ring) {
+      trace_write(app_options.trace ? app_options.trace : path);
+    } else {
+      fprintf(stderr, "trace: nothing was recorded\n");
+    }
   }
-  obj = JS_NewObjectProtoClass(ctx, proto, js_canvas_class_id);
-  JS_FreeValue(ctx, proto);
-  if (JS_IsException(obj)) {
-    goto fail;
+}
+
+// Writes the --trace file, if any, and frees the buffer. Raster threads must
+// be gone by then.
+static int trace_close(void) {
+  int ret = 0;
+  if (app_options.trace && trace.ring) {
+    ret = trace_write(app_options.trace);
   }
-  if (canvas_initializer(s)) {
-    goto fail;
+  trace_enabled = false;
+  free(trace.ring);
+  free(trace.marks);
+  for (int i = 0; i < trace.name_count; i++) {
+    free(trace.names[i]);
   }
-  JS_SetOpaque(obj, s);
-  return obj;
-fail:
-  js_free(ctx, s);
-  JS_FreeValue(ctx, obj);
-  return JS_EXCEPTION;
+  memset(&trace, 0, sizeof(trace));
+  return ret;
 }
 
-static JSClassDef js_canvas_class = {
-    "Canvas",
-    .finalizer = js_canvas_finalizer,
-};
+static TraceMark *trace_find_mark(const char *name) {
+  for (int i = 0; i < trace.mark_count; i++) {
+    if (!strcmp(trace.marks[i].name, name)) {
+      return &trace.marks[i];
+    }
+  }
+  return NULL;
+}
 
-static JSValue js_canvas_arc(JSContext *ctx, JSValueConst this_val, int argc,
-                             JSValueConst *argv) {
-  if (argc != 5 && argc != 6) {
-    fprintf(stderr, "canvas.arc() expected 5 or 6 arguments, but got %d\n",
+// performance.mark(name) records an instant and remembers its time for
+// measure(). Like the rest of the trace, it does nothing while off.
+static JSValue js_performance_mark(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv) {
+  if (argc < 1) {
+    fprintf(stderr, "performance.mark() expected 1 argument, but got %d\n",
             argc);
     return JS_EXCEPTION;
   }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
-    return JS_EXCEPTION;
+  if (!trace_enabled) {
+    return JS_UNDEFINED;
   }
-  double x = 0, y = 0, radius = 0, start_angle = 0, end_angle = 0;
-  bool counterclockwise = (argc == 6) ? JS_ToBool(ctx, argv[5]) : false;
-  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
-      JS_ToFloat64(ctx, &radius, argv[2]) ||
-      JS_ToFloat64(ctx, &start_angle, argv[3]) ||
-      JS_ToFloat64(ctx, &end_angle, argv[4])) {
+  const char *str = JS_ToCString(ctx, argv[0]);
+  if (!str) {
     return JS_EXCEPTION;
   }
-
-  plutovg_canvas_arc(s->plutovg_canvas, x, y, radius, start_angle, end_angle,
-                     counterclockwise);
+  const char *name = trace_intern(str);
+  JS_FreeCString(ctx, str);
+  if (!name) {
+    return JS_UNDEFINED;
+  }
+  uint64_t now = SDL_GetTicksNS();
+  TraceMark *mark = trace_find_mark(name);
+  if (!mark) {
+    if (trace.mark_count == trace.mark_capacity) {
+      int capacity = SDL_max(trace.mark_capacity * 2, 16);
+      TraceMark *marks = realloc(trace.marks, capacity * sizeof(TraceMark));
+      if (!marks) {
+        return JS_ThrowOutOfMemory(ctx);
+      }
+      trace.marks = marks;
+      trace.mark_capacity = capacity;
+    }
+    mark = &trace.marks[trace.mark_count++];
+    mark->name = name;
+  }
+  mark->ns = now;
+  trace_push(name, 'i', now);
   return JS_UNDEFINED;
 }
 
-static JSValue js_canvas_begin_path(JSContext *ctx, JSValueConst this_val,
-                                    int argc, JSValueConst *argv) {
-  if (argc != 0) {
-    fprintf(stderr, "canvas.beginPath() expected 0 arguments, but got %d\n",
-            argc);
+// performance.measure(name, startMark, endMark) records a span between two
+// marks. Without endMark it ends now, without startMark it starts when
+// tracing was turned on. Unknown marks, such as ones made while tracing was
+// off, drop the span instead of throwing like the web API.
+static JSValue js_performance_measure(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv) {
+  if (argc < 1) {
+    fprintf(stderr, "performance.measure() expected 1 to 3 arguments, but "
+                    "got %d\n", argc);
     return JS_EXCEPTION;
   }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
+  if (!trace_enabled) {
+    return JS_UNDEFINED;
+  }
+  uint64_t ns[2] = {trace.start_ns, SDL_GetTicksNS()};
+  for (int i = 0; i < 2; i++) {
+    if (argc < i + 2 || JS_IsUndefined(argv[i + 1])) {
+      continue;
+    }
+    const char *str = JS_ToCString(ctx, argv[i + 1]);
+    if (!str) {
+      return JS_EXCEPTION;
+    }
+    TraceMark *mark = trace_find_mark(str);
+    JS_FreeCString(ctx, str);
+    if (!mark) {
+      return JS_UNDEFINED;
+    }
+    ns[i] = mark->ns;
+  }
+  const char *str = JS_ToCString(ctx, argv[0]);
+  if (!str) {
     return JS_EXCEPTION;
   }
-
-  plutovg_canvas_new_path(s->plutovg_canvas);
+  const char *name = trace_intern(str);
+  JS_FreeCString(ctx, str);
+  if (name && ns[1] >= ns[0]) {
+    trace_push(name, 'X', ns[0])->dur_ns = ns[1] - ns[0];
+  }
   return JS_UNDEFINED;
 }
 
-static JSValue js_canvas_clear(JSContext *ctx, JSValueConst this_val, int argc,
+static const JSCFunctionListEntry js_performance_funcs[] = {
+    JS_CFUNC_DEF("mark", 1, js_performance_mark),
+    JS_CFUNC_DEF("measure", 3, js_performance_measure),
+};
+
+// Adds mark() and measure() to the engine's performance object.
+static int js_trace_init(JSContext *ctx) {
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue performance = JS_GetPropertyStr(ctx, global, "performance");
+  if (!JS_IsObject(performance)) {
+    JS_FreeValue(ctx, performance);
+    performance = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, global, "performance",
+                      JS_DupValue(ctx, performance));
+  }
+  JS_FreeValue(ctx, global);
+  JS_SetPropertyFunctionList(ctx, performance, js_performance_funcs,
+                             countof(js_performance_funcs));
+  JS_FreeValue(ctx, performance);
+  return 0;
+}
+
+// #endregion
+
+// #region bench
+//
+// yanhua_bench is built from this file with YANHUA_BENCH defined. It runs a
+// script for a fixed number of frames on a fixed timestep, with a seeded
+// Math.random and optional synthetic clicks, and reports how long each frame
+// spent in every phase. In every build the phases are also trace spans.
+
+typedef enum {
+  BENCH_JS,      // animation frame callbacks, minus the phases below
+  BENCH_RASTER,  // plutovg drawing, immediate or in canvas_flush()
+  BENCH_UPLOAD,  // copying damaged pixels into the texture
+  BENCH_PRESENT, // rendering the texture and presenting
+  BENCH_GC,      // the collection at the end of the frame
+  BENCH_FRAME,   // the whole tick
+  BENCH_PHASE_COUNT,
+} BenchPhase;
+
+static const char *bench_phase_names[BENCH_PHASE_COUNT] = {
+    "js", "raster", "upload", "present", "gc", "frame",
+};
+
+#ifdef YANHUA_BENCH
+
+typedef struct {
+  uint64_t phase_ns[BENCH_PHASE_COUNT]; // accumulated by the current frame
+  double *samples[BENCH_PHASE_COUNT];   // per frame, in milliseconds
+  int frame_count;
+  int capacity;
+  uint64_t rng;
+  int width; // size of the last canvas, where clicks land
+  int height;
+} Bench;
+
+static Bench bench;
+
+#define BENCH_BEGIN(phase) uint64_t bench_start_##phase = SDL_GetTicksNS()
+#define BENCH_END(phase)                                                       \
+  (bench.phase_ns[phase] += SDL_GetTicksNS() - bench_start_##phase,            \
+   trace_enabled ? trace_span(bench_phase_names[phase], bench_start_##phase)  \
+                 : (void)0)
+#define BENCH_VIEWPORT(w, h) (bench.width = (w), bench.height = (h))
+
+static JSValue js_bench_random(JSContext *ctx, JSValueConst this_val, int argc,
                                JSValueConst *argv) {
-  if (argc != 0) {
-    fprintf(stderr, "canvas.clear() expected 0 arguments, but got %d\n", argc);
-    return JS_EXCEPTION;
+  // 53 random bits, like the engine's own Math.random
+  return JS_NewFloat64(ctx, (xorshift64_next(&bench.rng) >> 11) * 0x1.0p-53);
+}
+
+// Replaces Math.random so that scenes are the same from run to run.
+static int js_bench_init(JSContext *ctx) {
+  xorshift64_seed(&bench.rng, app_options.seed ? app_options.seed : 1);
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue math = JS_GetPropertyStr(ctx, global, "Math");
+  JS_FreeValue(ctx, global);
+  if (JS_IsException(math)) {
+    return -1;
   }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
-    return JS_EXCEPTION;
+  JS_SetPropertyStr(ctx, math, "random",
+                    JS_NewCFunction(ctx, js_bench_random, "random", 0));
+  JS_FreeValue(ctx, math);
+  return 0;
+}
+
+static void bench_frame_begin(int frame) {
+  SDL_memset(bench.phase_ns, 0, sizeof(bench.phase_ns));
+  int every = app_options.click_every;
+  if (every <= 0 || frame % every != 0 || bench.width <= 0) {
+    return;
+  }
+  // somewhere in the upper part of the canvas, where a person would click
+  SDL_Event event = {0};
+  event.type = SDL_EVENT_MOUSE_BUTTON_DOWN;
+  event.button.button = SDL_BUTTON_LEFT;
+  event.button.down = true;
+  event.button.clicks = 1;
+  event.button.x = bench.width * (0.1f + 0.8f * xorshift64_float(&bench.rng));
+  event.button.y = bench.height * (0.1f + 0.5f * xorshift64_float(&bench.rng));
+  SDL_PushEvent(&event);
+}
+
+static void bench_frame_end(uint64_t frame_ns) {
+  if (bench.frame_count == bench.capacity) {
+    int capacity = SDL_max(bench.capacity * 2, 1024);
+    for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+      double *samples = realloc(bench.samples[i], capacity * sizeof(double));
+      if (!samples) {
+        return;
+      }
+      bench.samples[i] = samples;
+    }
+    bench.capacity = capacity;
+  }
+  uint64_t *ns = bench.phase_ns;
+  ns[BENCH_FRAME] = frame_ns;
+  uint64_t native = ns[BENCH_RASTER] + ns[BENCH_UPLOAD] + ns[BENCH_PRESENT] +
+                    ns[BENCH_GC];
+  ns[BENCH_JS] = frame_ns > native ? frame_ns - native : 0;
+  for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+    bench.samples[i][bench.frame_count] = (double)ns[i] / SDL_NS_PER_MS;
+  }
+  bench.frame_count++;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static double bench_percentile(const double *sorted, int count, double p) {
+  int rank = (int)ceil(p / 100 * count);
+  return sorted[SDL_clamp(rank - 1, 0, count - 1)];
+}
+
+// Prints a summary to stderr and writes the JSON report if asked to.
+static int bench_report(void) {
+  int n = bench.frame_count;
+  if (n == 0) {
+    fprintf(stderr, "bench: no frames were rendered\n");
+    return 1;
+  }
+  FILE *json = NULL;
+  if (app_options.json) {
+    json = fopen(app_options.json, "w");
+    if (!json) {
+      perror(app_options.json);
+      return 1;
+    }
+    int v = SDL_GetVersion();
+    // the script path may hold quotes or backslashes
+    fprintf(json, "{\n  \"script\": ");
+    json_write_string(json, app_options.script);
+    fprintf(json,
+            ",\n  \"frames\": %d,\n"
+            "  \"seed\": %" PRIu64 ",\n  \"headless\": %s,\n"
+            "  \"versions\": {\"quickjs\": \"%s\", \"sdl\": \"%d.%d.%d\", "
+            "\"plutovg\": \"%s\"},\n  \"phases\": {",
+            n, app_options.seed ? app_options.seed : 1,
+            app_options.headless ? "true" : "false", QUICKJS_VERSION,
+            SDL_VERSIONNUM_MAJOR(v), SDL_VERSIONNUM_MINOR(v),
+            SDL_VERSIONNUM_MICRO(v), plutovg_version_string());
+  }
+  fprintf(stderr, "%s: %d frames, times in ms\n", app_options.script, n);
+  fprintf(stderr, "%-8s %9s %9s %9s %9s\n", "phase", "mean", "p50", "p95",
+          "p99");
+  for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+    double *samples = bench.samples[i];
+    double sum = 0;
+    for (int j = 0; j < n; j++) {
+      sum += samples[j];
+    }
+    qsort(samples, n, sizeof(double), bench_compare);
+    double mean = sum / n;
+    double p50 = bench_percentile(samples, n, 50);
+    double p95 = bench_percentile(samples, n, 95);
+    double p99 = bench_percentile(samples, n, 99);
+    fprintf(stderr, "%-8s %9.3f %9.3f %9.3f %9.3f\n", bench_phase_names[i],
+            mean, p50, p95, p99);
+    if (json) {
+      fprintf(json,
+              "%s\n    \"%s\": {\"mean\": %.4f, \"p50\": %.4f, "
+              "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+              i ? "," : "", bench_phase_names[i], mean, p50, p95, p99,
+              samples[n - 1]);
+    }
+  }
+  if (json) {
+    fprintf(json, "\n  }\n}\n");
+    fclose(json);
+  }
+  return 0;
+}
+
+static void bench_free(void) {
+  for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+    free(bench.samples[i]);
+    bench.samples[i] = NULL;
+  }
+  bench.frame_count = bench.capacity = 0;
+}
+
+#else
+
+#define BENCH_BEGIN(phase) uint64_t bench_start_##phase = trace_now()
+#define BENCH_END(phase)                                                       \
+  trace_span(bench_phase_names[phase], bench_start_##phase)
+#define BENCH_VIEWPORT(w, h) ((void)0)
+
+#endif
+
+// #endregion
+
+// #region allocator
+//
+// The runtime allocates through a pool of size classes, 16 bytes apart up to
+// 256 bytes, which covers objects, shapes, short strings and property
+// arrays. Freed blocks go back on a per-class free list, so the churn of
+// short-lived objects never reaches malloc. Bigger blocks use malloc.
+// Every block starts with a header that records its class.
+
+#define POOL_GRANULE 16
+#define POOL_CLASSES 16 // up to POOL_GRANULE * POOL_CLASSES bytes
+#define POOL_LARGE POOL_CLASSES
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct {
+  uint32_t size_class;
+  uint32_t unused;
+  size_t size; // usable size
+} PoolHeader;
+
+static_assert(sizeof(PoolHeader) == POOL_GRANULE, "header keeps alignment");
+
+typedef struct PoolBlock {
+  struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct PoolSlab {
+  struct PoolSlab *next;
+} PoolSlab;
+
+typedef struct {
+  PoolBlock *free_list[POOL_CLASSES];
+  PoolSlab *slabs;
+  size_t slab_bytes; // reserved by slabs
+  size_t used_bytes; // handed out, headers included
+} Pool;
+
+static Pool js_pool;
+
+static inline PoolHeader *pool_header(const void *ptr) {
+  return (PoolHeader *)ptr - 1;
+}
+
+// Carves a new slab into blocks of one class.
+static int pool_refill(Pool *pool, int size_class) {
+  size_t block = sizeof(PoolHeader) + (size_class + 1) * POOL_GRANULE;
+  PoolSlab *slab = malloc(POOL_SLAB_SIZE);
+  if (!slab) {
+    return -1;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->slab_bytes += POOL_SLAB_SIZE;
+
+  uint8_t *p = (uint8_t *)slab + POOL_GRANULE;
+  uint8_t *end = (uint8_t *)slab + POOL_SLAB_SIZE;
+  for (; p + block <= end; p += block) {
+    PoolBlock *b = (PoolBlock *)p;
+    b->next = pool->free_list[size_class];
+    pool->free_list[size_class] = b;
+  }
+  return 0;
+}
+
+static void *pool_alloc(Pool *pool, size_t size) {
+  PoolHeader *h;
+  if (size > POOL_GRANULE * POOL_CLASSES) {
+    h = malloc(sizeof(PoolHeader) + size);
+    if (!h) {
+      return NULL;
+    }
+    h->size_class = POOL_LARGE;
+    h->size = size;
+  } else {
+    int size_class = size ? (int)((size - 1) / POOL_GRANULE) : 0;
+    if (!pool->free_list[size_class] && pool_refill(pool, size_class)) {
+      return NULL;
+    }
+    h = (PoolHeader *)pool->free_list[size_class];
+    pool->free_list[size_class] = ((PoolBlock *)h)->next;
+    h->size_class = size_class;
+    h->size = (size_class + 1) * POOL_GRANULE;
+  }
+  pool->used_bytes += sizeof(PoolHeader) + h->size;
+  return h + 1;
+}
+
+static void pool_release(Pool *pool, void *ptr) {
+  PoolHeader *h = pool_header(ptr);
+  pool->used_bytes -= sizeof(PoolHeader) + h->size;
+  if (h->size_class == POOL_LARGE) {
+    free(h);
+    return;
+  }
+  // the link overwrites the header
+  uint32_t size_class = h->size_class;
+  PoolBlock *b = (PoolBlock *)h;
+  b->next = pool->free_list[size_class];
+  pool->free_list[size_class] = b;
+}
+
+static void pool_free(Pool *pool) {
+  while (pool->slabs) {
+    PoolSlab *next = pool->slabs->next;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+  memset(pool, 0, sizeof(*pool));
+}
+
+static size_t js_pool_usable_size(const void *ptr) {
+  return ptr ? pool_header(ptr)->size : 0;
+}
+
+// The JSMallocState counters are what QuickJS compares against the GC
+// threshold, so they are kept exactly like the default allocator does.
+static void *js_pool_malloc(JSMallocState *s, size_t size) {
+  if (s->malloc_size + size > s->malloc_limit) {
+    return NULL;
+  }
+  void *ptr = pool_alloc(s->opaque, size);
+  if (!ptr) {
+    return NULL;
+  }
+  s->malloc_count++;
+  s->malloc_size += js_pool_usable_size(ptr) + sizeof(PoolHeader);
+  return ptr;
+}
+
+static void js_pool_free(JSMallocState *s, void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  s->malloc_count--;
+  s->malloc_size -= js_pool_usable_size(ptr) + sizeof(PoolHeader);
+  pool_release(s->opaque, ptr);
+}
+
+static void *js_pool_realloc(JSMallocState *s, void *ptr, size_t size) {
+  if (!ptr) {
+    return size ? js_pool_malloc(s, size) : NULL;
+  }
+  if (size == 0) {
+    js_pool_free(s, ptr);
+    return NULL;
+  }
+  size_t old_size = js_pool_usable_size(ptr);
+  if (size <= old_size &&
+      (pool_header(ptr)->size_class != POOL_LARGE || size == old_size)) {
+    // a pooled block shrinking or growing within its class stays put
+    return ptr;
+  }
+  if (s->malloc_size + size - old_size > s->malloc_limit) {
+    return NULL;
+  }
+  Pool *pool = s->opaque;
+  if (pool_header(ptr)->size_class == POOL_LARGE &&
+      size > POOL_GRANULE * POOL_CLASSES) {
+    PoolHeader *h = realloc(pool_header(ptr), sizeof(PoolHeader) + size);
+    if (!h) {
+      return NULL;
+    }
+    h->size = size;
+    pool->used_bytes += size - old_size;
+    s->malloc_size += size - old_size;
+    return h + 1;
+  }
+  void *new_ptr = pool_alloc(pool, size);
+  if (!new_ptr) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, SDL_min(old_size, size));
+  s->malloc_size += js_pool_usable_size(new_ptr);
+  s->malloc_size -= old_size;
+  pool_release(pool, ptr);
+  return new_ptr;
+}
+
+static const JSMallocFunctions js_pool_malloc_funcs = {
+    js_pool_malloc,
+    js_pool_free,
+    js_pool_realloc,
+    js_pool_usable_size,
+};
+
+// #endregion
+
+// #region gc
+//
+// QuickJS frees most garbage by reference counting, the cycle collector
+// only has to find cycles, but each run walks every live object. Left to
+// itself it runs whenever an allocation crosses the threshold, which is
+// often in the middle of a frame. Instead, collections are due after the
+// heap grew by a share of its live size and run at the end of a frame, as
+// long as the expected pause fits the budget. The threshold stays well
+// above that, as a backstop for frames that keep deferring.
+
+#define GC_BUDGET_NS (2 * SDL_NS_PER_MS)
+#define GC_MIN_TRIGGER (1024 * 1024)
+#define GC_BACKSTOP 4 // threshold, in triggers above the live size
+
+typedef struct {
+  JSRuntime *rt;
+  size_t live_bytes;    // heap size after the last collection
+  size_t trigger_bytes; // growth that makes a collection due
+  uint64_t estimate_ns; // expected pause, averaged over recent collections
+  size_t threshold;     // last JS_SetGCThreshold(), see gc_frame_end()
+  int collections;
+  int deferred;  // frames that skipped a due collection
+  int backstops; // collections QuickJS ran itself at the threshold
+  uint64_t last_ns;
+  uint64_t max_ns;
+  uint64_t total_ns;
+} GCPolicy;
+
+static GCPolicy gc_policy;
+
+static void gc_policy_reset(GCPolicy *gc) {
+  gc->live_bytes = js_pool.used_bytes;
+  gc->trigger_bytes = SDL_max(gc->live_bytes / 2, GC_MIN_TRIGGER);
+  gc->threshold = gc->live_bytes + GC_BACKSTOP * gc->trigger_bytes;
+  JS_SetGCThreshold(gc->rt, gc->threshold);
+}
+
+static void gc_collect(GCPolicy *gc) {
+  uint64_t start = SDL_GetTicksNS();
+  JS_RunGC(gc->rt);
+  uint64_t ns = SDL_GetTicksNS() - start;
+  gc->collections++;
+  gc->last_ns = ns;
+  gc->max_ns = SDL_max(gc->max_ns, ns);
+  gc->total_ns += ns;
+  gc->estimate_ns = gc->estimate_ns ? (gc->estimate_ns * 3 + ns) / 4 : ns;
+  gc_policy_reset(gc);
+}
+
+// Called once the callbacks of a frame have run.
+static void gc_frame_end(void) {
+  GCPolicy *gc = &gc_policy;
+  if (JS_GetGCThreshold(gc->rt) != gc->threshold) {
+    // the backstop fired during the frame and QuickJS set its own threshold
+    // of 1.5 times the live size; start over from the new live size
+    gc->backstops++;
+    gc_policy_reset(gc);
+  }
+  size_t heap = js_pool.used_bytes;
+  size_t growth = heap > gc->live_bytes ? heap - gc->live_bytes : 0;
+  if (growth < gc->trigger_bytes) {
+    return;
+  }
+  // past half of the backstop, collecting late beats a mid-frame pause
+  bool overdue = growth >= gc->trigger_bytes * GC_BACKSTOP / 2;
+  if (gc->estimate_ns > GC_BUDGET_NS && !overdue) {
+    gc->deferred++;
+    return;
+  }
+  BENCH_BEGIN(BENCH_GC);
+  gc_collect(gc);
+  BENCH_END(BENCH_GC);
+}
+
+static JSValue js_gc_collect(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+  gc_collect(&gc_policy);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_gc_stats(JSContext *ctx, JSValueConst this_val, int argc,
+                           JSValueConst *argv) {
+  GCPolicy *gc = &gc_policy;
+  JSValue obj = JS_NewObject(ctx);
+  if (JS_IsException(obj)) {
+    return obj;
+  }
+  struct {
+    const char *name;
+    double value;
+  } fields[] = {
+      {"collections", gc->collections},
+      {"deferred", gc->deferred},
+      {"backstops", gc->backstops},
+      {"lastPause", (double)gc->last_ns / SDL_NS_PER_MS},
+      {"maxPause", (double)gc->max_ns / SDL_NS_PER_MS},
+      {"totalPause", (double)gc->total_ns / SDL_NS_PER_MS},
+      {"budget", (double)GC_BUDGET_NS / SDL_NS_PER_MS},
+      {"heapBytes", js_pool.used_bytes},
+      {"liveBytes", gc->live_bytes},
+      {"poolBytes", js_pool.slab_bytes},
+      {"threshold", JS_GetGCThreshold(gc->rt)},
+  };
+  for (size_t i = 0; i < countof(fields); i++) {
+    JS_SetPropertyStr(ctx, obj, fields[i].name,
+                      JS_NewFloat64(ctx, fields[i].value));
+  }
+  return obj;
+}
+
+static const JSCFunctionListEntry js_gc_funcs[] = {
+    JS_CFUNC_DEF("collect", 0, js_gc_collect),
+    JS_CFUNC_DEF("stats", 0, js_gc_stats),
+};
+
+static int js_gc_init(JSContext *ctx) {
+  gc_policy.rt = JS_GetRuntime(ctx);
+  gc_policy_reset(&gc_policy);
+
+  JSValue gc = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, gc, js_gc_funcs, countof(js_gc_funcs));
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyStr(ctx, global, "gc", gc);
+  JS_FreeValue(ctx, global);
+  return 0;
+}
+
+// #endregion
+
+// #region FrameScheduler
+//
+// requestAnimationFrame() callbacks run from a tick queued with
+// os.setTimeout, so js_std_loop keeps servicing timers, promises and I/O
+// between frames. Ticks are paced by the vsync of the canvas when the last
+// frame was presented, and by a deadline timer otherwise. In headless mode
+// ticks run back to back and timestamps advance by a fixed step instead.
+//
+// A window that presented nothing for FRAME_IDLE_AFTER ticks in a row is
+// idle: ticks only pump SDL events every FRAME_IDLE_POLL_MS and run the
+// frame as soon as input arrives, or FRAME_IDLE_SLICE_MS after the last
+// one. The callbacks keep running at that rate, so a script that only draws
+// now and then (a clock, a ticker) still sees time pass. Nothing blocks in
+// between: js_std_loop sleeps in select() until the next poll, and os
+// timers and I/O handlers such as the one of loadImage() run on time.
+//
+// SDL only collects window input while the main thread pumps it, so the
+// loop cannot simply wait on a descriptor for input.
+
+#define FRAME_IDLE_AFTER 30
+#define FRAME_IDLE_SLICE_MS 100
+#define FRAME_IDLE_POLL_MS 10
+
+typedef struct {
+  int id;
+  JSValue func;
+} FrameCallback;
+
+typedef struct {
+  FrameCallback *callbacks;
+  int count;
+  int capacity;
+  int next_id;
+
+  bool armed;              // a tick is queued on the os timer list
+  uint64_t period_ns;      // refresh period of the display
+  uint64_t deadline_ns;    // when the next frame should start
+  bool vsync;              // canvases present with vsync
+  bool presented;          // a canvas presented since the last tick ended
+  bool fixed_step;         // headless: never sleep, time advances by period_ns
+  int frame_count;         // ticks run so far
+  int frame_limit;         // callbacks are dropped after this many ticks
+  uint64_t frame_start_ns; // when the current tick started its callbacks
+  int quiet_frames;        // ticks in a row that presented nothing
+
+  // callbacks of the frame being run, so that cancelAnimationFrame() can
+  // still cancel the ones that did not run yet
+  FrameCallback *running;
+  int running_count;
+
+  JSValue set_timeout; // os.setTimeout, looked up on first use
+  JSValue tick;
+} FrameScheduler;
+
+static FrameScheduler frame_scheduler;
+
+// Called by canvases with the refresh rate of their display.
+static void frame_scheduler_set_display(float refresh_rate, bool vsync) {
+  if (refresh_rate > 0 && !frame_scheduler.fixed_step) {
+    frame_scheduler.period_ns = (uint64_t)(SDL_NS_PER_SECOND / refresh_rate);
+  }
+  frame_scheduler.vsync = vsync;
+}
+
+static int frame_scheduler_arm(JSContext *ctx) {
+  FrameScheduler *fs = &frame_scheduler;
+  if (fs->armed) {
+    return 0;
+  }
+  if (JS_IsUndefined(fs->set_timeout)) {
+    JSValue global = JS_GetGlobalObject(ctx);
+    JSValue os = JS_GetPropertyStr(ctx, global, "os");
+    JS_FreeValue(ctx, global);
+    if (JS_IsException(os)) {
+      return -1;
+    }
+    fs->set_timeout = JS_GetPropertyStr(ctx, os, "setTimeout");
+    JS_FreeValue(ctx, os);
+    if (JS_IsException(fs->set_timeout)) {
+      fs->set_timeout = JS_UNDEFINED;
+      return -1;
+    }
+  }
+  // os timers have millisecond resolution, the tick sleeps the remainder
+  uint64_t now = SDL_GetTicksNS();
+  int64_t delay_ms = 0;
+  if (!fs->fixed_step && fs->deadline_ns > now) {
+    delay_ms = (fs->deadline_ns - now) / SDL_NS_PER_MS;
+  }
+  JSValue args[2] = {fs->tick, JS_NewInt64(ctx, delay_ms)};
+  JSValue ret = JS_Call(ctx, fs->set_timeout, JS_UNDEFINED, 2, args);
+  if (JS_IsException(ret)) {
+    return -1;
+  }
+  JS_FreeValue(ctx, ret);
+  fs->armed = true;
+  return 0;
+}
+
+static JSValue js_frame_scheduler_tick(JSContext *ctx, JSValueConst this_val,
+                                       int argc, JSValueConst *argv) {
+  FrameScheduler *fs = &frame_scheduler;
+  // stays set while the callbacks run so that requests made by them wait
+  // for the next deadline computed below
+  fs->armed = true;
+
+  if (!fs->fixed_step && fs->quiet_frames >= FRAME_IDLE_AFTER) {
+    // events are left in the queue for the script
+    SDL_PumpEvents();
+    uint64_t now = SDL_GetTicksNS();
+    if (SDL_HasEvents(SDL_EVENT_FIRST, SDL_EVENT_LAST)) {
+      fs->quiet_frames = 0;
+    } else if (now - fs->frame_start_ns <
+               FRAME_IDLE_SLICE_MS * SDL_NS_PER_MS) {
+      fs->armed = false;
+      fs->deadline_ns = now + FRAME_IDLE_POLL_MS * SDL_NS_PER_MS;
+      if (frame_scheduler_arm(ctx)) {
+        return JS_EXCEPTION;
+      }
+      return JS_UNDEFINED;
+    }
+    // input does not wait for the next deadline, and the end of a slice
+    // runs the frame at the idle rate
+    fs->deadline_ns = now;
+  }
+
+  uint64_t now = SDL_GetTicksNS();
+  if (!fs->fixed_step && fs->deadline_ns > now) {
+    SDL_DelayPrecise(fs->deadline_ns - now);
+    now = SDL_GetTicksNS();
+  }
+  uint64_t time_ns = now;
+  fs->frame_start_ns = now;
+  if (fs->fixed_step) {
+    time_ns = (uint64_t)fs->frame_count * fs->period_ns;
+  }
+#ifdef YANHUA_BENCH
+  bench_frame_begin(fs->frame_count);
+#endif
+
+  // callbacks requested from now on belong to the next frame
+  FrameCallback *callbacks = fs->callbacks;
+  int count = fs->count;
+  fs->callbacks = NULL;
+  fs->count = 0;
+  fs->capacity = 0;
+
+  fs->running = callbacks;
+  fs->running_count = count;
+  JSValue timestamp = JS_NewFloat64(ctx, (double)time_ns / SDL_NS_PER_MS);
+  for (int i = 0; i < count; i++) {
+    // undefined once run or cancelled
+    JSValue func = callbacks[i].func;
+    if (JS_IsUndefined(func)) {
+      continue;
+    }
+    callbacks[i].func = JS_UNDEFINED;
+    JSValue ret = JS_Call(ctx, func, JS_UNDEFINED, 1, &timestamp);
+    if (JS_IsException(ret)) {
+      js_std_dump_error(ctx);
+    }
+    JS_FreeValue(ctx, ret);
+    JS_FreeValue(ctx, func);
+  }
+  JS_FreeValue(ctx, timestamp);
+  fs->running = NULL;
+  fs->running_count = 0;
+  free(callbacks);
+  fs->quiet_frames = fs->presented ? 0 : fs->quiet_frames + 1;
+  gc_frame_end();
+#ifdef YANHUA_BENCH
+  bench_frame_end(SDL_GetTicksNS() - now);
+#endif
+  trace_frame_end(JS_GetRuntime(ctx), now);
+
+  fs->frame_count++;
+  if (fs->frame_limit > 0 && fs->frame_count >= fs->frame_limit) {
+    // nothing is rearmed, so js_std_loop returns once other work is done
+    for (int i = 0; i < fs->count; i++) {
+      JS_FreeValue(ctx, fs->callbacks[i].func);
+    }
+    fs->count = 0;
+  }
+  if (fs->presented && fs->vsync) {
+    // the present already waited for the vertical blank
+    fs->deadline_ns = SDL_GetTicksNS();
+  } else {
+    fs->deadline_ns += fs->period_ns;
+    if (fs->deadline_ns < now) {
+      // fell behind by more than a frame, do not try to catch up
+      fs->deadline_ns = now + fs->period_ns;
+    }
+  }
+  // cleared only here, so that a show() from a timer or an I/O callback
+  // between ticks counts as well
+  fs->presented = false;
+  fs->armed = false;
+  if (fs->count > 0 && frame_scheduler_arm(ctx)) {
+    return JS_EXCEPTION;
+  }
+  return JS_UNDEFINED;
+}
+
+static JSValue js_request_animation_frame(JSContext *ctx,
+                                          JSValueConst this_val, int argc,
+                                          JSValueConst *argv) {
+  FrameScheduler *fs = &frame_scheduler;
+  if (argc != 1 || !JS_IsFunction(ctx, argv[0])) {
+    return JS_ThrowTypeError(ctx, "requestAnimationFrame() expects a function");
+  }
+  if (fs->frame_limit > 0 && fs->frame_count >= fs->frame_limit) {
+    return JS_NewInt32(ctx, 0);
+  }
+  if (fs->count == fs->capacity) {
+    int capacity = SDL_max(fs->capacity * 2, 16);
+    FrameCallback *callbacks =
+        realloc(fs->callbacks, capacity * sizeof(FrameCallback));
+    if (!callbacks) {
+      return JS_ThrowOutOfMemory(ctx);
+    }
+    fs->callbacks = callbacks;
+    fs->capacity = capacity;
+  }
+  if (frame_scheduler_arm(ctx)) {
+    return JS_EXCEPTION;
+  }
+  FrameCallback *cb = &fs->callbacks[fs->count++];
+  cb->id = ++fs->next_id;
+  cb->func = JS_DupValue(ctx, argv[0]);
+  return JS_NewInt32(ctx, cb->id);
+}
+
+static JSValue js_cancel_animation_frame(JSContext *ctx, JSValueConst this_val,
+                                         int argc, JSValueConst *argv) {
+  FrameScheduler *fs = &frame_scheduler;
+  if (argc != 1) {
+    fprintf(stderr,
+            "cancelAnimationFrame() expected 1 argument, but got %d\n", argc);
+    return JS_EXCEPTION;
+  }
+  int32_t id;
+  if (JS_ToInt32(ctx, &id, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  // a callback of the current frame that has not run yet
+  for (int i = 0; i < fs->running_count; i++) {
+    if (fs->running[i].id == id) {
+      JS_FreeValue(ctx, fs->running[i].func);
+      fs->running[i].func = JS_UNDEFINED;
+      return JS_UNDEFINED;
+    }
+  }
+  for (int i = 0; i < fs->count; i++) {
+    if (fs->callbacks[i].id == id) {
+      JS_FreeValue(ctx, fs->callbacks[i].func);
+      memmove(&fs->callbacks[i], &fs->callbacks[i + 1],
+              (fs->count - i - 1) * sizeof(FrameCallback));
+      fs->count--;
+      break;
+    }
+  }
+  return JS_UNDEFINED;
+}
+
+static const JSCFunctionListEntry js_frame_scheduler_funcs[] = {
+    JS_CFUNC_DEF("requestAnimationFrame", 1, js_request_animation_frame),
+    JS_CFUNC_DEF("cancelAnimationFrame", 1, js_cancel_animation_frame),
+};
+
+static int js_frame_scheduler_init(JSContext *ctx) {
+  FrameScheduler *fs = &frame_scheduler;
+  fs->period_ns = SDL_NS_PER_SECOND / 60;
+#ifdef YANHUA_BENCH
+  // benchmarks never wait for the display
+  fs->fixed_step = true;
+  fs->period_ns = (uint64_t)(SDL_NS_PER_SECOND / app_options.fps);
+#endif
+  if (app_options.headless) {
+    fs->fixed_step = true;
+    fs->period_ns = (uint64_t)(SDL_NS_PER_SECOND / app_options.fps);
+  }
+  fs->frame_limit = app_options.frames;
+  fs->set_timeout = JS_UNDEFINED;
+  fs->tick = JS_NewCFunction(ctx, js_frame_scheduler_tick, "frameTick", 0);
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyFunctionList(ctx, global, js_frame_scheduler_funcs,
+                             countof(js_frame_scheduler_funcs));
+  JS_FreeValue(ctx, global);
+  return 0;
+}
+
+static void js_frame_scheduler_free(JSContext *ctx) {
+  FrameScheduler *fs = &frame_scheduler;
+  for (int i = 0; i < fs->count; i++) {
+    JS_FreeValue(ctx, fs->callbacks[i].func);
+  }
+  free(fs->callbacks);
+  fs->callbacks = NULL;
+  fs->count = fs->capacity = 0;
+  JS_FreeValue(ctx, fs->set_timeout);
+  JS_FreeValue(ctx, fs->tick);
+  fs->set_timeout = fs->tick = JS_UNDEFINED;
+}
+
+// #endregion
+
+// #region Path2D
+//
+// Path2D keeps its geometry in a plutovg_path_t that survives across frames.
+// Paths with curves also keep a few flattened copies, one per device scale
+// they were drawn at, so that filling a static shape every frame does no
+// curve subdivision after the first one. Recorded deferred commands hold a
+// reference to the path, which is why editing a shared path copies it first.
+
+// flattened copies kept per path, replaced round-robin
+#define PATH2D_FLATTENINGS 4
+// scales are bucketed by quarter powers of two
+#define PATH2D_SCALE_STEPS 4.0f
+
+typedef struct {
+  float scale;          // device pixels per path unit it was flattened for
+  plutovg_path_t *path; // line segments only, in path units times scale
+} Path2DFlattening;
+
+typedef struct {
+  plutovg_path_t *path;
+  bool has_curves;
+  Path2DFlattening flat[PATH2D_FLATTENINGS];
+  int flat_next;
+} JSPath2D;
+
+static JSClassID js_path2d_class_id;
+
+static void path2d_invalidate(JSPath2D *p) {
+  for (int i = 0; i < PATH2D_FLATTENINGS; i++) {
+    if (p->flat[i].path) {
+      plutovg_path_destroy(p->flat[i].path);
+      p->flat[i].path = NULL;
+    }
+  }
+}
+
+// Called before every edit.
+static void path2d_prepare_edit(JSPath2D *p) {
+  path2d_invalidate(p);
+  if (plutovg_path_get_reference_count(p->path) > 1) {
+    plutovg_path_t *path = plutovg_path_clone(p->path);
+    plutovg_path_destroy(p->path);
+    p->path = path;
+  }
+}
+
+// Returns the geometry to draw at the given device scale, and the scale it
+// was built for: the path itself with 1 when it has no curves.
+static plutovg_path_t *path2d_geometry(JSPath2D *p, float scale,
+                                       float *built_scale) {
+  *built_scale = 1;
+  if (!p->has_curves || !(scale > 0) || !isfinite(scale)) {
+    return p->path;
+  }
+  float steps = roundf(log2f(scale) * PATH2D_SCALE_STEPS);
+  float bucket = exp2f(steps / PATH2D_SCALE_STEPS);
+  for (int i = 0; i < PATH2D_FLATTENINGS; i++) {
+    if (p->flat[i].path && p->flat[i].scale == bucket) {
+      *built_scale = bucket;
+      return p->flat[i].path;
+    }
+  }
+  plutovg_path_t *scaled = plutovg_path_clone(p->path);
+  plutovg_matrix_t matrix;
+  plutovg_matrix_init_scale(&matrix, bucket, bucket);
+  plutovg_path_transform(scaled, &matrix);
+  plutovg_path_t *flat = plutovg_path_clone_flatten(scaled);
+  plutovg_path_destroy(scaled);
+
+  Path2DFlattening *slot = &p->flat[p->flat_next];
+  p->flat_next = (p->flat_next + 1) % PATH2D_FLATTENINGS;
+  if (slot->path) {
+    plutovg_path_destroy(slot->path);
+  }
+  slot->scale = bucket;
+  slot->path = flat;
+  *built_scale = bucket;
+  return flat;
+}
+
+static void js_path2d_finalizer(JSRuntime *rt, JSValue val) {
+  JSPath2D *p = JS_GetOpaque(val, js_path2d_class_id);
+  /* Note: 'p' can be NULL in case JS_SetOpaque() was not called */
+  if (p) {
+    path2d_invalidate(p);
+    plutovg_path_destroy(p->path);
+  }
+  js_free_rt(rt, p);
+}
+
+// new Path2D() or new Path2D(path), which copies path.
+static JSValue js_path2d_ctor(JSContext *ctx, JSValueConst new_target,
+                              int argc, JSValueConst *argv) {
+  JSPath2D *p;
+  JSValue obj = JS_UNDEFINED;
+  JSValue proto;
+
+  p = js_mallocz(ctx, sizeof(*p));
+  if (!p) {
+    return JS_EXCEPTION;
+  }
+  if (argc > 0 && !JS_IsUndefined(argv[0])) {
+    JSPath2D *other = JS_GetOpaque2(ctx, argv[0], js_path2d_class_id);
+    if (!other) {
+      goto fail;
+    }
+    p->path = plutovg_path_clone(other->path);
+    p->has_curves = other->has_curves;
+  } else {
+    p->path = plutovg_path_create();
+  }
+
+  /* using new_target to get the prototype is necessary when the
+   class is extended. */
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  if (JS_IsException(proto)) {
+    goto fail;
+  }
+  obj = JS_NewObjectProtoClass(ctx, proto, js_path2d_class_id);
+  JS_FreeValue(ctx, proto);
+  if (JS_IsException(obj)) {
+    goto fail;
+  }
+  JS_SetOpaque(obj, p);
+  return obj;
+fail:
+  if (p->path) {
+    plutovg_path_destroy(p->path);
+  }
+  js_free(ctx, p);
+  JS_FreeValue(ctx, obj);
+  return JS_EXCEPTION;
+}
+
+static JSClassDef js_path2d_class = {
+    "Path2D",
+    .finalizer = js_path2d_finalizer,
+};
+
+// Converts up to count numeric arguments, for the builder methods below.
+static int js_path2d_args(JSContext *ctx, const char *name, int argc,
+                          JSValueConst *argv, int count, float *out) {
+  if (argc < count) {
+    fprintf(stderr, "path.%s() expected %d arguments, but got %d\n", name,
+            count, argc);
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    double v;
+    if (JS_ToFloat64(ctx, &v, argv[i])) {
+      return -1;
+    }
+    out[i] = v;
+  }
+  return 0;
+}
+
+static JSValue js_path2d_arc(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  float a[5];
+  if (!p || js_path2d_args(ctx, "arc", argc, argv, 5, a)) {
+    return JS_EXCEPTION;
+  }
+  bool counterclockwise = argc > 5 && JS_ToBool(ctx, argv[5]);
+  path2d_prepare_edit(p);
+  plutovg_path_add_arc(p->path, a[0], a[1], a[2], a[3], a[4],
+                       counterclockwise);
+  p->has_curves = true;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_path2d_bezier_curve_to(JSContext *ctx, JSValueConst this_val,
+                                         int argc, JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  float a[6];
+  if (!p || js_path2d_args(ctx, "bezierCurveTo", argc, argv, 6, a)) {
+    return JS_EXCEPTION;
+  }
+  path2d_prepare_edit(p);
+  plutovg_path_cubic_to(p->path, a[0], a[1], a[2], a[3], a[4], a[5]);
+  p->has_curves = true;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_path2d_close_path(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  if (!p) {
+    return JS_EXCEPTION;
+  }
+  path2d_prepare_edit(p);
+  plutovg_path_close(p->path);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_path2d_line_to(JSContext *ctx, JSValueConst this_val,
+                                 int argc, JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  float a[2];
+  if (!p || js_path2d_args(ctx, "lineTo", argc, argv, 2, a)) {
+    return JS_EXCEPTION;
+  }
+  path2d_prepare_edit(p);
+  plutovg_path_line_to(p->path, a[0], a[1]);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_path2d_move_to(JSContext *ctx, JSValueConst this_val,
+                                 int argc, JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  float a[2];
+  if (!p || js_path2d_args(ctx, "moveTo", argc, argv, 2, a)) {
+    return JS_EXCEPTION;
+  }
+  path2d_prepare_edit(p);
+  plutovg_path_move_to(p->path, a[0], a[1]);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_path2d_quadratic_curve_to(JSContext *ctx,
+                                            JSValueConst this_val, int argc,
+                                            JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  float a[4];
+  if (!p || js_path2d_args(ctx, "quadraticCurveTo", argc, argv, 4, a)) {
+    return JS_EXCEPTION;
+  }
+  path2d_prepare_edit(p);
+  plutovg_path_quad_to(p->path, a[0], a[1], a[2], a[3]);
+  p->has_curves = true;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_path2d_rect(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+  JSPath2D *p = JS_GetOpaque2(ctx, this_val, js_path2d_class_id);
+  float a[4];
+  if (!p || js_path2d_args(ctx, "rect", argc, argv, 4, a)) {
+    return JS_EXCEPTION;
+  }
+  path2d_prepare_edit(p);
+  plutovg_path_add_rect(p->path, a[0], a[1], a[2], a[3]);
+  return JS_UNDEFINED;
+}
+
+static const JSCFunctionListEntry js_path2d_proto_funcs[] = {
+    JS_CFUNC_DEF("arc", 6, js_path2d_arc),
+    JS_CFUNC_DEF("bezierCurveTo", 6, js_path2d_bezier_curve_to),
+    JS_CFUNC_DEF("closePath", 0, js_path2d_close_path),
+    JS_CFUNC_DEF("lineTo", 2, js_path2d_line_to),
+    JS_CFUNC_DEF("moveTo", 2, js_path2d_move_to),
+    JS_CFUNC_DEF("quadraticCurveTo", 4, js_path2d_quadratic_curve_to),
+    JS_CFUNC_DEF("rect", 4, js_path2d_rect),
+};
+
+static int js_path2d_init(JSContext *ctx) {
+  JSValue path2d_proto, path2d_class;
+
+  JS_NewClassID(&js_path2d_class_id);
+  JS_NewClass(JS_GetRuntime(ctx), js_path2d_class_id, &js_path2d_class);
+
+  path2d_proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, path2d_proto, js_path2d_proto_funcs,
+                             countof(js_path2d_proto_funcs));
+
+  path2d_class = JS_NewCFunction2(ctx, js_path2d_ctor, "Path2D", 1,
+                                  JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, path2d_class, path2d_proto);
+  JS_SetClassProto(ctx, js_path2d_class_id, path2d_proto);
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyStr(ctx, global, "Path2D", path2d_class);
+  JS_FreeValue(ctx, global);
+  return 0;
+}
+
+// #endregion
+
+// #region JSCanvas
+
+typedef struct {
+  SDL_Color color;
+} Style;
+
+// upper bound of separate rectangles uploaded by one show()
+#define CANVAS_MAX_DIRTY_RECTS 16
+
+typedef enum {
+  CANVAS_COMMAND_CLEAR,
+  CANVAS_COMMAND_CIRCLE,
+  CANVAS_COMMAND_RECT,
+  CANVAS_COMMAND_LINE,
+  CANVAS_COMMAND_PATH,   // fill
+  CANVAS_COMMAND_STROKE, // stroke of a path
+  CANVAS_COMMAND_MUL_ADD, // whole-surface kernel, see canvas_mul_add()
+} CanvasCommandType;
+
+// A draw call recorded in deferred mode, with the state it needs to be
+// replayed by any tile.
+typedef struct {
+  CanvasCommandType type;
+  plutovg_operator_t op;
+  plutovg_color_t color;
+  float opacity;
+  float line_width;
+  plutovg_matrix_t matrix;
+  SDL_Rect bounds; // device pixels touched, used to skip tiles
+  union {
+    struct {
+      float x, y, radius;
+      const struct CanvasStamp *stamp; // drawn instead of the path if set
+      int px, py;
+    } circle;
+    plutovg_rect_t rect;
+    struct {
+      float x0, y0, x1, y1;
+    } line;
+    plutovg_path_t *path;
+    struct {
+      uint32_t add, factors;
+    } mul_add;
+  } u;
+} CanvasCommand;
+
+typedef struct {
+  int y0;
+  int y1;
+  plutovg_surface_t *surface; // rows [y0, y1) of the canvas pixels
+  plutovg_canvas_t *canvas;
+} CanvasTile;
+
+// Worker pool replaying the recorded commands of one canvas, one band of
+// rows at a time. The thread calling canvas_flush() works as well.
+typedef struct CanvasRaster {
+  struct JSCanvas *owner;
+  int thread_count;
+  SDL_Thread **threads;
+  int tile_count;
+  CanvasTile *tiles;
+  SDL_AtomicInt next_tile;
+
+  SDL_Mutex *mutex;
+  SDL_Condition *work_cond;
+  SDL_Condition *done_cond;
+  int generation; // bumped for every flush
+  int busy;       // workers still replaying the current generation
+  bool quit;
+} CanvasRaster;
+
+// Triangles of the geometry backend waiting for one SDL_RenderGeometry()
+// call, all drawn with the same blend mode.
+typedef struct {
+  SDL_Vertex *vertices;
+  int *indices;
+  int vertex_count;
+  int vertex_capacity;
+  int index_count;
+  int index_capacity;
+  SDL_BlendMode mode;
+  bool failed; // out of memory or a renderer error during the render
+} GeometryBatch;
+
+// Pixel memory, shared with the ArrayBuffers returned by canvas.pixels so
+// that it stays valid for as long as any of them can reach it.
+typedef struct {
+  int refcount;
+  void *data;
+} CanvasPixels;
+
+typedef struct JSCanvas {
+  // size of the pixel buffer, the view size times resolution_scale
+  int width;
+  int height;
+  // size in canvas units, what scripts draw in and events are reported in
+  int view_width;
+  int view_height;
+  float resolution_scale;
+  Style fill_style;
+  // canvas.font, NULL for the default; its face is looked up on first use
+  char *font;
+  int font_face; // index + 1 in text_faces, 0 until looked up
+  float font_size;
+
+  SDL_Window *window;
+  SDL_Renderer *renderer;
+  // long-lived streaming texture, recreated only when the size changes; a
+  // render target with the geometry backend
+  SDL_Texture *texture;
+
+  void *pixels; // pixel buffer shared with plutovg_surface
+  CanvasPixels *pixel_store; // owns pixels
+  JSValue pixels_buffer;     // canvas.pixels, created on first use
+  plutovg_surface_t *plutovg_surface;
+  plutovg_canvas_t *plutovg_canvas;
+  plutovg_color_t paint; // color last given to plutovg_canvas
+
+  // what arc() and beginPath() built, so that fill() can draw a path made
+  // of a single full circle with the stamp cache
+  bool path_empty;
+  bool path_is_circle;
+  float path_circle[3]; // x, y, radius
+
+  // deferred mode: draw calls are recorded and rasterized by tiles in show()
+  bool deferred;
+  int thread_count; // 0 picks one per logical core
+  CanvasCommand *commands;
+  int command_count;
+  int command_capacity;
+  CanvasRaster *raster;
+
+  // geometry backend: deferred commands drawn by the renderer
+  bool geometry;
+  bool geometry_upload; // s->pixels changed after the texture
+  GeometryBatch batch;
+
+  // damage accumulated since the last show(), in pixels
+  SDL_Rect dirty_rects[CANVAS_MAX_DIRTY_RECTS];
+  int dirty_count;
+  bool dirty_all;
+
+  // offscreen canvases have no window, show() writes the frame to output
+  bool offscreen;
+  bool layer; // an OffscreenCanvas: transparent, drawn into other canvases
+  char *output;         // NULL keeps the frames in memory
+  FILE *output_file;    // raw RGBA stream
+  uint8_t *output_rgba; // frame converted for the raw stream
+  int frame_index;
+
+  // the view follows the window size
+  bool resize;
+  // dynamic resolution: resolution_scale is picked by show() to hold the
+  // frame time, and the renderer scales the texture up to the window
+  uint64_t target_frame_ns; // 0 leaves resolution_scale alone
+  float min_scale;
+  double frame_ns_avg;
+  int frames_since_change;
+  uint64_t last_present_ns;
+
+  // --record: id in the stream and the state last written there
+  uint32_t record_id;
+  plutovg_color_t record_paint;
+  float record_opacity;
+  float record_line_width;
+  bool record_pixels; // canvas.pixels was handed out
+} JSCanvas;
+
+static JSClassID js_canvas_class_id;
+
+static void canvas_invalidate_all(JSCanvas *s) {
+  s->dirty_all = true;
+  s->dirty_count = 0;
+}
+
+static int rect_area(const SDL_Rect *r) { return r->w * r->h; }
+
+// Adds [x0, x1) x [y0, y1) to the damage region. Overlapping rectangles are
+// merged, and once the list is full the new rectangle is folded into the
+// entry that grows the least.
+static void canvas_add_damage(JSCanvas *s, int x0, int y0, int x1, int y1) {
+  x0 = SDL_max(x0, 0);
+  y0 = SDL_max(y0, 0);
+  x1 = SDL_min(x1, s->width);
+  y1 = SDL_min(y1, s->height);
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  TRACE_COUNT(pixels, (uint64_t)(x1 - x0) * (y1 - y0));
+  if (s->dirty_all) {
+    return;
+  }
+  SDL_Rect rect = {.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+  for (;;) {
+    int merge = -1;
+    for (int i = 0; i < s->dirty_count; i++) {
+      if (SDL_HasRectIntersection(&rect, &s->dirty_rects[i])) {
+        merge = i;
+        break;
+      }
+    }
+    if (merge < 0 && s->dirty_count == CANVAS_MAX_DIRTY_RECTS) {
+      int best_growth = 0;
+      for (int i = 0; i < s->dirty_count; i++) {
+        SDL_Rect u;
+        SDL_GetRectUnion(&rect, &s->dirty_rects[i], &u);
+        int growth = rect_area(&u) - rect_area(&s->dirty_rects[i]);
+        if (merge < 0 || growth < best_growth) {
+          merge = i;
+          best_growth = growth;
+        }
+      }
+    }
+    if (merge < 0) {
+      break;
+    }
+    SDL_GetRectUnion(&rect, &s->dirty_rects[merge], &rect);
+    s->dirty_rects[merge] = s->dirty_rects[--s->dirty_count];
+  }
+  if (rect.w == s->width && rect.h == s->height) {
+    canvas_invalidate_all(s);
+    return;
+  }
+  s->dirty_rects[s->dirty_count++] = rect;
+}
+
+// Adds device extents reported by plutovg, widened to whole pixels so
+// that anti-aliased edges are covered.
+static void canvas_add_damage_extents(JSCanvas *s,
+                                      const plutovg_rect_t *extents) {
+  if (extents->w <= 0 || extents->h <= 0) {
+    return;
+  }
+  canvas_add_damage(s, (int)floorf(extents->x), (int)floorf(extents->y),
+                    (int)ceilf(extents->x + extents->w) + 1,
+                    (int)ceilf(extents->y + extents->h) + 1);
+}
+
+// #endregion
+
+// #region recorder
+//
+// --record FILE writes every drawing operation of every canvas into one
+// binary stream, with a marker for each show(), so that --replay FILE can
+// drive the same drawing core without any JS. Records are captured where the
+// bindings end up, below the fast paths that pick them, so a replay takes
+// the same path through the rasterizer.
+//
+// The stream starts with "YREC" and a version, then every record is an
+// opcode byte followed by its fields in native byte order:
+//   CANVAS     u32 id, i32 width, i32 height, f32 scale, u8 flags, i32 threads
+//   TARGET     u32 id; later records draw into that canvas
+//   FRAME      u64 nanoseconds since the recording started
+//   PAINT      f32 r, g, b, a
+//   OPACITY    f32
+//   LINE_WIDTH f32
+//   CLEAR
+//   MUL_ADD    u32 add, u32 factors
+//   CIRCLE     f32 x, y, radius
+//   RECT       f32 x, y, width, height, u8 operator
+//   LINE       f32 x0, y0, x1, y1, width
+//   FILL, STROKE                  path
+//   FILL_PATH2D, STROKE_PATH2D    u8 has transform, [f32 a..f], path
+//   PIXELS     i32 x, y, width, height, width * height premultiplied ARGB32
+//   RESIZE     i32 width, i32 height, f32 scale
+//   DRAW_CANVAS u32 layer id, f32 x, y, alpha
+//   FONT       u32 face index, string file path; not tied to a canvas
+//   TEXT       u32 face index, f32 size, x, y, string UTF-8 text
+//   IMAGE      u32 image id, i32 width, height, width * height premultiplied
+//              ARGB32; not tied to a canvas, written before the first use
+//   DRAW_IMAGE u32 image id, f32 sx, sy, sw, sh, dx, dy, dw, dh
+// A string is a u32 byte count followed by the bytes.
+// A path is a u32 element count, then per element a u8 command, a u8 point
+// count and the points as f32 pairs. Paint, opacity and line width are
+// written when they differ from what the canvas last recorded.
+
+#define RECORD_MAGIC "YREC"
+#define RECORD_VERSION 1
+
+typedef enum {
+  RECORD_CANVAS = 1,
+  RECORD_TARGET,
+  RECORD_FRAME,
+  RECORD_PAINT,
+  RECORD_OPACITY,
+  RECORD_LINE_WIDTH,
+  RECORD_CLEAR,
+  RECORD_MUL_ADD,
+  RECORD_CIRCLE,
+  RECORD_RECT,
+  RECORD_LINE,
+  RECORD_FILL,
+  RECORD_STROKE,
+  RECORD_FILL_PATH2D,
+  RECORD_STROKE_PATH2D,
+  RECORD_PIXELS,
+  RECORD_RESIZE,
+  RECORD_DRAW_CANVAS,
+  RECORD_FONT,
+  RECORD_TEXT,
+  RECORD_IMAGE,
+  RECORD_DRAW_IMAGE,
+} RecordOp;
+
+#define RECORD_DEFERRED 1
+#define RECORD_OFFSCREEN 2
+#define RECORD_GEOMETRY 4
+#define RECORD_LAYER 8
+
+typedef struct {
+  FILE *file;
+  char *path;
+  // records are buffered and written out at every frame marker
+  uint8_t *buf;
+  size_t len;
+  size_t capacity;
+  bool failed;
+  uint32_t next_id;
+  uint32_t target_id; // canvas of the last record
+  uint64_t start_ns;
+} Recorder;
+
+static Recorder recorder;
+
+static void recorder_write(const void *data, size_t size) {
+  if (recorder.len + size > recorder.capacity) {
+    size_t capacity = SDL_max(recorder.capacity * 2, 64 * 1024);
+    while (capacity < recorder.len + size) {
+      capacity *= 2;
+    }
+    uint8_t *buf = realloc(recorder.buf, capacity);
+    if (!buf) {
+      recorder.failed = true;
+      return;
+    }
+    recorder.buf = buf;
+    recorder.capacity = capacity;
+  }
+  memcpy(recorder.buf + recorder.len, data, size);
+  recorder.len += size;
+}
+
+static void recorder_u8(uint8_t v) { recorder_write(&v, sizeof(v)); }
+static void recorder_i32(int32_t v) { recorder_write(&v, sizeof(v)); }
+static void recorder_u32(uint32_t v) { recorder_write(&v, sizeof(v)); }
+static void recorder_u64(uint64_t v) { recorder_write(&v, sizeof(v)); }
+static void recorder_f32(float v) { recorder_write(&v, sizeof(v)); }
+
+static void recorder_string(const char *s, size_t len) {
+  recorder_u32((uint32_t)len);
+  recorder_write(s, len);
+}
+
+static void recorder_flush(void) {
+  if (recorder.len > 0 && !recorder.failed &&
+      fwrite(recorder.buf, recorder.len, 1, recorder.file) != 1) {
+    perror(recorder.path);
+    recorder.failed = true;
+  }
+  recorder.len = 0;
+}
+
+static int recorder_open(const char *path) {
+  recorder.file = fopen(path, "wb");
+  if (!recorder.file) {
+    perror(path);
+    return -1;
+  }
+  recorder.path = strdup(path);
+  recorder.start_ns = SDL_GetTicksNS();
+  recorder_write(RECORD_MAGIC, 4);
+  recorder_u32(RECORD_VERSION);
+  return 0;
+}
+
+// Returns non-zero when the recording could not be written completely.
+static int recorder_close(void) {
+  if (!recorder.file) {
+    return 0;
+  }
+  recorder_flush();
+  if (fclose(recorder.file) && !recorder.failed) {
+    perror(recorder.path);
+    recorder.failed = true;
+  }
+  int ret = recorder.failed;
+  free(recorder.buf);
+  free(recorder.path);
+  memset(&recorder, 0, sizeof(recorder));
+  return ret;
+}
+
+static void recorder_path_element(void *closure,
+                                  plutovg_path_command_t command,
+                                  const plutovg_point_t *points,
+                                  int npoints) {
+  uint32_t *count = closure;
+  recorder_u8(command);
+  recorder_u8(npoints);
+  for (int i = 0; i < npoints; i++) {
+    recorder_f32(points[i].x);
+    recorder_f32(points[i].y);
+  }
+  (*count)++;
+}
+
+static void recorder_path(const plutovg_path_t *path) {
+  // the count is patched in once the elements are written
+  size_t at = recorder.len;
+  uint32_t count = 0;
+  recorder_u32(0);
+  plutovg_path_traverse(path, recorder_path_element, &count);
+  if (!recorder.failed) {
+    memcpy(recorder.buf + at, &count, sizeof(count));
+  }
+}
+
+// Writes the pixels of a rectangle as they are now.
+static void recorder_pixels(JSCanvas *s, const SDL_Rect *rect) {
+  recorder_i32(rect->x);
+  recorder_i32(rect->y);
+  recorder_i32(rect->w);
+  recorder_i32(rect->h);
+  for (int row = rect->y; row < rect->y + rect->h; row++) {
+    recorder_write((const uint8_t *)s->pixels +
+                       ((size_t)row * s->width + rect->x) * 4,
+                   (size_t)rect->w * 4);
+  }
+}
+
+// Gives a new canvas its id in the stream.
+static void recorder_add_canvas(JSCanvas *s) {
+  if (!recorder.file) {
+    return;
+  }
+  s->record_id = ++recorder.next_id;
+  s->record_opacity = -1; // forces the state out with the first record
+  recorder_u8(RECORD_CANVAS);
+  recorder_u32(s->record_id);
+  recorder_i32(s->view_width);
+  recorder_i32(s->view_height);
+  recorder_f32(s->resolution_scale);
+  recorder_u8((s->deferred ? RECORD_DEFERRED : 0) |
+              (s->offscreen ? RECORD_OFFSCREEN : 0) |
+              (s->geometry ? RECORD_GEOMETRY : 0) |
+              (s->layer ? RECORD_LAYER : 0));
+  recorder_i32(s->thread_count);
+  recorder.target_id = s->record_id;
+}
+
+// Starts a record for s, preceded by whatever the replay needs to be in the
+// same state. Returns false when nothing is being recorded, the caller then
+// skips its fields.
+static bool canvas_record(JSCanvas *s, RecordOp op) {
+  if (!recorder.file || !s->record_id) {
+    return false;
+  }
+  if (recorder.target_id != s->record_id) {
+    recorder_u8(RECORD_TARGET);
+    recorder_u32(s->record_id);
+    recorder.target_id = s->record_id;
+  }
+  if (s->record_pixels) {
+    // canvas.pixels was handed out since, the script may have written it
+    s->record_pixels = false;
+    recorder_u8(RECORD_PIXELS);
+    recorder_pixels(s, &(SDL_Rect){0, 0, s->width, s->height});
+  }
+  if (memcmp(&s->record_paint, &s->paint, sizeof(s->paint))) {
+    s->record_paint = s->paint;
+    recorder_u8(RECORD_PAINT);
+    recorder_f32(s->paint.r);
+    recorder_f32(s->paint.g);
+    recorder_f32(s->paint.b);
+    recorder_f32(s->paint.a);
+  }
+  float opacity = plutovg_canvas_get_opacity(s->plutovg_canvas);
+  if (opacity != s->record_opacity) {
+    s->record_opacity = opacity;
+    recorder_u8(RECORD_OPACITY);
+    recorder_f32(opacity);
+  }
+  float line_width = plutovg_canvas_get_line_width(s->plutovg_canvas);
+  if (line_width != s->record_line_width) {
+    s->record_line_width = line_width;
+    recorder_u8(RECORD_LINE_WIDTH);
+    recorder_f32(line_width);
+  }
+  recorder_u8(op);
+  return true;
+}
+
+// #endregion
+
+// #region drawing core
+//
+// Every draw call goes through the helpers below. They record the damage
+// and either rasterize right away or, in deferred mode, append a command
+// that the tile workers replay in show().
+
+// Skips plutovg when the color is already set: fill() and the record
+// batches re-apply the fill style on every call. A new plutovg canvas
+// starts with paint.a at -1 so that its first color always goes through.
+static void canvas_set_paint(JSCanvas *s, float r, float g, float b, float a) {
+  if (s->paint.r == r && s->paint.g == g && s->paint.b == b &&
+      s->paint.a == a) {
+    return;
+  }
+  s->paint = (plutovg_color_t){r, g, b, a};
+  plutovg_canvas_set_rgba(s->plutovg_canvas, r, g, b, a);
+}
+
+// Restores the paint to the color chosen with setFillColor().
+static void canvas_apply_fill_style(JSCanvas *s) {
+  SDL_Color color = s->fill_style.color;
+  canvas_set_paint(s, color.r / 255.0f, color.g / 255.0f, color.b / 255.0f,
+                   color.a / 255.0f);
+}
+
+static void canvas_discard_commands(JSCanvas *s) {
+  for (int i = 0; i < s->command_count; i++) {
+    CanvasCommandType type = s->commands[i].type;
+    if (type == CANVAS_COMMAND_PATH || type == CANVAS_COMMAND_STROKE) {
+      plutovg_path_destroy(s->commands[i].u.path);
+    }
+  }
+  s->command_count = 0;
+}
+
+// Converts device extents to the pixel bounds a command may touch.
+static SDL_Rect canvas_pixel_bounds(const plutovg_rect_t *extents) {
+  int x0 = (int)floorf(extents->x), y0 = (int)floorf(extents->y);
+  int x1 = (int)ceilf(extents->x + extents->w) + 1;
+  int y1 = (int)ceilf(extents->y + extents->h) + 1;
+  return (SDL_Rect){.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+}
+
+// Appends a command capturing the current paint, opacity and matrix. Returns
+// NULL when out of memory, in which case the draw call is dropped.
+static CanvasCommand *canvas_push_command(JSCanvas *s, CanvasCommandType type,
+                                          plutovg_operator_t op,
+                                          const plutovg_rect_t *extents) {
+  if (s->command_count == s->command_capacity) {
+    int capacity = SDL_max(s->command_capacity * 2, 256);
+    CanvasCommand *commands =
+        realloc(s->commands, capacity * sizeof(CanvasCommand));
+    if (!commands) {
+      return NULL;
+    }
+    s->commands = commands;
+    s->command_capacity = capacity;
+  }
+  CanvasCommand *cmd = &s->commands[s->command_count++];
+  cmd->type = type;
+  cmd->op = op;
+  cmd->color = s->paint;
+  cmd->opacity = plutovg_canvas_get_opacity(s->plutovg_canvas);
+  cmd->line_width = 1;
+  plutovg_canvas_get_matrix(s->plutovg_canvas, &cmd->matrix);
+  if (extents) {
+    cmd->bounds = canvas_pixel_bounds(extents);
+  } else {
+    cmd->bounds = (SDL_Rect){.x = 0, .y = 0, .w = s->width, .h = s->height};
+  }
+  return cmd;
+}
+
+// Maps a user-space rectangle to device extents.
+static void canvas_map_extents(JSCanvas *s, float x, float y, float w,
+                               float h, plutovg_rect_t *extents) {
+  plutovg_rect_t rect = {.x = x, .y = y, .w = w, .h = h};
+  if (w < 0) {
+    rect.x += w;
+    rect.w = -w;
+  }
+  if (h < 0) {
+    rect.y += h;
+    rect.h = -h;
+  }
+  plutovg_canvas_map_rect(s->plutovg_canvas, &rect, extents);
+}
+
+// Stamp cache: coverage masks of small circles rasterized once by plutovg
+// and blended straight into the pixels afterwards. Masks are keyed by the
+// device radius in quarter pixels and by the subpixel position of the center
+// in a 4x4 grid, and are created on the main thread only, so tile workers
+// can read them without locking.
+
+#define CANVAS_STAMP_MAX_RADIUS 8 // device pixels
+#define CANVAS_STAMP_RADIUS_STEPS 4
+#define CANVAS_STAMP_SUBPIXELS 4
+
+typedef struct CanvasStamp {
+  int size;      // the mask is size x size
+  int origin;    // offset of the mask from the pixel holding the center
+  uint8_t *mask; // coverage, 0-255
+} CanvasStamp;
+
+#define CANVAS_STAMP_RADII                                                     \
+  (CANVAS_STAMP_MAX_RADIUS * CANVAS_STAMP_RADIUS_STEPS + 1)
+
+static CanvasStamp *canvas_stamps[CANVAS_STAMP_RADII][CANVAS_STAMP_SUBPIXELS]
+                                 [CANVAS_STAMP_SUBPIXELS];
+
+static CanvasStamp *canvas_stamp_create(int radius_index, int sx, int sy) {
+  float radius = (float)radius_index / CANVAS_STAMP_RADIUS_STEPS;
+  int extent = (int)ceilf(radius) + 1;
+  int size = 2 * extent;
+  CanvasStamp *stamp = malloc(sizeof(CanvasStamp) + size * size);
+  plutovg_surface_t *surface = plutovg_surface_create(size, size);
+  plutovg_canvas_t *canvas = surface ? plutovg_canvas_create(surface) : NULL;
+  if (!stamp || !canvas) {
+    free(stamp);
+    stamp = NULL;
+    goto done;
+  }
+  stamp->size = size;
+  stamp->origin = 1 - extent;
+  stamp->mask = (uint8_t *)(stamp + 1);
+  // centered on the middle of its subpixel bucket
+  float cx = extent - 1 + (sx + 0.5f) / CANVAS_STAMP_SUBPIXELS;
+  float cy = extent - 1 + (sy + 0.5f) / CANVAS_STAMP_SUBPIXELS;
+  plutovg_canvas_set_rgba(canvas, 1, 1, 1, 1);
+  plutovg_canvas_circle(canvas, cx, cy, radius);
+  plutovg_canvas_fill(canvas);
+  const uint8_t *data = plutovg_surface_get_data(surface);
+  int stride = plutovg_surface_get_stride(surface);
+  for (int y = 0; y < size; y++) {
+    const uint32_t *row = (const uint32_t *)(data + y * stride);
+    for (int x = 0; x < size; x++) {
+      stamp->mask[y * size + x] = row[x] >> 24;
+    }
+  }
+done:
+  if (canvas) {
+    plutovg_canvas_destroy(canvas);
+  }
+  if (surface) {
+    plutovg_surface_destroy(surface);
+  }
+  return stamp;
+}
+
+static void canvas_stamps_free(void) {
+  CanvasStamp **stamps = &canvas_stamps[0][0][0];
+  size_t count = sizeof(canvas_stamps) / sizeof(canvas_stamps[0][0][0]);
+  for (size_t i = 0; i < count; i++) {
+    free(stamps[i]);
+    stamps[i] = NULL;
+  }
+}
+
+// Finds the stamp for a circle at device position (cx, cy). Returns NULL
+// when the circle is too big or small for the cache, and stores the pixel
+// the center falls in otherwise.
+static const CanvasStamp *canvas_stamp_lookup(float cx, float cy,
+                                              float radius, int *px,
+                                              int *py) {
+  float steps = radius * CANVAS_STAMP_RADIUS_STEPS;
+  if (!(steps >= 0.5f &&
+        steps <= CANVAS_STAMP_MAX_RADIUS * CANVAS_STAMP_RADIUS_STEPS) ||
+      !(fabsf(cx) < 1e6f && fabsf(cy) < 1e6f)) {
+    return NULL;
+  }
+  float fx = floorf(cx), fy = floorf(cy);
+  int r = (int)lroundf(steps);
+  int sx = (int)((cx - fx) * CANVAS_STAMP_SUBPIXELS);
+  int sy = (int)((cy - fy) * CANVAS_STAMP_SUBPIXELS);
+  sx = SDL_min(sx, CANVAS_STAMP_SUBPIXELS - 1);
+  sy = SDL_min(sy, CANVAS_STAMP_SUBPIXELS - 1);
+  CanvasStamp **slot = &canvas_stamps[r][sy][sx];
+  if (*slot == NULL) {
+    *slot = canvas_stamp_create(r, sx, sy);
+  }
+  *px = (int)fx;
+  *py = (int)fy;
+  return *slot;
+}
+
+// x * a / 255 on the four channels of a pixel, as plutovg does it.
+static inline uint32_t pixel_byte_mul(uint32_t x, uint32_t a) {
+  uint32_t t = (x & 0xff00ff) * a;
+  t = (t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8;
+  t &= 0xff00ff;
+  x = ((x >> 8) & 0xff00ff) * a;
+  x = (x + ((x >> 8) & 0xff00ff) + 0x800080);
+  x &= 0xff00ff00;
+  return x | t;
+}
+
+// Premultiplied ARGB32 pixel of a paint and opacity.
+static uint32_t canvas_premultiply(const plutovg_color_t *color,
+                                   float opacity) {
+  float a = SDL_clamp(color->a * opacity, 0.0f, 1.0f);
+  uint32_t pa = (uint32_t)(a * 255 + 0.5f);
+  uint32_t pr = (uint32_t)(SDL_clamp(color->r, 0.0f, 1.0f) * a * 255 + 0.5f);
+  uint32_t pg = (uint32_t)(SDL_clamp(color->g, 0.0f, 1.0f) * a * 255 + 0.5f);
+  uint32_t pb = (uint32_t)(SDL_clamp(color->b, 0.0f, 1.0f) * a * 255 + 0.5f);
+  return pa << 24 | pr << 16 | pg << 8 | pb;
+}
+
+// Blends a width x height coverage mask in the given color with source-over
+// into rows [y0, y1) of the canvas pixels, its top left corner at pixel
+// (left, top).
+static void canvas_blit_mask(JSCanvas *s, const uint8_t *mask, int stride,
+                             int width, int height, int left, int top,
+                             uint32_t color, int y0, int y1) {
+  int mx0 = SDL_max(0, -left);
+  int my0 = SDL_max(0, y0 - top);
+  int mx1 = SDL_min(width, s->width - left);
+  int my1 = SDL_min(height, y1 - top);
+  uint32_t *pixels = s->pixels;
+  for (int my = my0; my < my1; my++) {
+    const uint8_t *coverage = mask + my * stride;
+    uint32_t *restrict dst = pixels + (size_t)(top + my) * s->width + left;
+    for (int mx = mx0; mx < mx1; mx++) {
+      uint32_t c = coverage[mx];
+      if (c == 0) {
+        continue;
+      }
+      uint32_t src = c == 255 ? color : pixel_byte_mul(color, c);
+      dst[mx] = src + pixel_byte_mul(dst[mx], 255 - (src >> 24));
+    }
+  }
+}
+
+// Blends a stamp with source-over into rows [y0, y1) of the canvas pixels.
+static void canvas_blit_stamp(JSCanvas *s, const CanvasStamp *stamp, int px,
+                              int py, uint32_t color, int y0, int y1) {
+  canvas_blit_mask(s, stamp->mask, stamp->size, stamp->size, stamp->size,
+                   px + stamp->origin, py + stamp->origin, color, y0, y1);
+}
+
+// The stamp of a circle drawn with the current matrix, or NULL when the
+// matrix rotates, skews or scales unevenly.
+static const CanvasStamp *canvas_circle_stamp(JSCanvas *s, float x, float y,
+                                              float radius, int *px, int *py) {
+  plutovg_matrix_t m;
+  plutovg_canvas_get_matrix(s->plutovg_canvas, &m);
+  if (m.b != 0 || m.c != 0 || m.a != m.d || m.a <= 0) {
+    return NULL;
+  }
+  return canvas_stamp_lookup(m.a * x + m.e, m.d * y + m.f, m.a * radius, px,
+                             py);
+}
+
+// Whole-surface kernels: every premultiplied channel becomes
+//   add + channel * factor / 255
+// which covers a solid source-over fill (add is the color, factor is its
+// inverse alpha) and a per-channel multiply (add is zero). The rounding is
+// the same in every implementation, so results do not depend on the CPU.
+
+typedef void (*PixelsMulAddFunc)(uint32_t *pixels, size_t count, uint32_t add,
+                                 uint32_t factors);
+
+static inline uint32_t pixel_div255(uint32_t x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static void pixels_mul_add_scalar(uint32_t *restrict pixels, size_t count,
+                                  uint32_t add, uint32_t factors) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t p = pixels[i];
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t c = pixel_div255(((p >> shift) & 0xff) *
+                                ((factors >> shift) & 0xff)) +
+                   ((add >> shift) & 0xff);
+      out |= SDL_min(c, 255u) << shift;
+    }
+    pixels[i] = out;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 8 channels of p (16 bits each) times f, divided by 255
+__attribute__((target("sse2"))) static inline __m128i
+mul_div255_epi16(__m128i p, __m128i f) {
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(p, f), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static void
+pixels_mul_add_sse2(uint32_t *pixels, size_t count, uint32_t add,
+                    uint32_t factors) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i f = _mm_unpacklo_epi8(_mm_set1_epi32(factors), zero);
+  __m128i a = _mm_set1_epi32(add);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(pixels + i));
+    __m128i lo = mul_div255_epi16(_mm_unpacklo_epi8(p, zero), f);
+    __m128i hi = mul_div255_epi16(_mm_unpackhi_epi8(p, zero), f);
+    p = _mm_adds_epu8(_mm_packus_epi16(lo, hi), a);
+    _mm_storeu_si128((__m128i *)(pixels + i), p);
+  }
+  pixels_mul_add_scalar(pixels + i, count - i, add, factors);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+mul_div255_epi16_avx2(__m256i p, __m256i f) {
+  __m256i x =
+      _mm256_add_epi16(_mm256_mullo_epi16(p, f), _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static void
+pixels_mul_add_avx2(uint32_t *pixels, size_t count, uint32_t add,
+                    uint32_t factors) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i f = _mm256_unpacklo_epi8(_mm256_set1_epi32(factors), zero);
+  __m256i a = _mm256_set1_epi32(add);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(pixels + i));
+    // unpack and pack work within 128-bit lanes, so the order is kept
+    __m256i lo = mul_div255_epi16_avx2(_mm256_unpacklo_epi8(p, zero), f);
+    __m256i hi = mul_div255_epi16_avx2(_mm256_unpackhi_epi8(p, zero), f);
+    p = _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), a);
+    _mm256_storeu_si256((__m256i *)(pixels + i), p);
+  }
+  pixels_mul_add_sse2(pixels + i, count - i, add, factors);
+}
+
+#elif defined(__ARM_NEON)
+
+static void pixels_mul_add_neon(uint32_t *pixels, size_t count, uint32_t add,
+                                uint32_t factors) {
+  uint8x16_t f = vreinterpretq_u8_u32(vdupq_n_u32(factors));
+  uint8x16_t a = vreinterpretq_u8_u32(vdupq_n_u32(add));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint8x16_t p = vreinterpretq_u8_u32(vld1q_u32(pixels + i));
+    uint16x8_t lo = vmull_u8(vget_low_u8(p), vget_low_u8(f));
+    uint16x8_t hi = vmull_u8(vget_high_u8(p), vget_high_u8(f));
+    // (x + 128 + ((x + 128) >> 8)) >> 8, as pixel_div255()
+    uint8x8_t rlo = vraddhn_u16(lo, vrshrq_n_u16(lo, 8));
+    uint8x8_t rhi = vraddhn_u16(hi, vrshrq_n_u16(hi, 8));
+    p = vqaddq_u8(vcombine_u8(rlo, rhi), a);
+    vst1q_u32(pixels + i, vreinterpretq_u32_u8(p));
+  }
+  pixels_mul_add_scalar(pixels + i, count - i, add, factors);
+}
+
+#endif
+
+// Layer kernels: premultiplied src scaled by alpha (0-255), then drawn over
+// dst with source-over:
+//   dst = src * alpha / 255 + dst * (255 - src alpha * alpha / 255) / 255
+// using the same rounding as the kernels above.
+
+typedef void (*PixelsBlendFunc)(uint32_t *dst, const uint32_t *src,
+                                size_t count, uint32_t alpha);
+
+static void pixels_blend_scalar(uint32_t *restrict dst,
+                                const uint32_t *restrict src, size_t count,
+                                uint32_t alpha) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t s = src[i];
+    if (alpha != 255) {
+      uint32_t scaled = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        scaled |= pixel_div255(((s >> shift) & 0xff) * alpha) << shift;
+      }
+      s = scaled;
+    }
+    uint32_t inverse = 255 - (s >> 24);
+    uint32_t d = dst[i];
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t c = pixel_div255(((d >> shift) & 0xff) * inverse) +
+                   ((s >> shift) & 0xff);
+      out |= SDL_min(c, 255u) << shift;
+    }
+    dst[i] = out;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 255 minus the alpha word of each pixel, copied to its four channels
+__attribute__((target("sse2"))) static inline __m128i
+inverse_alpha_epi16(__m128i p) {
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, 0xff), 0xff);
+  return _mm_sub_epi16(_mm_set1_epi16(255), a);
+}
+
+__attribute__((target("sse2"))) static void
+pixels_blend_sse2(uint32_t *dst, const uint32_t *src, size_t count,
+                  uint32_t alpha) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = _mm_set1_epi16((short)alpha);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i slo = mul_div255_epi16(_mm_unpacklo_epi8(s, zero), a);
+    __m128i shi = mul_div255_epi16(_mm_unpackhi_epi8(s, zero), a);
+    __m128i dlo = mul_div255_epi16(_mm_unpacklo_epi8(d, zero),
+                                   inverse_alpha_epi16(slo));
+    __m128i dhi = mul_div255_epi16(_mm_unpackhi_epi8(d, zero),
+                                   inverse_alpha_epi16(shi));
+    d = _mm_adds_epu8(_mm_packus_epi16(dlo, dhi), _mm_packus_epi16(slo, shi));
+    _mm_storeu_si128((__m128i *)(dst + i), d);
+  }
+  pixels_blend_scalar(dst + i, src + i, count - i, alpha);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+inverse_alpha_epi16_avx2(__m256i p) {
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p, 0xff), 0xff);
+  return _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+}
+
+__attribute__((target("avx2"))) static void
+pixels_blend_avx2(uint32_t *dst, const uint32_t *src, size_t count,
+                  uint32_t alpha) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i a = _mm256_set1_epi16((short)alpha);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i slo = mul_div255_epi16_avx2(_mm256_unpacklo_epi8(s, zero), a);
+    __m256i shi = mul_div255_epi16_avx2(_mm256_unpackhi_epi8(s, zero), a);
+    __m256i dlo = mul_div255_epi16_avx2(_mm256_unpacklo_epi8(d, zero),
+                                        inverse_alpha_epi16_avx2(slo));
+    __m256i dhi = mul_div255_epi16_avx2(_mm256_unpackhi_epi8(d, zero),
+                                        inverse_alpha_epi16_avx2(shi));
+    d = _mm256_adds_epu8(_mm256_packus_epi16(dlo, dhi),
+                         _mm256_packus_epi16(slo, shi));
+    _mm256_storeu_si256((__m256i *)(dst + i), d);
+  }
+  pixels_blend_sse2(dst + i, src + i, count - i, alpha);
+}
+
+#elif defined(__ARM_NEON)
+
+static void pixels_blend_neon(uint32_t *dst, const uint32_t *src,
+                              size_t count, uint32_t alpha) {
+  uint8x8_t a = vdup_n_u8((uint8_t)alpha);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    // planes 0-3 are blue, green, red and alpha of 8 pixels
+    uint8x8x4_t s = vld4_u8((const uint8_t *)(src + i));
+    uint8x8x4_t d = vld4_u8((const uint8_t *)(dst + i));
+    for (int c = 0; c < 4; c++) {
+      uint16x8_t x = vmull_u8(s.val[c], a);
+      s.val[c] = vraddhn_u16(x, vrshrq_n_u16(x, 8));
+    }
+    uint8x8_t inverse = vmvn_u8(s.val[3]);
+    for (int c = 0; c < 4; c++) {
+      uint16x8_t x = vmull_u8(d.val[c], inverse);
+      d.val[c] = vqadd_u8(vraddhn_u16(x, vrshrq_n_u16(x, 8)), s.val[c]);
+    }
+    vst4_u8((uint8_t *)(dst + i), d);
+  }
+  pixels_blend_scalar(dst + i, src + i, count - i, alpha);
+}
+
+#endif
+
+static PixelsMulAddFunc pixels_mul_add = pixels_mul_add_scalar;
+static PixelsBlendFunc pixels_blend = pixels_blend_scalar;
+
+// Picks the widest kernel the CPU supports.
+static void pixel_kernels_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (SDL_HasAVX2()) {
+    pixels_mul_add = pixels_mul_add_avx2;
+    pixels_blend = pixels_blend_avx2;
+  } else if (SDL_HasSSE2()) {
+    pixels_mul_add = pixels_mul_add_sse2;
+    pixels_blend = pixels_blend_sse2;
+  }
+#elif defined(__ARM_NEON)
+  if (SDL_HasNEON()) {
+    pixels_mul_add = pixels_mul_add_neon;
+    pixels_blend = pixels_blend_neon;
+  }
+#endif
+}
+
+// Runs the kernel over rows [y0, y1) of the canvas.
+static void canvas_mul_add_rows(JSCanvas *s, uint32_t add, uint32_t factors,
+                                int y0, int y1) {
+  uint32_t *pixels = (uint32_t *)s->pixels + (size_t)y0 * s->width;
+  pixels_mul_add(pixels, (size_t)(y1 - y0) * s->width, add, factors);
+}
+
+// Applies the kernel to the whole surface, or records it in deferred mode.
+static void canvas_mul_add(JSCanvas *s, uint32_t add, uint32_t factors) {
+  if (canvas_record(s, RECORD_MUL_ADD)) {
+    recorder_u32(add);
+    recorder_u32(factors);
+  }
+  canvas_invalidate_all(s);
+  TRACE_COUNT(pixels, (uint64_t)s->width * s->height);
+  if (s->deferred) {
+    CanvasCommand *cmd = canvas_push_command(s, CANVAS_COMMAND_MUL_ADD,
+                                             PLUTOVG_OPERATOR_SRC_OVER, NULL);
+    if (cmd) {
+      cmd->u.mul_add.add = add;
+      cmd->u.mul_add.factors = factors;
+    }
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  canvas_mul_add_rows(s, add, factors, 0, s->height);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Source-over of a premultiplied color over every pixel.
+static void canvas_blend_solid(JSCanvas *s, uint32_t color) {
+  uint32_t inverse = 255 - (color >> 24);
+  canvas_mul_add(s, color, inverse * 0x01010101u);
+}
+
+// Clears the whole surface to transparent black.
+static void canvas_clear_all(JSCanvas *s) {
+  canvas_record(s, RECORD_CLEAR);
+  canvas_invalidate_all(s);
+  TRACE_COUNT(pixels, (uint64_t)s->width * s->height);
+  if (s->deferred) {
+    // nothing recorded before a full clear can show up
+    canvas_discard_commands(s);
+    canvas_push_command(s, CANVAS_COMMAND_CLEAR, PLUTOVG_OPERATOR_CLEAR, NULL);
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  SDL_memset(s->pixels, 0, (size_t)s->width * s->height * 4);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Fills a circle with the current paint.
+static void canvas_fill_circle(JSCanvas *s, float x, float y, float radius) {
+  if (canvas_record(s, RECORD_CIRCLE)) {
+    recorder_f32(x);
+    recorder_f32(y);
+    recorder_f32(radius);
+  }
+  plutovg_rect_t extents;
+  canvas_map_extents(s, x - radius, y - radius, 2 * radius, 2 * radius,
+                     &extents);
+  canvas_add_damage_extents(s, &extents);
+  int px, py;
+  const CanvasStamp *stamp = canvas_circle_stamp(s, x, y, radius, &px, &py);
+  if (s->deferred) {
+    CanvasCommand *cmd = canvas_push_command(s, CANVAS_COMMAND_CIRCLE,
+                                             PLUTOVG_OPERATOR_SRC_OVER,
+                                             &extents);
+    if (cmd) {
+      cmd->u.circle.x = x;
+      cmd->u.circle.y = y;
+      cmd->u.circle.radius = radius;
+      cmd->u.circle.stamp = stamp;
+      cmd->u.circle.px = px;
+      cmd->u.circle.py = py;
+    }
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  if (stamp) {
+    uint32_t color = canvas_premultiply(
+        &s->paint, plutovg_canvas_get_opacity(s->plutovg_canvas));
+    canvas_blit_stamp(s, stamp, px, py, color, 0, s->height);
+    BENCH_END(BENCH_RASTER);
+    return;
+  }
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  plutovg_canvas_new_path(canvas);
+  plutovg_canvas_circle(canvas, x, y, radius);
+  plutovg_canvas_fill(canvas);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Whether a rectangle mapped to extents covers every pixel completely.
+static bool canvas_covers_surface(JSCanvas *s, const plutovg_rect_t *extents) {
+  plutovg_matrix_t m;
+  plutovg_canvas_get_matrix(s->plutovg_canvas, &m);
+  // with rotation the extents are only a bounding box
+  return m.b == 0 && m.c == 0 && extents->x <= 0 && extents->y <= 0 &&
+         extents->x + extents->w >= s->width &&
+         extents->y + extents->h >= s->height;
+}
+
+// Fills a rectangle with the current paint, or clears it with
+// PLUTOVG_OPERATOR_CLEAR.
+static void canvas_fill_rect(JSCanvas *s, float x, float y, float w, float h,
+                             plutovg_operator_t op) {
+  plutovg_rect_t extents;
+  canvas_map_extents(s, x, y, w, h, &extents);
+  if (canvas_covers_surface(s, &extents)) {
+    // the trail effect: no need for the scanline renderer
+    if (op == PLUTOVG_OPERATOR_CLEAR) {
+      canvas_clear_all(s);
+      return;
+    }
+    if (op == PLUTOVG_OPERATOR_SRC_OVER) {
+      float opacity = plutovg_canvas_get_opacity(s->plutovg_canvas);
+      canvas_blend_solid(s, canvas_premultiply(&s->paint, opacity));
+      return;
+    }
+  }
+  if (canvas_record(s, RECORD_RECT)) {
+    recorder_f32(x);
+    recorder_f32(y);
+    recorder_f32(w);
+    recorder_f32(h);
+    recorder_u8(op);
+  }
+  canvas_add_damage_extents(s, &extents);
+  if (s->deferred) {
+    CanvasCommand *cmd =
+        canvas_push_command(s, CANVAS_COMMAND_RECT, op, &extents);
+    if (cmd) {
+      cmd->u.rect = (plutovg_rect_t){.x = x, .y = y, .w = w, .h = h};
+    }
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  plutovg_canvas_new_path(canvas);
+  plutovg_canvas_rect(canvas, x, y, w, h);
+  if (op == PLUTOVG_OPERATOR_SRC_OVER) {
+    plutovg_canvas_fill(canvas);
+  } else {
+    plutovg_canvas_save(canvas);
+    plutovg_canvas_set_operator(canvas, op);
+    plutovg_canvas_fill(canvas);
+    plutovg_canvas_restore(canvas);
+  }
+  BENCH_END(BENCH_RASTER);
+}
+
+// Strokes a single line segment with the current paint.
+static void canvas_stroke_line(JSCanvas *s, float x0, float y0, float x1,
+                               float y1, float line_width) {
+  if (canvas_record(s, RECORD_LINE)) {
+    recorder_f32(x0);
+    recorder_f32(y0);
+    recorder_f32(x1);
+    recorder_f32(y1);
+    recorder_f32(line_width);
+  }
+  plutovg_rect_t extents;
+  float half = line_width / 2;
+  canvas_map_extents(s, SDL_min(x0, x1) - half, SDL_min(y0, y1) - half,
+                     fabsf(x1 - x0) + line_width, fabsf(y1 - y0) + line_width,
+                     &extents);
+  canvas_add_damage_extents(s, &extents);
+  if (s->deferred) {
+    CanvasCommand *cmd = canvas_push_command(s, CANVAS_COMMAND_LINE,
+                                             PLUTOVG_OPERATOR_SRC_OVER,
+                                             &extents);
+    if (cmd) {
+      cmd->line_width = line_width;
+      cmd->u.line.x0 = x0;
+      cmd->u.line.y0 = y0;
+      cmd->u.line.x1 = x1;
+      cmd->u.line.y1 = y1;
+    }
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  plutovg_canvas_set_line_width(canvas, line_width);
+  plutovg_canvas_new_path(canvas);
+  plutovg_canvas_move_to(canvas, x0, y0);
+  plutovg_canvas_line_to(canvas, x1, y1);
+  plutovg_canvas_stroke(canvas);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Fills the current path with the current paint and starts a new path.
+static void canvas_fill_path(JSCanvas *s) {
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  if (canvas_record(s, RECORD_FILL)) {
+    recorder_path(plutovg_canvas_get_path(canvas));
+  }
+  plutovg_rect_t extents;
+  plutovg_canvas_fill_extents(canvas, &extents);
+  canvas_add_damage_extents(s, &extents);
+  if (s->deferred) {
+    plutovg_path_t *path = plutovg_path_clone(plutovg_canvas_get_path(canvas));
+    CanvasCommand *cmd = canvas_push_command(s, CANVAS_COMMAND_PATH,
+                                             PLUTOVG_OPERATOR_SRC_OVER,
+                                             &extents);
+    if (cmd) {
+      cmd->u.path = path;
+    } else {
+      plutovg_path_destroy(path);
+    }
+    plutovg_canvas_new_path(canvas);
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  plutovg_canvas_fill(canvas);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Strokes the current path with the current paint and line width, and
+// starts a new path.
+static void canvas_stroke_path(JSCanvas *s) {
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  if (canvas_record(s, RECORD_STROKE)) {
+    recorder_path(plutovg_canvas_get_path(canvas));
+  }
+  plutovg_rect_t extents;
+  plutovg_canvas_stroke_extents(canvas, &extents);
+  canvas_add_damage_extents(s, &extents);
+  if (s->deferred) {
+    plutovg_path_t *path = plutovg_path_clone(plutovg_canvas_get_path(canvas));
+    CanvasCommand *cmd = canvas_push_command(s, CANVAS_COMMAND_STROKE,
+                                             PLUTOVG_OPERATOR_SRC_OVER,
+                                             &extents);
+    if (cmd) {
+      cmd->line_width = plutovg_canvas_get_line_width(canvas);
+      cmd->u.path = path;
+    } else {
+      plutovg_path_destroy(path);
+    }
+    plutovg_canvas_new_path(canvas);
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  plutovg_canvas_stroke(canvas);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Fills or strokes a Path2D with the current paint, drawn through the canvas
+// matrix times transform (if any). The current path is left alone.
+static void canvas_draw_path2d(JSCanvas *s, JSPath2D *p,
+                               const plutovg_matrix_t *transform,
+                               bool stroke) {
+  if (canvas_record(s, stroke ? RECORD_STROKE_PATH2D : RECORD_FILL_PATH2D)) {
+    recorder_u8(transform != NULL);
+    if (transform) {
+      recorder_f32(transform->a);
+      recorder_f32(transform->b);
+      recorder_f32(transform->c);
+      recorder_f32(transform->d);
+      recorder_f32(transform->e);
+      recorder_f32(transform->f);
+    }
+    recorder_path(p->path);
+  }
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  float line_width = plutovg_canvas_get_line_width(canvas);
+  plutovg_canvas_save(canvas);
+  if (transform) {
+    plutovg_canvas_transform(canvas, transform);
+  }
+  plutovg_matrix_t m;
+  plutovg_canvas_get_matrix(canvas, &m);
+  float built_scale;
+  plutovg_path_t *path =
+      path2d_geometry(p, sqrtf(fabsf(m.a * m.d - m.b * m.c)), &built_scale);
+  if (built_scale != 1) {
+    // the flattened copy is pre-scaled, undo it in the matrix
+    plutovg_canvas_scale(canvas, 1 / built_scale, 1 / built_scale);
+    line_width *= built_scale;
+  }
+
+  plutovg_rect_t rect, extents;
+  plutovg_path_extents(path, &rect, false);
+  if (stroke) {
+    // covers miter joins and square caps
+    float miter = plutovg_canvas_get_miter_limit(canvas);
+    float pad = line_width / 2 * SDL_max(miter, sqrtf(2));
+    rect = (plutovg_rect_t){rect.x - pad, rect.y - pad, rect.w + 2 * pad,
+                            rect.h + 2 * pad};
+  }
+  plutovg_canvas_map_rect(canvas, &rect, &extents);
+  canvas_add_damage_extents(s, &extents);
+
+  if (s->deferred) {
+    CanvasCommand *cmd = canvas_push_command(
+        s, stroke ? CANVAS_COMMAND_STROKE : CANVAS_COMMAND_PATH,
+        PLUTOVG_OPERATOR_SRC_OVER, &extents);
+    if (cmd) {
+      cmd->line_width = line_width;
+      // shared, Path2D copies it before any edit
+      cmd->u.path = plutovg_path_reference(path);
+    }
+  } else {
+    BENCH_BEGIN(BENCH_RASTER);
+    if (stroke) {
+      plutovg_canvas_set_line_width(canvas, line_width);
+      plutovg_canvas_stroke_path(canvas, path);
+    } else {
+      plutovg_canvas_fill_path(canvas, path);
+    }
+    BENCH_END(BENCH_RASTER);
+  }
+  plutovg_canvas_restore(canvas);
+}
+
+// Replays every command touching the tile into the tile's own canvas.
+static void canvas_replay_tile(JSCanvas *s, CanvasTile *tile) {
+  plutovg_canvas_t *canvas = tile->canvas;
+  int stride = s->width * 4;
+  for (int i = 0; i < s->command_count; i++) {
+    const CanvasCommand *cmd = &s->commands[i];
+    if (cmd->bounds.y >= tile->y1 ||
+        cmd->bounds.y + cmd->bounds.h <= tile->y0) {
+      continue;
+    }
+    if (cmd->type == CANVAS_COMMAND_CLEAR) {
+      SDL_memset((uint8_t *)s->pixels + tile->y0 * stride, 0,
+                 (tile->y1 - tile->y0) * stride);
+      continue;
+    }
+    if (cmd->type == CANVAS_COMMAND_MUL_ADD) {
+      canvas_mul_add_rows(s, cmd->u.mul_add.add, cmd->u.mul_add.factors,
+                          tile->y0, tile->y1);
+      continue;
+    }
+    if (cmd->type == CANVAS_COMMAND_CIRCLE && cmd->u.circle.stamp) {
+      uint32_t color = canvas_premultiply(&cmd->color, cmd->opacity);
+      canvas_blit_stamp(s, cmd->u.circle.stamp, cmd->u.circle.px,
+                        cmd->u.circle.py, color, tile->y0, tile->y1);
+      continue;
+    }
+    // the tile surface starts at row y0 of the canvas
+    plutovg_matrix_t matrix = cmd->matrix;
+    matrix.f -= tile->y0;
+    plutovg_canvas_set_matrix(canvas, &matrix);
+    plutovg_canvas_set_operator(canvas, cmd->op);
+    plutovg_canvas_set_color(canvas, &cmd->color);
+    plutovg_canvas_set_opacity(canvas, cmd->opacity);
+    plutovg_canvas_new_path(canvas);
+    switch (cmd->type) {
+    case CANVAS_COMMAND_CIRCLE:
+      plutovg_canvas_circle(canvas, cmd->u.circle.x, cmd->u.circle.y,
+                            cmd->u.circle.radius);
+      plutovg_canvas_fill(canvas);
+      break;
+    case CANVAS_COMMAND_RECT:
+      plutovg_canvas_rect(canvas, cmd->u.rect.x, cmd->u.rect.y, cmd->u.rect.w,
+                          cmd->u.rect.h);
+      plutovg_canvas_fill(canvas);
+      break;
+    case CANVAS_COMMAND_LINE:
+      plutovg_canvas_set_line_width(canvas, cmd->line_width);
+      plutovg_canvas_move_to(canvas, cmd->u.line.x0, cmd->u.line.y0);
+      plutovg_canvas_line_to(canvas, cmd->u.line.x1, cmd->u.line.y1);
+      plutovg_canvas_stroke(canvas);
+      break;
+    case CANVAS_COMMAND_PATH:
+      plutovg_canvas_fill_path(canvas, cmd->u.path);
+      break;
+    case CANVAS_COMMAND_STROKE:
+      plutovg_canvas_set_line_width(canvas, cmd->line_width);
+      plutovg_canvas_stroke_path(canvas, cmd->u.path);
+      break;
+    case CANVAS_COMMAND_CLEAR:
+    case CANVAS_COMMAND_MUL_ADD:
+      break;
+    }
+  }
+}
+
+static void canvas_raster_run_tiles(CanvasRaster *r) {
+  int i;
+  while ((i = SDL_AddAtomicInt(&r->next_tile, 1)) < r->tile_count) {
+    uint64_t start = trace_now();
+    canvas_replay_tile(r->owner, &r->tiles[i]);
+    trace_span("tile", start);
+  }
+}
+
+static int canvas_raster_worker(void *data) {
+  CanvasRaster *r = data;
+  int generation = 0;
+  SDL_LockMutex(r->mutex);
+  for (;;) {
+    while (!r->quit && r->generation == generation) {
+      SDL_WaitCondition(r->work_cond, r->mutex);
+    }
+    if (r->quit) {
+      break;
+    }
+    generation = r->generation;
+    SDL_UnlockMutex(r->mutex);
+    canvas_raster_run_tiles(r);
+    SDL_LockMutex(r->mutex);
+    if (--r->busy == 0) {
+      SDL_SignalCondition(r->done_cond);
+    }
+  }
+  SDL_UnlockMutex(r->mutex);
+  return 0;
+}
+
+static void canvas_raster_destroy(CanvasRaster *r) {
+  if (r->mutex) {
+    SDL_LockMutex(r->mutex);
+    r->quit = true;
+    SDL_BroadcastCondition(r->work_cond);
+    SDL_UnlockMutex(r->mutex);
+  }
+  for (int i = 0; i < r->thread_count; i++) {
+    if (r->threads[i]) {
+      SDL_WaitThread(r->threads[i], NULL);
+    }
+  }
+  for (int i = 0; i < r->tile_count; i++) {
+    if (r->tiles[i].canvas) {
+      plutovg_canvas_destroy(r->tiles[i].canvas);
+    }
+    if (r->tiles[i].surface) {
+      plutovg_surface_destroy(r->tiles[i].surface);
+    }
+  }
+  if (r->work_cond) {
+    SDL_DestroyCondition(r->work_cond);
+  }
+  if (r->done_cond) {
+    SDL_DestroyCondition(r->done_cond);
+  }
+  if (r->mutex) {
+    SDL_DestroyMutex(r->mutex);
+  }
+  free(r->threads);
+  free(r->tiles);
+  free(r);
+}
+
+// Splits the canvas into bands of rows, a few per thread so that bands
+// with heavy content do not leave the other threads idle.
+static CanvasRaster *canvas_raster_create(JSCanvas *s, int thread_count) {
+  CanvasRaster *r = calloc(1, sizeof(CanvasRaster));
+  if (!r) {
+    return NULL;
+  }
+  r->owner = s;
+  int stride = s->width * 4;
+  int tile_height = SDL_max(16, (s->height + thread_count * 4 - 1) /
+                                    (thread_count * 4));
+  r->tile_count = (s->height + tile_height - 1) / tile_height;
+  r->tiles = calloc(r->tile_count, sizeof(CanvasTile));
+  // the calling thread is one of the workers
+  r->threads = calloc(thread_count, sizeof(SDL_Thread *));
+  r->mutex = SDL_CreateMutex();
+  r->work_cond = SDL_CreateCondition();
+  r->done_cond = SDL_CreateCondition();
+  if (!r->tiles || !r->threads || !r->mutex || !r->work_cond ||
+      !r->done_cond) {
+    canvas_raster_destroy(r);
+    return NULL;
+  }
+  for (int i = 0; i < r->tile_count; i++) {
+    CanvasTile *tile = &r->tiles[i];
+    tile->y0 = i * tile_height;
+    tile->y1 = SDL_min(tile->y0 + tile_height, s->height);
+    tile->surface = plutovg_surface_create_for_data(
+        (unsigned char *)s->pixels + tile->y0 * stride, s->width,
+        tile->y1 - tile->y0, stride);
+    if (!tile->surface) {
+      canvas_raster_destroy(r);
+      return NULL;
+    }
+    tile->canvas = plutovg_canvas_create(tile->surface);
+    if (!tile->canvas) {
+      canvas_raster_destroy(r);
+      return NULL;
+    }
+  }
+  for (int i = 0; i < thread_count - 1; i++) {
+    r->threads[i] = SDL_CreateThread(canvas_raster_worker, "raster", r);
+    if (!r->threads[i]) {
+      fprintf(stderr, "SDL could not create thread! SDL_Error: %s\n",
+              SDL_GetError());
+      canvas_raster_destroy(r);
+      return NULL;
+    }
+    r->thread_count++;
+  }
+  return r;
+}
+
+// Geometry backend: canvases made with {backend: 'geometry'} record the same
+// commands as deferred mode, and show() has the SDL renderer draw them into
+// the texture as triangles with premultiplied vertex colors. Consecutive
+// commands with the same blend mode go out in one SDL_RenderGeometry() call;
+// commands are never reordered across blend modes, since later draws may
+// cover earlier ones. Fills are triangle fans of each flattened subpath,
+// exact for convex shapes such as circles and rectangles, and strokes are a
+// quad per segment without joins or caps. Fades keep the alpha channel of
+// the texture, which is shown opaque. s->pixels is only a copy, read back by
+// canvas_flush() for the pixel accessors.
+
+#define GEOMETRY_TOLERANCE 0.25f // device pixels between curve and polygon
+
+static bool geometry_reserve(GeometryBatch *b, int vertices, int indices) {
+  if (b->vertex_count + vertices > b->vertex_capacity) {
+    int capacity = SDL_max(b->vertex_capacity * 2, b->vertex_count + vertices);
+    capacity = SDL_max(capacity, 1024);
+    SDL_Vertex *v = realloc(b->vertices, capacity * sizeof(SDL_Vertex));
+    if (!v) {
+      b->failed = true;
+      return false;
+    }
+    b->vertices = v;
+    b->vertex_capacity = capacity;
+  }
+  if (b->index_count + indices > b->index_capacity) {
+    int capacity = SDL_max(b->index_capacity * 2, b->index_count + indices);
+    capacity = SDL_max(capacity, 3072);
+    int *index = realloc(b->indices, capacity * sizeof(int));
+    if (!index) {
+      b->failed = true;
+      return false;
+    }
+    b->indices = index;
+    b->index_capacity = capacity;
+  }
+  return true;
+}
+
+// Draws the pending triangles.
+static void geometry_submit(JSCanvas *s) {
+  GeometryBatch *b = &s->batch;
+  if (b->index_count > 0) {
+    SDL_SetRenderDrawBlendMode(s->renderer, b->mode);
+    if (!SDL_RenderGeometry(s->renderer, NULL, b->vertices, b->vertex_count,
+                            b->indices, b->index_count)) {
+      fprintf(stderr, "SDL could not render geometry! SDL_Error: %s\n",
+              SDL_GetError());
+      b->failed = true;
+    }
+  }
+  b->vertex_count = 0;
+  b->index_count = 0;
+}
+
+// Switches the batch to mode and makes room. Returns false when the
+// primitive has to be dropped.
+static bool geometry_begin(JSCanvas *s, SDL_BlendMode mode, int vertices,
+                           int indices) {
+  GeometryBatch *b = &s->batch;
+  if (b->mode != mode) {
+    geometry_submit(s);
+    b->mode = mode;
+  }
+  return geometry_reserve(b, vertices, indices);
+}
+
+static void geometry_vertex(GeometryBatch *b, const plutovg_matrix_t *m,
+                            float x, float y, SDL_FColor color) {
+  SDL_Vertex *v = &b->vertices[b->vertex_count++];
+  plutovg_matrix_map(m, x, y, &v->position.x, &v->position.y);
+  v->color = color;
+  v->tex_coord = (SDL_FPoint){0, 0};
+}
+
+static void geometry_triangle(GeometryBatch *b, int i0, int i1, int i2) {
+  int *index = &b->indices[b->index_count];
+  index[0] = i0;
+  index[1] = i1;
+  index[2] = i2;
+  b->index_count += 3;
+}
+
+// A quad from four corners in order around it.
+static void geometry_quad(JSCanvas *s, SDL_BlendMode mode,
+                          const plutovg_matrix_t *m, const float *xy,
+                          SDL_FColor color) {
+  GeometryBatch *b = &s->batch;
+  if (!geometry_begin(s, mode, 4, 6)) {
+    return;
+  }
+  int first = b->vertex_count;
+  for (int i = 0; i < 4; i++) {
+    geometry_vertex(b, m, xy[i * 2], xy[i * 2 + 1], color);
+  }
+  geometry_triangle(b, first, first + 1, first + 2);
+  geometry_triangle(b, first, first + 2, first + 3);
+}
+
+static void geometry_rect(JSCanvas *s, SDL_BlendMode mode,
+                          const plutovg_matrix_t *m, plutovg_rect_t r,
+                          SDL_FColor color) {
+  float xy[8] = {r.x,       r.y,       r.x + r.w, r.y,
+                 r.x + r.w, r.y + r.h, r.x,       r.y + r.h};
+  geometry_quad(s, mode, m, xy, color);
+}
+
+static void geometry_line(JSCanvas *s, const plutovg_matrix_t *m, float x0,
+                          float y0, float x1, float y1, float width,
+                          SDL_FColor color) {
+  float dx = x1 - x0, dy = y1 - y0;
+  float length = sqrtf(dx * dx + dy * dy);
+  if (!(length > 0)) {
+    return;
+  }
+  // half the width across the segment
+  float nx = -dy / length * width / 2, ny = dx / length * width / 2;
+  float xy[8] = {x0 + nx, y0 + ny, x1 + nx, y1 + ny,
+                 x1 - nx, y1 - ny, x0 - nx, y0 - ny};
+  geometry_quad(s, SDL_BLENDMODE_BLEND_PREMULTIPLIED, m, xy, color);
+}
+
+static void geometry_circle(JSCanvas *s, const plutovg_matrix_t *m, float x,
+                            float y, float radius, SDL_FColor color) {
+  float device_radius = radius * sqrtf(fabsf(m->a * m->d - m->b * m->c));
+  int n = 8;
+  if (device_radius > GEOMETRY_TOLERANCE) {
+    // sides short enough to stay within the tolerance of the circle
+    float step = acosf(1 - GEOMETRY_TOLERANCE / device_radius);
+    n = SDL_clamp((int)ceilf(SDL_PI_F / step), 8, 256);
+  }
+  GeometryBatch *b = &s->batch;
+  if (!geometry_begin(s, SDL_BLENDMODE_BLEND_PREMULTIPLIED, n + 1, 3 * n)) {
+    return;
+  }
+  int center = b->vertex_count;
+  geometry_vertex(b, m, x, y, color);
+  for (int i = 0; i < n; i++) {
+    float angle = 2 * SDL_PI_F * i / n;
+    geometry_vertex(b, m, x + radius * cosf(angle), y + radius * sinf(angle),
+                    color);
+    geometry_triangle(b, center, center + 1 + i, center + 1 + (i + 1) % n);
+  }
+}
+
+typedef struct {
+  JSCanvas *canvas;
+  const plutovg_matrix_t *matrix;
+  SDL_FColor color;
+  float line_width; // 0 fills
+  int first;        // vertex starting the fan of the current subpath
+  int count;        // vertices in the fan
+  plutovg_point_t start;
+  plutovg_point_t current;
+} GeometryPath;
+
+static void geometry_path_element(void *closure,
+                                  plutovg_path_command_t command,
+                                  const plutovg_point_t *points,
+                                  int npoints) {
+  GeometryPath *g = closure;
+  GeometryBatch *b = &g->canvas->batch;
+  if (g->line_width > 0) {
+    if (command == PLUTOVG_PATH_COMMAND_MOVE_TO) {
+      g->start = g->current = points[0];
+      return;
+    }
+    plutovg_point_t to =
+        command == PLUTOVG_PATH_COMMAND_CLOSE ? g->start : points[0];
+    geometry_line(g->canvas, g->matrix, g->current.x, g->current.y, to.x,
+                  to.y, g->line_width, g->color);
+    g->current = to;
+    return;
+  }
+  if (command == PLUTOVG_PATH_COMMAND_CLOSE) {
+    return;
+  }
+  if (!geometry_begin(g->canvas, SDL_BLENDMODE_BLEND_PREMULTIPLIED, 1, 3)) {
+    return;
+  }
+  if (command == PLUTOVG_PATH_COMMAND_MOVE_TO) {
+    // a flush between elements would leave the fan behind
+    g->first = b->vertex_count;
+    g->count = 0;
+  } else if (g->first >= b->vertex_count) {
+    return;
+  }
+  geometry_vertex(b, g->matrix, points[0].x, points[0].y, g->color);
+  if (++g->count >= 3) {
+    geometry_triangle(b, g->first, b->vertex_count - 2, b->vertex_count - 1);
+  }
+}
+
+// Per-channel multiply and add of canvas_mul_add() as full-size quads.
+static void geometry_mul_add(JSCanvas *s, uint32_t add, uint32_t factors) {
+  plutovg_matrix_t identity;
+  plutovg_matrix_init_identity(&identity);
+  plutovg_rect_t all = {0, 0, s->width, s->height};
+  SDL_FColor a = {((add >> 16) & 0xff) / 255.0f, ((add >> 8) & 0xff) / 255.0f,
+                  (add & 0xff) / 255.0f, (add >> 24) / 255.0f};
+  if (factors == (255 - (add >> 24)) * 0x01010101u) {
+    // canvas_blend_solid()
+    geometry_rect(s, SDL_BLENDMODE_BLEND_PREMULTIPLIED, &identity, all, a);
+    return;
+  }
+  if ((factors & 0xffffff) != 0xffffff) {
+    SDL_FColor f = {((factors >> 16) & 0xff) / 255.0f,
+                    ((factors >> 8) & 0xff) / 255.0f,
+                    (factors & 0xff) / 255.0f, 1};
+    geometry_rect(s, SDL_BLENDMODE_MOD, &identity, all, f);
+  }
+  if ((add & 0xffffff) != 0) {
+    geometry_rect(s, SDL_BLENDMODE_ADD_PREMULTIPLIED, &identity, all, a);
+  }
+}
+
+// Draws the recorded commands into the texture, after s->pixels if they
+// changed. The commands are left to the caller. Returns -1 on errors.
+static int geometry_render(JSCanvas *s) {
+  if (s->command_count == 0 && !s->geometry_upload) {
+    return 0;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  SDL_Renderer *renderer = s->renderer;
+  GeometryBatch *b = &s->batch;
+  b->failed = false;
+  if (!SDL_SetRenderTarget(renderer, s->texture)) {
+    fprintf(stderr, "SDL could not set render target! SDL_Error: %s\n",
+            SDL_GetError());
+    return -1;
+  }
+  if (s->geometry_upload) {
+    if (!SDL_UpdateTexture(s->texture, NULL, s->pixels, s->width * 4)) {
+      fprintf(stderr, "SDL could not update texture! SDL_Error: %s\n",
+              SDL_GetError());
+      b->failed = true;
+    }
+    s->geometry_upload = false;
+  }
+  for (int i = 0; i < s->command_count; i++) {
+    const CanvasCommand *cmd = &s->commands[i];
+    float alpha = SDL_clamp(cmd->color.a * cmd->opacity, 0.0f, 1.0f);
+    SDL_FColor color = {SDL_clamp(cmd->color.r, 0.0f, 1.0f) * alpha,
+                        SDL_clamp(cmd->color.g, 0.0f, 1.0f) * alpha,
+                        SDL_clamp(cmd->color.b, 0.0f, 1.0f) * alpha, alpha};
+    switch (cmd->type) {
+    case CANVAS_COMMAND_CLEAR:
+      geometry_submit(s);
+      SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+      SDL_RenderClear(renderer);
+      break;
+    case CANVAS_COMMAND_MUL_ADD:
+      geometry_mul_add(s, cmd->u.mul_add.add, cmd->u.mul_add.factors);
+      break;
+    case CANVAS_COMMAND_CIRCLE:
+      geometry_circle(s, &cmd->matrix, cmd->u.circle.x, cmd->u.circle.y,
+                      cmd->u.circle.radius, color);
+      break;
+    case CANVAS_COMMAND_RECT:
+      if (cmd->op == PLUTOVG_OPERATOR_CLEAR) {
+        geometry_rect(s, SDL_BLENDMODE_NONE, &cmd->matrix, cmd->u.rect,
+                      (SDL_FColor){0, 0, 0, 0});
+      } else {
+        geometry_rect(s, SDL_BLENDMODE_BLEND_PREMULTIPLIED, &cmd->matrix,
+                      cmd->u.rect, color);
+      }
+      break;
+    case CANVAS_COMMAND_LINE:
+      geometry_line(s, &cmd->matrix, cmd->u.line.x0, cmd->u.line.y0,
+                    cmd->u.line.x1, cmd->u.line.y1, cmd->line_width, color);
+      break;
+    case CANVAS_COMMAND_PATH:
+    case CANVAS_COMMAND_STROKE: {
+      GeometryPath g = {
+          .canvas = s,
+          .matrix = &cmd->matrix,
+          .color = color,
+          .line_width =
+              cmd->type == CANVAS_COMMAND_STROKE ? cmd->line_width : 0,
+      };
+      plutovg_path_traverse_flatten(cmd->u.path, geometry_path_element, &g);
+      break;
+    }
+    }
+  }
+  geometry_submit(s);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+  SDL_SetRenderTarget(renderer, NULL);
+  BENCH_END(BENCH_RASTER);
+  return b->failed ? -1 : 0;
+}
+
+// Copies the texture into s->pixels.
+static void geometry_read_pixels(JSCanvas *s) {
+  SDL_SetRenderTarget(s->renderer, s->texture);
+  SDL_Surface *surface = SDL_RenderReadPixels(s->renderer, NULL);
+  SDL_SetRenderTarget(s->renderer, NULL);
+  if (!surface) {
+    fprintf(stderr, "SDL could not read pixels! SDL_Error: %s\n",
+            SDL_GetError());
+    return;
+  }
+  SDL_ConvertPixels(s->width, s->height, surface->format, surface->pixels,
+                    surface->pitch, SDL_PIXELFORMAT_ARGB8888, s->pixels,
+                    s->width * 4);
+  SDL_DestroySurface(surface);
+}
+
+// Rasterizes all recorded commands. Must run before anything reads pixels.
+static void canvas_flush(JSCanvas *s) {
+  if (s->geometry) {
+    // the pixel accessors want what the renderer drew so far
+    geometry_render(s);
+    canvas_discard_commands(s);
+    geometry_read_pixels(s);
+    return;
+  }
+  CanvasRaster *r = s->raster;
+  if (!r || s->command_count == 0) {
+    return;
+  }
+  BENCH_BEGIN(BENCH_RASTER);
+  SDL_SetAtomicInt(&r->next_tile, 0);
+  SDL_LockMutex(r->mutex);
+  r->busy = r->thread_count;
+  r->generation++;
+  SDL_BroadcastCondition(r->work_cond);
+  SDL_UnlockMutex(r->mutex);
+
+  canvas_raster_run_tiles(r);
+
+  SDL_LockMutex(r->mutex);
+  while (r->busy > 0) {
+    SDL_WaitCondition(r->done_cond, r->mutex);
+  }
+  SDL_UnlockMutex(r->mutex);
+  canvas_discard_commands(s);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Blends the pixels of a surface over the canvas, pixel (sx, sy) of the
+// surface landing on canvas pixel (left, top), for at most width x height
+// pixels.
+static void canvas_blit_surface(JSCanvas *s, plutovg_surface_t *surface,
+                                int sx, int sy, int width, int height,
+                                int left, int top, uint32_t alpha) {
+  const uint8_t *data = plutovg_surface_get_data(surface);
+  int stride = plutovg_surface_get_stride(surface);
+  int x0 = SDL_max(SDL_max(0, -sx), -left);
+  int y0 = SDL_max(SDL_max(0, -sy), -top);
+  int x1 = SDL_min(width, plutovg_surface_get_width(surface) - sx);
+  int y1 = SDL_min(height, plutovg_surface_get_height(surface) - sy);
+  x1 = SDL_min(x1, s->width - left);
+  y1 = SDL_min(y1, s->height - top);
+  if (x0 >= x1 || y0 >= y1 || alpha == 0) {
+    return;
+  }
+  for (int y = y0; y < y1; y++) {
+    uint32_t *dst = (uint32_t *)s->pixels + (size_t)(top + y) * s->width +
+                    left + x0;
+    const uint32_t *src =
+        (const uint32_t *)(data + (size_t)(sy + y) * stride) + sx + x0;
+    pixels_blend(dst, src, x1 - x0, alpha);
+  }
+}
+
+// Composites the src rectangle of a premultiplied ARGB32 surface, in its
+// pixels, over the dst rectangle in user space, with alpha on top of the
+// canvas opacity. Pending deferred drawing is finished first. When the
+// pixels land 1:1 on whole canvas pixels the rows are blended by the layer
+// kernels, otherwise plutovg draws the surface as a texture.
+static void canvas_draw_surface(JSCanvas *s, plutovg_surface_t *surface,
+                                const plutovg_rect_t *src,
+                                const plutovg_rect_t *dst, float alpha) {
+  if (!(src->w > 0 && src->h > 0) || dst->w == 0 || dst->h == 0) {
+    return;
+  }
+  canvas_flush(s);
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  alpha = SDL_clamp(alpha * plutovg_canvas_get_opacity(canvas), 0.0f, 1.0f);
+  plutovg_rect_t extents;
+  canvas_map_extents(s, dst->x, dst->y, dst->w, dst->h, &extents);
+  canvas_add_damage_extents(s, &extents);
+  s->geometry_upload = s->geometry;
+
+  BENCH_BEGIN(BENCH_RASTER);
+  plutovg_matrix_t m;
+  plutovg_canvas_get_matrix(canvas, &m);
+  float left = m.a * dst->x + m.e;
+  float top = m.d * dst->y + m.f;
+  // 1:1 at whole pixels; the bounds keep the int conversions defined, far
+  // rectangles go through plutovg
+  if (m.b == 0 && m.c == 0 && fabsf(m.a * dst->w - src->w) < 0.01f &&
+      fabsf(m.d * dst->h - src->h) < 0.01f && left == floorf(left) &&
+      top == floorf(top) && src->x == floorf(src->x) &&
+      src->y == floorf(src->y) && fabsf(left) < 1e6f && fabsf(top) < 1e6f &&
+      fabsf(src->x) < 1e6f && fabsf(src->y) < 1e6f && src->w < 1e6f &&
+      src->h < 1e6f) {
+    canvas_blit_surface(s, surface, (int)src->x, (int)src->y,
+                        (int)lroundf(src->w), (int)lroundf(src->h),
+                        (int)left, (int)top, (uint32_t)(alpha * 255 + 0.5f));
+    BENCH_END(BENCH_RASTER);
+    return;
+  }
+  // surface pixels to user space; the fill keeps the current path
+  plutovg_matrix_t texture;
+  plutovg_matrix_init_translate(&texture, dst->x, dst->y);
+  plutovg_matrix_scale(&texture, dst->w / src->w, dst->h / src->h);
+  plutovg_matrix_translate(&texture, -src->x, -src->y);
+  plutovg_path_t *rect = plutovg_path_create();
+  plutovg_path_add_rect(rect, dst->x, dst->y, dst->w, dst->h);
+  plutovg_canvas_save(canvas);
+  plutovg_canvas_set_opacity(canvas, 1);
+  plutovg_canvas_set_texture(canvas, surface, PLUTOVG_TEXTURE_TYPE_PLAIN,
+                             alpha, &texture);
+  plutovg_canvas_fill_path(canvas, rect);
+  plutovg_canvas_restore(canvas);
+  plutovg_path_destroy(rect);
+  BENCH_END(BENCH_RASTER);
+}
+
+// Composites layer over the canvas, its top left corner at (x, y) and its
+// view size in canvas units. Pending deferred drawing of the layer is
+// finished first.
+static void canvas_draw_layer(JSCanvas *s, JSCanvas *layer, float x, float y,
+                              float alpha) {
+  if (canvas_record(s, RECORD_DRAW_CANVAS)) {
+    recorder_u32(layer->record_id);
+    recorder_f32(x);
+    recorder_f32(y);
+    recorder_f32(alpha);
+  }
+  canvas_flush(layer);
+  plutovg_rect_t src = {.x = 0, .y = 0, .w = layer->width, .h = layer->height};
+  plutovg_rect_t dst = {
+      .x = x, .y = y, .w = layer->view_width, .h = layer->view_height};
+  canvas_draw_surface(s, layer->plutovg_surface, &src, &dst, alpha);
+}
+
+// Text: font faces are loaded once and shared by every canvas. Glyph
+// coverage is rasterized by plutovg into one atlas, keyed by face, device
+// size in quarter pixels and the subpixel position of the pen in quarter
+// pixels, and strings are drawn as mask blits from it. Decoded runs of
+// recently drawn strings keep their codepoints and pen offsets, so a string
+// drawn every frame is decoded once. When the atlas or the glyph table is
+// full, every glyph is dropped and rasterized again on demand. Transforms
+// that rotate, skew or scale unevenly, and very large text, fall back to
+// plutovg filling the glyph outlines.
+
+#define TEXT_MAX_FACES 32
+#define TEXT_ATLAS_SIZE 1024
+#define TEXT_GLYPH_SLOTS 4096 // power of two
+#define TEXT_RUN_SLOTS 256    // power of two
+#define TEXT_SIZE_STEPS 4
+#define TEXT_SUBPIXELS 4
+#define TEXT_MAX_ATLAS_SIZE 128 // device pixels
+#define TEXT_DEFAULT_FONT "10px sans-serif"
+
+typedef struct {
+  char *family; // the name canvas.font uses, or the file path
+  plutovg_font_face_t *face;
+} TextFace;
+
+typedef struct {
+  plutovg_codepoint_t codepoint;
+  uint16_t face; // index + 1 in text_faces, 0 for a free slot
+  uint16_t subpixel;
+  uint32_t size; // device size in 1 / TEXT_SIZE_STEPS pixels
+  // mask in the atlas, and its offset from the pen on the baseline
+  uint16_t x, y, width, height;
+  int16_t left, top;
+} TextGlyph;
+
+typedef struct {
+  char *text; // NULL for a free slot
+  size_t length;
+  int face;
+  int count;
+  plutovg_codepoint_t *codepoints;
+  float *offsets; // pen position of each glyph at size 1
+  float width;    // advance of the whole run at size 1
+} TextRun;
+
+// generic families tried in order when no face was loaded under their name
+static const struct {
+  const char *family;
+  const char *path;
+} text_system_fonts[] = {
+    {"sans-serif", "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"},
+    {"sans-serif", "/usr/share/fonts/TTF/DejaVuSans.ttf"},
+    {"sans-serif", "/System/Library/Fonts/Supplemental/Arial.ttf"},
+    {"sans-serif", "C:/Windows/Fonts/arial.ttf"},
+    {"serif", "/usr/share/fonts/truetype/dejavu/DejaVuSerif.ttf"},
+    {"serif", "/usr/share/fonts/TTF/DejaVuSerif.ttf"},
+    {"serif", "/System/Library/Fonts/Supplemental/Times New Roman.ttf"},
+    {"serif", "C:/Windows/Fonts/times.ttf"},
+    {"monospace", "/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf"},
+    {"monospace", "/usr/share/fonts/TTF/DejaVuSansMono.ttf"},
+    {"monospace", "/System/Library/Fonts/Supplemental/Courier New.ttf"},
+    {"monospace", "C:/Windows/Fonts/cour.ttf"},
+};
+
+static TextFace text_faces[TEXT_MAX_FACES];
+static int text_face_count;
+static uint8_t *text_atlas; // TEXT_ATLAS_SIZE x TEXT_ATLAS_SIZE coverage
+static int text_atlas_x, text_atlas_y, text_atlas_row; // shelf packing
+static TextGlyph text_glyphs[TEXT_GLYPH_SLOTS];
+static int text_glyph_count;
+static TextRun text_runs[TEXT_RUN_SLOTS];
+
+// Loads the font file at path and registers it as family. Returns its index
+// in text_faces, or -1.
+static int text_face_load(const char *family, const char *path) {
+  if (text_face_count == TEXT_MAX_FACES) {
+    return -1;
+  }
+  plutovg_font_face_t *face = plutovg_font_face_load_from_file(path, 0);
+  if (!face) {
+    return -1;
+  }
+  char *name = strdup(family);
+  if (!name) {
+    plutovg_font_face_destroy(face);
+    return -1;
+  }
+  int index = text_face_count++;
+  text_faces[index] = (TextFace){.family = name, .face = face};
+  if (recorder.file) {
+    recorder_u8(RECORD_FONT);
+    recorder_u32(index);
+    recorder_string(path, strlen(path));
+  }
+  return index;
+}
+
+// Index of the face registered as family, the latest one if several were.
+// Generic families and font file paths are loaded the first time.
+static int text_face_find(const char *family) {
+  for (int i = text_face_count - 1; i >= 0; i--) {
+    if (!SDL_strcasecmp(text_faces[i].family, family)) {
+      return i;
+    }
+  }
+  for (size_t i = 0; i < countof(text_system_fonts); i++) {
+    if (!SDL_strcasecmp(text_system_fonts[i].family, family)) {
+      int index = text_face_load(family, text_system_fonts[i].path);
+      if (index >= 0) {
+        return index;
+      }
+    }
+  }
+  struct stat st;
+  if (stat(family, &st) == 0 && S_ISREG(st.st_mode)) {
+    return text_face_load(family, family);
+  }
+  return -1;
+}
+
+// Parses the size of a CSS-like font, "[style...] <size>px[/<line height>]
+// <family>[, <family>...]". Returns where the families start, or NULL.
+static const char *text_parse_font(const char *font, float *size) {
+  const char *p = font;
+  while (*p) {
+    while (*p == ' ') {
+      p++;
+    }
+    char *end;
+    float v = strtof(p, &end);
+    if (end != p && !strncmp(end, "px", 2)) {
+      p = end + 2;
+      if (*p == '/') {
+        p += strcspn(p, " ");
+      }
+      if (*p != ' ' || !(v > 0 && v < 10000)) {
+        return NULL;
+      }
+      while (*p == ' ') {
+        p++;
+      }
+      *size = v;
+      return *p ? p : NULL;
+    }
+    p += strcspn(p, " ");
+  }
+  return NULL;
+}
+
+// The face of the first family in a comma-separated list that has one, or
+// -1.
+static int text_find_families(const char *families) {
+  char name[256];
+  while (*families) {
+    const char *start = families;
+    const char *end = families + strcspn(families, ",");
+    families = *end ? end + 1 : end;
+    while (start < end && strchr(" \"'", *start)) {
+      start++;
+    }
+    while (end > start && strchr(" \"'", end[-1])) {
+      end--;
+    }
+    if (end > start && (size_t)(end - start) < sizeof(name)) {
+      memcpy(name, start, end - start);
+      name[end - start] = '\0';
+      int face = text_face_find(name);
+      if (face >= 0) {
+        return face;
+      }
+    }
+  }
+  return -1;
+}
+
+// Drops every glyph, making room in the atlas.
+static void text_atlas_reset(void) {
+  memset(text_glyphs, 0, sizeof(text_glyphs));
+  text_glyph_count = 0;
+  text_atlas_x = 0;
+  text_atlas_y = 0;
+  text_atlas_row = 0;
+}
+
+// Rasterizes a glyph into the atlas. Returns false when the atlas is full;
+// glyphs that cannot be rasterized otherwise are left empty.
+static bool text_glyph_rasterize(TextGlyph *g) {
+  if (!text_atlas) {
+    text_atlas = malloc(TEXT_ATLAS_SIZE * TEXT_ATLAS_SIZE);
+    if (!text_atlas) {
+      return true;
+    }
+  }
+  plutovg_path_t *path = plutovg_path_create();
+  if (!path) {
+    return true;
+  }
+  plutovg_font_face_get_glyph_path(
+      text_faces[g->face - 1].face, (float)g->size / TEXT_SIZE_STEPS,
+      (float)g->subpixel / TEXT_SUBPIXELS, 0, g->codepoint, path);
+  plutovg_rect_t extents;
+  plutovg_path_extents(path, &extents, true);
+  int left = (int)floorf(extents.x);
+  int top = (int)floorf(extents.y);
+  int width = (int)ceilf(extents.x + extents.w) - left;
+  int height = (int)ceilf(extents.y + extents.h) - top;
+  if (width <= 0 || height <= 0) {
+    // spaces
+    plutovg_path_destroy(path);
+    return true;
+  }
+  if (text_atlas_x + width > TEXT_ATLAS_SIZE) {
+    text_atlas_x = 0;
+    text_atlas_y += text_atlas_row;
+    text_atlas_row = 0;
+  }
+  if (text_atlas_y + height > TEXT_ATLAS_SIZE) {
+    plutovg_path_destroy(path);
+    return false;
+  }
+  plutovg_surface_t *surface = plutovg_surface_create(width, height);
+  plutovg_canvas_t *canvas = surface ? plutovg_canvas_create(surface) : NULL;
+  if (canvas) {
+    plutovg_canvas_translate(canvas, -left, -top);
+    plutovg_canvas_set_rgba(canvas, 1, 1, 1, 1);
+    plutovg_canvas_fill_path(canvas, path);
+    const uint8_t *data = plutovg_surface_get_data(surface);
+    int stride = plutovg_surface_get_stride(surface);
+    uint8_t *mask = text_atlas + text_atlas_y * TEXT_ATLAS_SIZE + text_atlas_x;
+    for (int y = 0; y < height; y++) {
+      const uint32_t *row = (const uint32_t *)(data + y * stride);
+      for (int x = 0; x < width; x++) {
+        mask[y * TEXT_ATLAS_SIZE + x] = row[x] >> 24;
+      }
+    }
+    g->x = text_atlas_x;
+    g->y = text_atlas_y;
+    g->width = width;
+    g->height = height;
+    g->left = left;
+    g->top = top;
+    text_atlas_x += width;
+    text_atlas_row = SDL_max(text_atlas_row, height);
+    plutovg_canvas_destroy(canvas);
+  }
+  if (surface) {
+    plutovg_surface_destroy(surface);
+  }
+  plutovg_path_destroy(path);
+  return true;
+}
+
+// The glyph of a codepoint at a device size and pen subpixel, rasterized on
+// first use. Returns NULL when the atlas or the table is full.
+static const TextGlyph *text_glyph_lookup(int face, uint32_t size,
+                                          plutovg_codepoint_t codepoint,
+                                          int subpixel) {
+  uint32_t h = codepoint * 0x9E3779B1u ^ size * 0x85EBCA77u ^
+               (uint32_t)(face * TEXT_SUBPIXELS + subpixel) * 0xC2B2AE3Du;
+  h ^= h >> 16;
+  for (;; h++) {
+    TextGlyph *g = &text_glyphs[h & (TEXT_GLYPH_SLOTS - 1)];
+    if (g->face == 0) {
+      if (text_glyph_count >= TEXT_GLYPH_SLOTS * 3 / 4) {
+        return NULL;
+      }
+      *g = (TextGlyph){.codepoint = codepoint,
+                       .face = face + 1,
+                       .subpixel = subpixel,
+                       .size = size};
+      if (!text_glyph_rasterize(g)) {
+        g->face = 0;
+        return NULL;
+      }
+      text_glyph_count++;
+      return g;
+    }
+    if (g->codepoint == codepoint && g->face == face + 1 &&
+        g->size == size && g->subpixel == subpixel) {
+      return g;
+    }
+  }
+}
+
+static void text_run_free(TextRun *run) {
+  free(run->text);
+  free(run->codepoints);
+  free(run->offsets);
+  *run = (TextRun){0};
+}
+
+// The decoded run of a UTF-8 string, from the cache or decoded now. Returns
+// NULL when out of memory.
+static const TextRun *text_run_lookup(int face, const char *text,
+                                      size_t length) {
+  uint32_t h = 2166136261u ^ (uint32_t)face;
+  for (size_t i = 0; i < length; i++) {
+    h = (h ^ (uint8_t)text[i]) * 16777619u;
+  }
+  TextRun *run = &text_runs[h & (TEXT_RUN_SLOTS - 1)];
+  if (run->text && run->face == face && run->length == length &&
+      !memcmp(run->text, text, length)) {
+    return run;
+  }
+  text_run_free(run);
+  // a codepoint takes at least one byte
+  run->text = malloc(length + 1);
+  run->codepoints = malloc((length + 1) * sizeof(plutovg_codepoint_t));
+  run->offsets = malloc((length + 1) * sizeof(float));
+  if (!run->text || !run->codepoints || !run->offsets) {
+    text_run_free(run);
+    return NULL;
+  }
+  memcpy(run->text, text, length);
+  run->length = length;
+  run->face = face;
+  plutovg_text_iterator_t it;
+  plutovg_text_iterator_init(&it, text, (int)length,
+                             PLUTOVG_TEXT_ENCODING_UTF8);
+  while (plutovg_text_iterator_has_next(&it)) {
+    plutovg_codepoint_t codepoint = plutovg_text_iterator_next(&it);
+    float advance;
+    plutovg_font_face_get_glyph_metrics(text_faces[face].face, 1, codepoint,
+                                        &advance, NULL, NULL);
+    run->codepoints[run->count] = codepoint;
+    run->offsets[run->count] = run->width;
+    run->count++;
+    run->width += advance;
+  }
+  return run;
+}
+
+static void text_free(void) {
+  for (int i = 0; i < TEXT_RUN_SLOTS; i++) {
+    text_run_free(&text_runs[i]);
+  }
+  for (int i = 0; i < text_face_count; i++) {
+    free(text_faces[i].family);
+    plutovg_font_face_destroy(text_faces[i].face);
+  }
+  text_face_count = 0;
+  free(text_atlas);
+  text_atlas = NULL;
+  text_atlas_reset();
+}
+
+// Blits the glyphs of a run from the atlas, pen positions rounded to
+// quarter pixels and the baseline to whole pixels.
+static void canvas_blit_text(JSCanvas *s, int face, const TextRun *run,
+                             uint32_t size, float x, float y,
+                             uint32_t color) {
+  float scale = (float)size / TEXT_SIZE_STEPS;
+  int baseline = (int)lroundf(y);
+  for (int i = 0; i < run->count; i++) {
+    float pen = floorf((x + run->offsets[i] * scale) * TEXT_SUBPIXELS + 0.5f);
+    if (!(fabsf(pen) < 1e6f)) {
+      continue;
+    }
+    int px = (int)floorf(pen / TEXT_SUBPIXELS);
+    int subpixel = (int)(pen - (float)px * TEXT_SUBPIXELS);
+    const TextGlyph *g =
+        text_glyph_lookup(face, size, run->codepoints[i], subpixel);
+    if (!g) {
+      text_atlas_reset();
+      g = text_glyph_lookup(face, size, run->codepoints[i], subpixel);
+    }
+    if (g && g->width) {
+      canvas_blit_mask(s, text_atlas + g->y * TEXT_ATLAS_SIZE + g->x,
+                       TEXT_ATLAS_SIZE, g->width, g->height, px + g->left,
+                       baseline + g->top, color, 0, s->height);
+    }
+  }
+}
+
+// Fills a UTF-8 string with the current paint, the start of its baseline at
+// (x, y). Text is drawn right away, after whatever was deferred.
+static void canvas_fill_text(JSCanvas *s, int face, float size,
+                             const char *text, size_t length, float x,
+                             float y) {
+  if (canvas_record(s, RECORD_TEXT)) {
+    recorder_u32(face);
+    recorder_f32(size);
+    recorder_f32(x);
+    recorder_f32(y);
+    recorder_string(text, length);
+  }
+  const TextRun *run = text_run_lookup(face, text, length);
+  if (!run || run->count == 0) {
+    return;
+  }
+  canvas_flush(s);
+  plutovg_canvas_t *canvas = s->plutovg_canvas;
+  plutovg_font_face_t *font_face = text_faces[face].face;
+  plutovg_rect_t bounds;
+  plutovg_font_face_get_metrics(font_face, size, NULL, NULL, NULL, &bounds);
+  plutovg_rect_t extents;
+  canvas_map_extents(s, x + bounds.x, y + bounds.y,
+                     run->width * size + bounds.w, bounds.h, &extents);
+  canvas_add_damage_extents(s, &extents);
+  s->geometry_upload = s->geometry;
+
+  BENCH_BEGIN(BENCH_RASTER);
+  plutovg_matrix_t m;
+  plutovg_canvas_get_matrix(canvas, &m);
+  float device_size = m.a * size;
+  if (m.b == 0 && m.c == 0 && m.a == m.d && device_size > 0 &&
+      device_size <= TEXT_MAX_ATLAS_SIZE) {
+    uint32_t color =
+        canvas_premultiply(&s->paint, plutovg_canvas_get_opacity(canvas));
+    uint32_t steps = (uint32_t)lroundf(device_size * TEXT_SIZE_STEPS);
+    if (steps > 0) {
+      canvas_blit_text(s, face, run, steps, m.a * x + m.e, m.d * y + m.f,
+                       color);
+    }
+    BENCH_END(BENCH_RASTER);
+    return;
+  }
+  // the fill keeps the current path
+  plutovg_path_t *path = plutovg_path_create();
+  for (int i = 0; path && i < run->count; i++) {
+    plutovg_font_face_get_glyph_path(font_face, size,
+                                     x + run->offsets[i] * size, y,
+                                     run->codepoints[i], path);
+  }
+  if (path) {
+    plutovg_canvas_fill_path(canvas, path);
+    plutovg_path_destroy(path);
+  }
+  BENCH_END(BENCH_RASTER);
+}
+
+// #endregion
+
+// #region Image
+//
+// loadImage(path) returns a Promise of an Image. Files are read and decoded
+// by a few loader threads: QOI here, PNG, JPEG, BMP, GIF and TGA by plutovg.
+// A worker writes a byte to a pipe when a decode is done, and the
+// os.setReadHandler() callback on the other end settles the promises on the
+// main thread, so they resolve through the job queue js_std_loop drives.
+// The callback is registered only while decodes are pending: loads keep the
+// loop alive, finished ones do not.
+//
+// Decoded images are premultiplied ARGB32 plutovg surfaces, the layout of
+// the canvas pixels, cached by path with the most recently used first.
+// Image objects pin their entry; unpinned entries are dropped, least
+// recently used first, while the cache holds more than Image.cacheBudget
+// bytes, checked when a decode finishes, on loadImage() and when the budget
+// changes. Loading a cached path resolves without decoding again.
+
+#define IMAGE_MAX_THREADS 4
+#define IMAGE_DEFAULT_BUDGET ((int64_t)256 << 20)
+#define IMAGE_MAX_SIZE 16384 // QOI pixels per side
+
+typedef struct ImageWaiter {
+  JSValue resolve;
+  JSValue reject;
+  struct ImageWaiter *next;
+} ImageWaiter;
+
+typedef struct ImageEntry {
+  char *path;
+  // written by the worker decoding the entry, read once it is done
+  plutovg_surface_t *surface; // NULL when decoding failed
+  char error[256];
+  int width;
+  int height;
+  size_t bytes;
+
+  int refcount; // Image objects of the entry
+  bool loading;
+  ImageWaiter *waiters;           // promises settled when decoded
+  struct ImageEntry *prev, *next; // cache order, most recent first
+  struct ImageEntry *job_next;    // decode queue, then done list
+  uint32_t record_id;             // --record: id of the pixels
+} ImageEntry;
+
+typedef struct {
+  SDL_Thread *threads[IMAGE_MAX_THREADS];
+  int thread_count;
+  SDL_Mutex *mutex;
+  SDL_Condition *work_cond;
+  // guarded by mutex
+  ImageEntry *queue;
+  ImageEntry *queue_tail;
+  ImageEntry *done;
+  bool quit;
+  int wake[2]; // pipe, workers write a byte after adding to done
+
+  // main thread only
+  ImageEntry *first;
+  ImageEntry *last;
+  size_t bytes; // pixels of the decoded entries
+  int64_t budget;
+  int pending; // entries queued or decoding
+  bool watching;
+  JSValue set_read_handler; // os.setReadHandler, looked up on first use
+  JSValue on_wake;
+  uint32_t next_record_id;
+} ImageLoader;
+
+static ImageLoader image_loader = {.wake = {-1, -1},
+                                   .budget = IMAGE_DEFAULT_BUDGET};
+static JSClassID js_image_class_id;
+
+static uint32_t image_read_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+// Decodes a QOI file (https://qoiformat.org) into a premultiplied ARGB32
+// surface. Truncated streams repeat their last pixel.
+static plutovg_surface_t *image_decode_qoi(const uint8_t *data, size_t size) {
+  // header, then chunks, then 8 bytes of padding
+  if (size < 14 + 8 || memcmp(data, "qoif", 4)) {
+    return NULL;
+  }
+  uint32_t width = image_read_be32(data + 4);
+  uint32_t height = image_read_be32(data + 8);
+  if (width == 0 || height == 0 || width > IMAGE_MAX_SIZE ||
+      height > IMAGE_MAX_SIZE) {
+    return NULL;
+  }
+  plutovg_surface_t *surface = plutovg_surface_create(width, height);
+  if (!surface) {
+    return NULL;
+  }
+  uint8_t *pixels = plutovg_surface_get_data(surface);
+  int stride = plutovg_surface_get_stride(surface);
+  uint8_t index[64][4] = {{0}};
+  uint8_t px[4] = {0, 0, 0, 255}; // r, g, b, a
+  // chunks are at most 5 bytes, so they never read into the padding
+  const uint8_t *p = data + 14;
+  const uint8_t *end = data + size - 8;
+  int run = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    uint32_t *row = (uint32_t *)(pixels + (size_t)y * stride);
+    for (uint32_t x = 0; x < width; x++) {
+      if (run > 0) {
+        run--;
+      } else if (p < end) {
+        uint8_t b1 = *p++;
+        if (b1 == 0xfe) { // QOI_OP_RGB
+          memcpy(px, p, 3);
+          p += 3;
+        } else if (b1 == 0xff) { // QOI_OP_RGBA
+          memcpy(px, p, 4);
+          p += 4;
+        } else if ((b1 & 0xc0) == 0x00) { // QOI_OP_INDEX
+          memcpy(px, index[b1], 4);
+        } else if ((b1 & 0xc0) == 0x40) { // QOI_OP_DIFF
+          px[0] += ((b1 >> 4) & 3) - 2;
+          px[1] += ((b1 >> 2) & 3) - 2;
+          px[2] += (b1 & 3) - 2;
+        } else if ((b1 & 0xc0) == 0x80) { // QOI_OP_LUMA
+          uint8_t b2 = *p++;
+          int vg = (b1 & 0x3f) - 32;
+          px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+          px[1] += vg;
+          px[2] += vg - 8 + (b2 & 0x0f);
+        } else { // QOI_OP_RUN
+          run = b1 & 0x3f;
+        }
+        memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64],
+               px, 4);
+      }
+      uint32_t a = px[3];
+      row[x] = a << 24 | pixel_div255(px[0] * a) << 16 |
+               pixel_div255(px[1] * a) << 8 | pixel_div255(px[2] * a);
+    }
+  }
+  return surface;
+}
+
+// Reads and decodes an entry, on a loader thread.
+static void image_decode(ImageEntry *e) {
+  size_t size;
+  void *data = SDL_LoadFile(e->path, &size);
+  if (!data) {
+    snprintf(e->error, sizeof(e->error), "could not read '%s': %s", e->path,
+             SDL_GetError());
+    return;
+  }
+  plutovg_surface_t *surface = NULL;
+  if (size >= 4 && !memcmp(data, "qoif", 4)) {
+    surface = image_decode_qoi(data, size);
+  } else if (size <= 0x7fffffff) {
+    surface = plutovg_surface_load_from_image_data(data, (int)size);
+  }
+  SDL_free(data);
+  if (!surface) {
+    snprintf(e->error, sizeof(e->error), "could not decode '%s'", e->path);
+    return;
+  }
+  e->surface = surface;
+  e->width = plutovg_surface_get_width(surface);
+  e->height = plutovg_surface_get_height(surface);
+  e->bytes = (size_t)plutovg_surface_get_stride(surface) * e->height;
+}
+
+static int image_worker(void *data) {
+  ImageLoader *l = data;
+  SDL_LockMutex(l->mutex);
+  while (!l->quit) {
+    ImageEntry *e = l->queue;
+    if (!e) {
+      SDL_WaitCondition(l->work_cond, l->mutex);
+      continue;
+    }
+    l->queue = e->job_next;
+    SDL_UnlockMutex(l->mutex);
+    uint64_t start = trace_now();
+    image_decode(e);
+    trace_span("decode image", start);
+    SDL_LockMutex(l->mutex);
+    e->job_next = l->done;
+    l->done = e;
+    // only wakes the main thread up, a full pipe already does
+    uint8_t byte = 1;
+    (void)!write(l->wake[1], &byte, 1);
+  }
+  SDL_UnlockMutex(l->mutex);
+  return 0;
+}
+
+// Starts the loader threads on first use.
+static int image_loader_start(void) {
+  ImageLoader *l = &image_loader;
+  if (l->thread_count > 0) {
+    return 0;
+  }
+  if (l->mutex) {
+    return -1; // failed before
+  }
+  l->mutex = SDL_CreateMutex();
+  l->work_cond = SDL_CreateCondition();
+  if (!l->mutex || !l->work_cond) {
+    return -1;
+  }
+  if (pipe(l->wake)) {
+    perror("pipe");
+    l->wake[0] = l->wake[1] = -1;
+    return -1;
+  }
+  fcntl(l->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(l->wake[1], F_SETFL, O_NONBLOCK);
+  int count =
+      SDL_clamp(SDL_GetNumLogicalCPUCores() - 1, 1, IMAGE_MAX_THREADS);
+  for (int i = 0; i < count; i++) {
+    l->threads[i] = SDL_CreateThread(image_worker, "image", l);
+    if (!l->threads[i]) {
+      fprintf(stderr, "SDL could not create thread! SDL_Error: %s\n",
+              SDL_GetError());
+      break;
+    }
+    l->thread_count++;
+  }
+  return l->thread_count > 0 ? 0 : -1;
+}
+
+static ImageEntry *image_cache_find(const char *path) {
+  for (ImageEntry *e = image_loader.first; e; e = e->next) {
+    if (!strcmp(e->path, path)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void image_cache_unlink(ImageEntry *e) {
+  ImageLoader *l = &image_loader;
+  *(e->prev ? &e->prev->next : &l->first) = e->next;
+  *(e->next ? &e->next->prev : &l->last) = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void image_cache_push(ImageEntry *e) {
+  ImageLoader *l = &image_loader;
+  e->next = l->first;
+  *(l->first ? &l->first->prev : &l->last) = e;
+  l->first = e;
+}
+
+// Marks an entry as the most recently used.
+static void image_cache_touch(ImageEntry *e) {
+  if (image_loader.first != e) {
+    image_cache_unlink(e);
+    image_cache_push(e);
+  }
+}
+
+static void image_cache_remove(ImageEntry *e) {
+  image_cache_unlink(e);
+  image_loader.bytes -= e->bytes;
+  if (e->surface) {
+    plutovg_surface_destroy(e->surface);
+  }
+  free(e->path);
+  free(e);
+}
+
+// Drops unused entries, least recently used first, until the cache fits
+// in its budget.
+static void image_cache_trim(void) {
+  ImageLoader *l = &image_loader;
+  ImageEntry *e = l->last;
+  while (e && (int64_t)l->bytes > l->budget) {
+    ImageEntry *prev = e->prev;
+    if (e->refcount == 0 && !e->loading) {
+      image_cache_remove(e);
+    }
+    e = prev;
+  }
+}
+
+static JSValue js_image_new(JSContext *ctx, ImageEntry *e) {
+  JSValue obj = JS_NewObjectClass(ctx, js_image_class_id);
+  if (!JS_IsException(obj)) {
+    JS_SetOpaque(obj, e);
+    e->refcount++;
+  }
+  return obj;
+}
+
+// Registers the wake callback with os.setReadHandler() while decodes are
+// pending, and removes it once they are done.
+static int image_loader_watch(JSContext *ctx, bool watch) {
+  ImageLoader *l = &image_loader;
+  if (watch == l->watching) {
+    return 0;
+  }
+  if (JS_IsUndefined(l->set_read_handler)) {
+    JSValue global = JS_GetGlobalObject(ctx);
+    JSValue os = JS_GetPropertyStr(ctx, global, "os");
+    JS_FreeValue(ctx, global);
+    if (JS_IsException(os)) {
+      return -1;
+    }
+    l->set_read_handler = JS_GetPropertyStr(ctx, os, "setReadHandler");
+    JS_FreeValue(ctx, os);
+    if (JS_IsException(l->set_read_handler)) {
+      l->set_read_handler = JS_UNDEFINED;
+      return -1;
+    }
+  }
+  JSValue args[2] = {JS_NewInt32(ctx, l->wake[0]),
+                     watch ? l->on_wake : JS_NULL};
+  JSValue ret = JS_Call(ctx, l->set_read_handler, JS_UNDEFINED, 2, args);
+  if (JS_IsException(ret)) {
+    return -1;
+  }
+  JS_FreeValue(ctx, ret);
+  l->watching = watch;
+  return 0;
+}
+
+// Settles the promises waiting for an entry, in the order of the calls.
+// The caller pins the entry: freeing a resolve function can release the
+// last Image of it.
+static void image_settle(JSContext *ctx, ImageEntry *e) {
+  ImageWaiter *w = NULL;
+  while (e->waiters) {
+    ImageWaiter *next = e->waiters->next;
+    e->waiters->next = w;
+    w = e->waiters;
+    e->waiters = next;
+  }
+  while (w) {
+    JSValue arg;
+    JSValueConst func = w->resolve;
+    if (e->surface) {
+      arg = js_image_new(ctx, e);
+    } else {
+      arg = JS_NewError(ctx);
+      if (!JS_IsException(arg)) {
+        JS_DefinePropertyValueStr(ctx, arg, "message",
+                                  JS_NewString(ctx, e->error),
+                                  JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+      }
+    }
+    if (JS_IsException(arg)) {
+      arg = JS_GetException(ctx);
+      func = w->reject;
+    } else if (!e->surface) {
+      func = w->reject;
+    }
+    JSValue ret = JS_Call(ctx, func, JS_UNDEFINED, 1, &arg);
+    if (JS_IsException(ret)) {
+      js_std_dump_error(ctx);
+    }
+    JS_FreeValue(ctx, ret);
+    JS_FreeValue(ctx, arg);
+    JS_FreeValue(ctx, w->resolve);
+    JS_FreeValue(ctx, w->reject);
+    ImageWaiter *next = w->next;
+    free(w);
+    w = next;
+  }
+}
+
+// os.setReadHandler() callback: settles the promises of finished decodes.
+static JSValue js_image_loader_wake(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  ImageLoader *l = &image_loader;
+  uint8_t buf[64];
+  while (read(l->wake[0], buf, sizeof(buf)) > 0) {
+  }
+  SDL_LockMutex(l->mutex);
+  ImageEntry *done = l->done;
+  l->done = NULL;
+  SDL_UnlockMutex(l->mutex);
+  while (done) {
+    ImageEntry *e = done;
+    done = e->job_next;
+    e->loading = false;
+    l->pending--;
+    l->bytes += e->bytes;
+    e->refcount++;
+    image_settle(ctx, e);
+    e->refcount--;
+    if (!e->surface) {
+      // a later loadImage() tries again
+      image_cache_remove(e);
+    }
+  }
+  // entries are trimmed here and in loadImage(), never from a finalizer
+  image_cache_trim();
+  if (image_loader_watch(ctx, l->pending > 0)) {
+    return JS_EXCEPTION;
+  }
+  return JS_UNDEFINED;
+}
+
+// Queues the decode of a new entry. Returns NULL with a pending exception.
+static ImageEntry *image_load_async(JSContext *ctx, const char *path) {
+  ImageLoader *l = &image_loader;
+  if (image_loader_start()) {
+    JS_ThrowInternalError(ctx, "could not start the image loader");
+    return NULL;
+  }
+  ImageEntry *e = calloc(1, sizeof(ImageEntry));
+  if (!e || !(e->path = strdup(path))) {
+    free(e);
+    JS_ThrowOutOfMemory(ctx);
+    return NULL;
+  }
+  e->loading = true;
+  image_cache_push(e);
+  SDL_LockMutex(l->mutex);
+  *(l->queue ? &l->queue_tail->job_next : &l->queue) = e;
+  l->queue_tail = e;
+  SDL_SignalCondition(l->work_cond);
+  SDL_UnlockMutex(l->mutex);
+  l->pending++;
+  if (image_loader_watch(ctx, true)) {
+    return NULL;
+  }
+  return e;
+}
+
+// loadImage(path) returns a Promise of the decoded Image.
+static JSValue js_load_image(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "loadImage() expected 1 argument, but got %d\n", argc);
+    return JS_EXCEPTION;
+  }
+  const char *path = JS_ToCString(ctx, argv[0]);
+  if (!path) {
+    return JS_EXCEPTION;
+  }
+  ImageEntry *e = image_cache_find(path);
+  if (!e) {
+    e = image_load_async(ctx, path);
+  }
+  JS_FreeCString(ctx, path);
+  if (!e) {
+    return JS_EXCEPTION;
+  }
+  JSValue funcs[2];
+  JSValue promise = JS_NewPromiseCapability(ctx, funcs);
+  if (JS_IsException(promise)) {
+    return promise;
+  }
+  if (e->loading) {
+    ImageWaiter *w = malloc(sizeof(ImageWaiter));
+    if (!w) {
+      JS_FreeValue(ctx, funcs[0]);
+      JS_FreeValue(ctx, funcs[1]);
+      JS_FreeValue(ctx, promise);
+      return JS_ThrowOutOfMemory(ctx);
+    }
+    *w = (ImageWaiter){.resolve = funcs[0], .reject = funcs[1]};
+    w->next = e->waiters;
+    e->waiters = w;
+    image_cache_trim();
+    return promise;
+  }
+  image_cache_touch(e);
+  JSValue image = js_image_new(ctx, e);
+  JSValue ret;
+  if (JS_IsException(image)) {
+    image = JS_GetException(ctx);
+    ret = JS_Call(ctx, funcs[1], JS_UNDEFINED, 1, &image);
+  } else {
+    ret = JS_Call(ctx, funcs[0], JS_UNDEFINED, 1, &image);
+  }
+  JS_FreeValue(ctx, image);
+  JS_FreeValue(ctx, funcs[0]);
+  JS_FreeValue(ctx, funcs[1]);
+  if (JS_IsException(ret)) {
+    JS_FreeValue(ctx, promise);
+    return ret;
+  }
+  JS_FreeValue(ctx, ret);
+  image_cache_trim();
+  return promise;
+}
+
+// Draws the src rectangle of an image, in its pixels, into the dst
+// rectangle in user space.
+static void canvas_draw_image(JSCanvas *s, ImageEntry *image,
+                              const plutovg_rect_t *src,
+                              const plutovg_rect_t *dst) {
+  if (recorder.file && s->record_id && !image->record_id) {
+    // the pixels go into the stream once, before their first use
+    image->record_id = ++image_loader.next_record_id;
+    const uint8_t *data = plutovg_surface_get_data(image->surface);
+    int stride = plutovg_surface_get_stride(image->surface);
+    recorder_u8(RECORD_IMAGE);
+    recorder_u32(image->record_id);
+    recorder_i32(image->width);
+    recorder_i32(image->height);
+    for (int y = 0; y < image->height; y++) {
+      recorder_write(data + (size_t)y * stride, (size_t)image->width * 4);
+    }
+  }
+  if (canvas_record(s, RECORD_DRAW_IMAGE)) {
+    recorder_u32(image->record_id);
+    recorder_f32(src->x);
+    recorder_f32(src->y);
+    recorder_f32(src->w);
+    recorder_f32(src->h);
+    recorder_f32(dst->x);
+    recorder_f32(dst->y);
+    recorder_f32(dst->w);
+    recorder_f32(dst->h);
+  }
+  image_cache_touch(image);
+  canvas_draw_surface(s, image->surface, src, dst, 1);
+}
+
+// Finalizers run from the middle of any call that frees a value, so the
+// entry only loses its pin; the next trim drops it if the cache is full.
+static void js_image_finalizer(JSRuntime *rt, JSValue val) {
+  ImageEntry *e = JS_GetOpaque(val, js_image_class_id);
+  if (e) {
+    e->refcount--;
+  }
+}
+
+static JSValue js_image_ctor(JSContext *ctx, JSValueConst new_target,
+                             int argc, JSValueConst *argv) {
+  return JS_ThrowTypeError(ctx, "images are created by loadImage()");
+}
+
+// width and height in pixels, src the path given to loadImage().
+static JSValue js_image_get(JSContext *ctx, JSValueConst this_val,
+                            int magic) {
+  ImageEntry *e = JS_GetOpaque2(ctx, this_val, js_image_class_id);
+  if (!e) {
+    return JS_EXCEPTION;
+  }
+  switch (magic) {
+  case 0:
+    return JS_NewInt32(ctx, e->width);
+  case 1:
+    return JS_NewInt32(ctx, e->height);
+  default:
+    return JS_NewString(ctx, e->path);
+  }
+}
+
+// Image.cacheBudget is the most the cache keeps in bytes, Image.cacheSize
+// what it holds now, including images in use.
+static JSValue js_image_get_cache(JSContext *ctx, JSValueConst this_val,
+                                  int magic) {
+  return JS_NewInt64(ctx, magic ? (int64_t)image_loader.bytes
+                                : image_loader.budget);
+}
+
+static JSValue js_image_set_cache_budget(JSContext *ctx,
+                                         JSValueConst this_val,
+                                         JSValueConst val, int magic) {
+  int64_t budget;
+  if (JS_ToInt64(ctx, &budget, val)) {
+    return JS_EXCEPTION;
+  }
+  if (budget < 0) {
+    return JS_ThrowRangeError(ctx, "cache budget %" PRId64 " out of range",
+                              budget);
+  }
+  image_loader.budget = budget;
+  image_cache_trim();
+  return JS_UNDEFINED;
+}
+
+static JSClassDef js_image_class = {
+    "Image",
+    .finalizer = js_image_finalizer,
+};
+
+static const JSCFunctionListEntry js_image_proto_funcs[] = {
+    JS_CGETSET_MAGIC_DEF("width", js_image_get, NULL, 0),
+    JS_CGETSET_MAGIC_DEF("height", js_image_get, NULL, 1),
+    JS_CGETSET_MAGIC_DEF("src", js_image_get, NULL, 2),
+};
+
+static const JSCFunctionListEntry js_image_static_funcs[] = {
+    JS_CGETSET_MAGIC_DEF("cacheBudget", js_image_get_cache,
+                         js_image_set_cache_budget, 0),
+    JS_CGETSET_MAGIC_DEF("cacheSize", js_image_get_cache, NULL, 1),
+};
+
+static int js_image_init(JSContext *ctx) {
+  JSValue image_proto, image_class;
+
+  JS_NewClassID(&js_image_class_id);
+  JS_NewClass(JS_GetRuntime(ctx), js_image_class_id, &js_image_class);
+  image_loader.set_read_handler = JS_UNDEFINED;
+  image_loader.on_wake =
+      JS_NewCFunction(ctx, js_image_loader_wake, "onImagesDecoded", 0);
+
+  image_proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, image_proto, js_image_proto_funcs,
+                             countof(js_image_proto_funcs));
+
+  image_class = JS_NewCFunction2(ctx, js_image_ctor, "Image", 0,
+                                 JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, image_class, image_proto);
+  JS_SetClassProto(ctx, js_image_class_id, image_proto);
+  JS_SetPropertyFunctionList(ctx, image_class, js_image_static_funcs,
+                             countof(js_image_static_funcs));
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyStr(ctx, global, "Image", image_class);
+  JS_SetPropertyStr(ctx, global, "loadImage",
+                    JS_NewCFunction(ctx, js_load_image, "loadImage", 1));
+  JS_FreeValue(ctx, global);
+  return 0;
+}
+
+// Stops the loader threads and drops the promises still waiting, before
+// the context goes away.
+static void js_image_free(JSContext *ctx) {
+  ImageLoader *l = &image_loader;
+  if (l->mutex) {
+    SDL_LockMutex(l->mutex);
+    l->quit = true;
+    SDL_BroadcastCondition(l->work_cond);
+    SDL_UnlockMutex(l->mutex);
+  }
+  for (int i = 0; i < l->thread_count; i++) {
+    SDL_WaitThread(l->threads[i], NULL);
+  }
+  l->thread_count = 0;
+  for (ImageEntry *e = l->first; e; e = e->next) {
+    while (e->waiters) {
+      ImageWaiter *w = e->waiters;
+      e->waiters = w->next;
+      JS_FreeValue(ctx, w->resolve);
+      JS_FreeValue(ctx, w->reject);
+      free(w);
+    }
+  }
+  JS_FreeValue(ctx, l->set_read_handler);
+  JS_FreeValue(ctx, l->on_wake);
+  l->set_read_handler = JS_UNDEFINED;
+  l->on_wake = JS_UNDEFINED;
+}
+
+// Frees the cache once no Image object is left.
+static void image_cache_free(void) {
+  ImageLoader *l = &image_loader;
+  while (l->first) {
+    image_cache_remove(l->first);
+  }
+  if (l->work_cond) {
+    SDL_DestroyCondition(l->work_cond);
+  }
+  if (l->mutex) {
+    SDL_DestroyMutex(l->mutex);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (l->wake[i] >= 0) {
+      close(l->wake[i]);
+    }
+  }
+  *l = (ImageLoader){.wake = {-1, -1}, .budget = IMAGE_DEFAULT_BUDGET};
+}
+
+// #endregion
+
+// #region JSCanvas bindings
+
+static CanvasPixels *canvas_pixels_create(size_t size) {
+  CanvasPixels *p = malloc(sizeof(CanvasPixels));
+  if (p) {
+    p->refcount = 1;
+    p->data = malloc(size);
+    if (!p->data) {
+      free(p);
+      p = NULL;
+    }
+  }
+  return p;
+}
+
+static void canvas_pixels_release(CanvasPixels *p) {
+  if (--p->refcount == 0) {
+    free(p->data);
+    free(p);
+  }
+}
+
+static void canvas_pixels_free_buffer(JSRuntime *rt, void *opaque,
+                                      void *ptr) {
+  canvas_pixels_release(opaque);
+}
+
+static void canvas_finalizer(JSCanvas *s) {
+  if (s->raster != NULL) {
+    canvas_raster_destroy(s->raster);
+  }
+  canvas_discard_commands(s);
+  free(s->commands);
+  if (s->output_file != NULL && s->output_file != stdout) {
+    fclose(s->output_file);
+  } else if (s->output_file != NULL) {
+    fflush(s->output_file);
+  }
+  free(s->output_rgba);
+  free(s->output);
+  free(s->font);
+  free(s->batch.vertices);
+  free(s->batch.indices);
+  if (s->texture != NULL) {
+    SDL_DestroyTexture(s->texture);
+  }
+  if (s->renderer != NULL) {
+    SDL_DestroyRenderer(s->renderer);
+  }
+  if (s->window != NULL) {
+    SDL_DestroyWindow(s->window);
+  }
+  if (s->pixel_store != NULL) {
+    canvas_pixels_release(s->pixel_store);
+  }
+  if (s->plutovg_surface != NULL) {
+    plutovg_surface_destroy(s->plutovg_surface);
+  }
+  if (s->plutovg_canvas != NULL) {
+    plutovg_canvas_destroy(s->plutovg_canvas);
+  }
+}
+
+static void js_canvas_finalizer(JSRuntime *rt, JSValue val) {
+  JSCanvas *s = JS_GetOpaque(val, js_canvas_class_id);
+  /* Note: 's' can be NULL in case JS_SetOpaque() was not called */
+  if (s) {
+    JS_FreeValueRT(rt, s->pixels_buffer);
+    canvas_finalizer(s);
+  }
+  js_free_rt(rt, s);
+}
+
+static void js_canvas_mark(JSRuntime *rt, JSValueConst val,
+                           JS_MarkFunc *mark_func) {
+  JSCanvas *s = JS_GetOpaque(val, js_canvas_class_id);
+  if (s) {
+    JS_MarkValue(rt, s->pixels_buffer, mark_func);
+  }
+}
+
+static int canvas_scaled_size(int view_size, float scale) {
+  return SDL_max(1, (int)ceilf(view_size * scale));
+}
+
+// Draws in view units: the matrix maps them to pixels.
+static void canvas_apply_view_matrix(JSCanvas *s) {
+  plutovg_matrix_t m;
+  plutovg_matrix_init_scale(&m, s->resolution_scale, s->resolution_scale);
+  plutovg_canvas_set_matrix(s->plutovg_canvas, &m);
+}
+
+// (Re)creates the streaming texture when it does not match the canvas size.
+static int canvas_ensure_texture(JSCanvas *s) {
+  if (s->texture != NULL && s->texture->w == s->width &&
+      s->texture->h == s->height) {
+    return 0;
+  }
+  if (s->texture != NULL) {
+    SDL_DestroyTexture(s->texture);
+  }
+  // plutovg renders premultiplied ARGB32, which matches ARGB8888
+  s->texture = SDL_CreateTexture(
+      s->renderer, SDL_PIXELFORMAT_ARGB8888,
+      s->geometry ? SDL_TEXTUREACCESS_TARGET : SDL_TEXTUREACCESS_STREAMING,
+      s->width, s->height);
+  if (!s->texture) {
+    fprintf(stderr, "SDL could not create texture! SDL_Error: %s\n",
+            SDL_GetError());
+    return 1;
+  }
+  // below full resolution the texture is scaled up
+  SDL_SetTextureScaleMode(s->texture, SDL_SCALEMODE_LINEAR);
+  if (s->geometry) {
+    // premultiplied over the black clear color is the color as it is
+    SDL_SetTextureBlendMode(s->texture, SDL_BLENDMODE_NONE);
+    s->geometry_upload = true;
+  }
+  // a fresh texture has no content yet
+  canvas_invalidate_all(s);
+  return 0;
+}
+
+// Opens the window and renderer of an onscreen canvas.
+static int canvas_create_window(JSCanvas *s) {
+  s->window = SDL_CreateWindow("Canvas", s->view_width, s->view_height,
+                               SDL_WINDOW_RESIZABLE);
+  if (!s->window) {
+    fprintf(stderr, "SDL could not create window! SDL_Error: %s\n",
+            SDL_GetError());
+    return 1;
+  }
+  s->renderer = SDL_CreateRenderer(s->window, NULL);
+  if (!s->renderer) {
+    fprintf(stderr, "SDL could not create renderer! SDL_Error: %s\n",
+            SDL_GetError());
+    return 1;
+  }
+  if (canvas_ensure_texture(s)) {
+    return 1;
+  }
+  // the texture is stretched over the view, letterboxed in the window, and
+  // events are mapped back to view coordinates
+  if (!SDL_SetRenderLogicalPresentation(s->renderer, s->view_width,
+                                        s->view_height,
+                                        SDL_LOGICAL_PRESENTATION_LETTERBOX)) {
+    fprintf(stderr, "SDL could not set presentation! SDL_Error: %s\n",
+            SDL_GetError());
+    return 1;
+  }
+
+  // pace presents to the display; fall back to the scheduler's timer when
+  // the renderer cannot wait for vsync
+#ifdef YANHUA_BENCH
+  // a benchmark measures the present itself, not the wait for the display
+  SDL_SetRenderVSync(s->renderer, 0);
+  bool vsync = false;
+#else
+  bool vsync = SDL_SetRenderVSync(s->renderer, 1);
+#endif
+  const SDL_DisplayMode *mode =
+      SDL_GetCurrentDisplayMode(SDL_GetDisplayForWindow(s->window));
+  frame_scheduler_set_display(mode ? mode->refresh_rate : 0, vsync);
+
+  if (!SDL_SetRenderDrawBlendMode(s->renderer, SDL_BLENDMODE_NONE)) {
+    fprintf(stderr, "SDL could not set blend mode! SDL_Error: %s\n",
+            SDL_GetError());
+    return 1;
+  }
+  return 0;
+}
+
+static int canvas_initializer(JSCanvas *s) {
+  s->width = canvas_scaled_size(s->view_width, s->resolution_scale);
+  s->height = canvas_scaled_size(s->view_height, s->resolution_scale);
+  int width = s->width;
+  int height = s->height;
+  int pitch = width * 4; // 4 bytes per pixel (RGBA)
+
+  // Allocate memory for pixel data
+  s->pixel_store = canvas_pixels_create((size_t)height * pitch);
+  assert(s->pixel_store != NULL &&
+         "Failed to allocate memory for pixel buffer");
+  void *pixels = s->pixel_store->data;
+
+  // Fill pixels with a default color (e.g., white with full alpha), layers
+  // start transparent
+  SDL_memset(pixels, s->layer ? 0 : 0xFF, s->height * pitch);
+  s->pixels = pixels;
+
+  s->plutovg_surface =
+      plutovg_surface_create_for_data(pixels, width, height, pitch);
+  if (s->plutovg_surface == NULL) {
+    fprintf(stderr, "PlutoVG could not create surface!\n");
+    return 1;
+  }
+  s->plutovg_canvas = plutovg_canvas_create(s->plutovg_surface);
+  if (s->plutovg_canvas == NULL) {
+    fprintf(stderr, "PlutoVG could not create canvas!\n");
+    return 1;
+  }
+  canvas_apply_view_matrix(s);
+  s->paint.a = -1;
+  canvas_apply_fill_style(s);
+
+  if (s->deferred && !s->geometry) {
+    int threads = s->thread_count;
+    if (threads <= 0) {
+      threads = SDL_max(SDL_GetNumLogicalCPUCores(), 1);
+    }
+    s->raster = canvas_raster_create(s, threads);
+    if (!s->raster) {
+      fprintf(stderr, "Could not create the deferred rasterizer!\n");
+      return 1;
+    }
+  }
+
+  if (!s->offscreen && canvas_create_window(s)) {
+    return 1;
+  }
+  if (!s->layer) {
+    BENCH_VIEWPORT(s->view_width, s->view_height);
+  }
+  return 0;
+}
+
+// Recreates the pixels for a view of view_width x view_height units drawn at
+// scale pixels per unit. The picture is carried over at the same place in
+// the view, the rest of the new pixels are blank like a new canvas. Pending
+// deferred drawing is finished first and the current path is dropped.
+static int canvas_resize(JSCanvas *s, int view_width, int view_height,
+                         float scale) {
+  int width = canvas_scaled_size(view_width, scale);
+  int height = canvas_scaled_size(view_height, scale);
+  if (view_width == s->view_width && view_height == s->view_height &&
+      width == s->width && height == s->height) {
+    s->resolution_scale = scale;
+    return 0;
+  }
+  if (canvas_record(s, RECORD_RESIZE)) {
+    recorder_i32(view_width);
+    recorder_i32(view_height);
+    recorder_f32(scale);
+  }
+  canvas_flush(s);
+
+  int pitch = width * 4;
+  CanvasPixels *store = canvas_pixels_create((size_t)height * pitch);
+  if (!store) {
+    return -1;
+  }
+  plutovg_surface_t *surface =
+      plutovg_surface_create_for_data(store->data, width, height, pitch);
+  plutovg_canvas_t *canvas = surface ? plutovg_canvas_create(surface) : NULL;
+  if (!canvas) {
+    if (surface) {
+      plutovg_surface_destroy(surface);
+    }
+    canvas_pixels_release(store);
+    return -1;
+  }
+  SDL_memset(store->data, s->layer ? 0 : 0xFF, (size_t)height * pitch);
+  plutovg_matrix_t m;
+  float ratio = (float)width / s->width;
+  plutovg_matrix_init_scale(&m, ratio, (float)height / s->height);
+  if (view_width != s->view_width || view_height != s->view_height) {
+    // same size in view units, the view only grew or shrank
+    ratio = scale / s->resolution_scale;
+    plutovg_matrix_init_scale(&m, ratio, ratio);
+  }
+  plutovg_canvas_set_texture(canvas, s->plutovg_surface,
+                             PLUTOVG_TEXTURE_TYPE_PLAIN, 1, &m);
+  plutovg_canvas_set_operator(canvas, PLUTOVG_OPERATOR_SRC);
+  plutovg_canvas_fill_rect(canvas, 0, 0, s->width * m.a, s->height * m.d);
+  plutovg_canvas_set_operator(canvas, PLUTOVG_OPERATOR_SRC_OVER);
+  plutovg_canvas_set_line_width(
+      canvas, plutovg_canvas_get_line_width(s->plutovg_canvas));
+  plutovg_canvas_set_opacity(canvas,
+                             plutovg_canvas_get_opacity(s->plutovg_canvas));
+
+  plutovg_canvas_destroy(s->plutovg_canvas);
+  plutovg_surface_destroy(s->plutovg_surface);
+  canvas_pixels_release(s->pixel_store);
+  s->pixel_store = store;
+  s->pixels = store->data;
+  s->plutovg_surface = surface;
+  s->plutovg_canvas = canvas;
+  s->width = width;
+  s->height = height;
+  s->view_width = view_width;
+  s->view_height = view_height;
+  s->resolution_scale = scale;
+  s->path_empty = true;
+  s->path_is_circle = false;
+  canvas_apply_view_matrix(s);
+  s->paint.a = -1;
+  canvas_apply_fill_style(s);
+  canvas_invalidate_all(s);
+
+  // the geometry backend draws into a texture of the new size right away
+  if (s->geometry && canvas_ensure_texture(s)) {
+    return -1;
+  }
+  if (s->raster) {
+    // the tiles point into the old pixels
+    int threads = s->raster->thread_count + 1;
+    canvas_raster_destroy(s->raster);
+    s->raster = canvas_raster_create(s, threads);
+    if (!s->raster) {
+      fprintf(stderr, "Could not create the deferred rasterizer!\n");
+      // carries on drawing immediately
+      s->deferred = false;
+      return -1;
+    }
+  }
+  if (s->renderer &&
+      !SDL_SetRenderLogicalPresentation(s->renderer, view_width, view_height,
+                                        SDL_LOGICAL_PRESENTATION_LETTERBOX)) {
+    fprintf(stderr, "SDL could not set presentation! SDL_Error: %s\n",
+            SDL_GetError());
+    return -1;
+  }
+  if (!s->layer) {
+    BENCH_VIEWPORT(view_width, view_height);
+  }
+  return 0;
+}
+
+// canvas_resize() for the bindings, which also detaches canvas.pixels from
+// the old pixels.
+static int js_canvas_resize(JSContext *ctx, JSCanvas *s, int view_width,
+                            int view_height, float scale) {
+  CanvasPixels *store = s->pixel_store;
+  int ret = canvas_resize(s, view_width, view_height, scale);
+  if (s->pixel_store != store && !JS_IsUndefined(s->pixels_buffer)) {
+    JS_DetachArrayBuffer(ctx, s->pixels_buffer);
+    JS_FreeValue(ctx, s->pixels_buffer);
+    s->pixels_buffer = JS_UNDEFINED;
+  }
+  if (ret) {
+    JS_ThrowInternalError(ctx, "could not resize the canvas");
+  }
+  return ret;
+}
+
+// Frames slower than the target lower the resolution right away, faster ones
+// raise it in small steps. The raster cost follows the pixel count, so the
+// scale moves with the square root of the time ratio. Changes are spaced out
+// so that the average reflects the new resolution before the next one.
+#define CANVAS_RESOLUTION_SETTLE 30 // frames between changes
+#define CANVAS_RESOLUTION_STEP 0.02f
+
+static int canvas_update_resolution(JSContext *ctx, JSCanvas *s,
+                                    uint64_t frame_ns) {
+  if (frame_ns == 0) {
+    return 0;
+  }
+  s->frame_ns_avg =
+      s->frame_ns_avg ? s->frame_ns_avg * 0.9 + frame_ns * 0.1 : frame_ns;
+  if (++s->frames_since_change < CANVAS_RESOLUTION_SETTLE ||
+      s->frame_ns_avg <= 0) {
+    return 0;
+  }
+  double ratio = sqrt(s->target_frame_ns / s->frame_ns_avg);
+  float scale = s->resolution_scale;
+  if (ratio < 1) {
+    scale *= SDL_max(ratio, 0.75);
+  } else if (ratio > 1.15) {
+    scale *= SDL_min(ratio, 1.1);
+  }
+  scale = SDL_clamp(scale, s->min_scale, 1.0f);
+  if (fabsf(scale - s->resolution_scale) < CANVAS_RESOLUTION_STEP) {
+    return 0;
+  }
+  s->frames_since_change = 0;
+  s->frame_ns_avg = 0;
+  return js_canvas_resize(ctx, s, s->view_width, s->view_height, scale);
+}
+
+static bool canvas_output_is_png(const char *path) {
+  size_t len = strlen(path);
+  return len >= 4 && !strcmp(path + len - 4, ".png");
+}
+
+// PNG outputs are used as a printf format with the frame index, so the only
+// conversion allowed is a single integer like %d or %05d.
+static bool canvas_output_is_valid(const char *path) {
+  if (!canvas_output_is_png(path)) {
+    return true;
+  }
+  int conversions = 0;
+  for (const char *p = path; *p; p++) {
+    if (*p != '%') {
+      continue;
+    }
+    if (p[1] == '%') {
+      p++;
+      continue;
+    }
+    p++;
+    while (*p >= '0' && *p <= '9') {
+      p++;
+    }
+    if (*p != 'd' || ++conversions > 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the optional third constructor argument:
+//   deferred:  record draw calls and rasterize them on worker threads in show()
+//   threads:   worker count in deferred mode, defaults to the core count
+//   offscreen: no window, only the pixel buffer; always set in headless mode
+//   output:    where show() writes the frames of an offscreen canvas, see
+//              --output; defaults to the command line value in headless mode
+//   resize:    the view follows the size of the window
+//   targetFrameTime: milliseconds; lowers the resolution, down to minScale
+//              (default 0.5), while frames take longer, the window shows
+//              the canvas scaled up
+static int js_canvas_parse_options(JSContext *ctx, JSCanvas *s,
+                                   JSValueConst options) {
+  if (JS_IsUndefined(options)) {
+    return 0;
+  }
+  JSValue val = JS_GetPropertyStr(ctx, options, "deferred");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  s->deferred = JS_ToBool(ctx, val);
+  JS_FreeValue(ctx, val);
+
+  val = JS_GetPropertyStr(ctx, options, "threads");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  int ret = 0;
+  if (!JS_IsUndefined(val)) {
+    ret = JS_ToInt32(ctx, &s->thread_count, val);
+  }
+  JS_FreeValue(ctx, val);
+  if (ret) {
+    return ret;
+  }
+
+  val = JS_GetPropertyStr(ctx, options, "backend");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  if (!JS_IsUndefined(val)) {
+    const char *backend = JS_ToCString(ctx, val);
+    if (!backend) {
+      ret = -1;
+    } else if (!strcmp(backend, "geometry")) {
+      s->geometry = true;
+    } else if (strcmp(backend, "plutovg")) {
+      JS_ThrowRangeError(ctx, "unknown canvas backend '%s'", backend);
+      ret = -1;
+    }
+    JS_FreeCString(ctx, backend);
+  }
+  JS_FreeValue(ctx, val);
+  if (ret) {
+    return ret;
+  }
+
+  val = JS_GetPropertyStr(ctx, options, "offscreen");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  s->offscreen = s->offscreen || JS_ToBool(ctx, val);
+  JS_FreeValue(ctx, val);
+
+  val = JS_GetPropertyStr(ctx, options, "resize");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  s->resize = JS_ToBool(ctx, val);
+  JS_FreeValue(ctx, val);
+
+  val = JS_GetPropertyStr(ctx, options, "targetFrameTime");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  if (!JS_IsUndefined(val)) {
+    double ms = 0;
+    ret = JS_ToFloat64(ctx, &ms, val);
+    s->target_frame_ns = ms > 0 ? (uint64_t)(ms * SDL_NS_PER_MS) : 0;
+  }
+  JS_FreeValue(ctx, val);
+  if (ret) {
+    return ret;
+  }
+
+  val = JS_GetPropertyStr(ctx, options, "minScale");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  if (!JS_IsUndefined(val)) {
+    double min_scale = 0.5;
+    ret = JS_ToFloat64(ctx, &min_scale, val);
+    s->min_scale = SDL_clamp(min_scale, 0.05, 1.0);
+  }
+  JS_FreeValue(ctx, val);
+  if (ret) {
+    return ret;
+  }
+
+  val = JS_GetPropertyStr(ctx, options, "output");
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  if (!JS_IsUndefined(val)) {
+    const char *output = JS_ToCString(ctx, val);
+    if (output) {
+      free(s->output);
+      s->output = strdup(output);
+      JS_FreeCString(ctx, output);
+    } else {
+      ret = -1;
+    }
+  }
+  JS_FreeValue(ctx, val);
+  return ret;
+}
+
+// Shared by new Canvas() and new OffscreenCanvas(); layers never get a
+// window and only write frames when given an output of their own.
+static JSValue js_canvas_create(JSContext *ctx, JSValueConst new_target,
+                                int argc, JSValueConst *argv, bool layer) {
+  JSCanvas *s;
+  JSValue obj = JS_UNDEFINED;
+  JSValue proto;
+
+  s = js_mallocz(ctx, sizeof(*s));
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  s->fill_style.color = (SDL_Color){.r = 0, .g = 0, .b = 0, .a = 255};
+  s->pixels_buffer = JS_UNDEFINED;
+  s->path_empty = true;
+  s->resolution_scale = 1;
+  s->min_scale = 0.5f;
+  s->offscreen = app_options.headless || layer;
+  s->layer = layer;
+  if (app_options.headless && app_options.output && !layer) {
+    s->output = strdup(app_options.output);
+  }
+  if (JS_ToInt32(ctx, &s->view_width, argv[0])) {
+    goto fail;
+  }
+  if (JS_ToInt32(ctx, &s->view_height, argv[1])) {
+    goto fail;
+  }
+  if (argc > 2 && js_canvas_parse_options(ctx, s, argv[2])) {
+    goto fail;
+  }
+  if (s->output && !canvas_output_is_valid(s->output)) {
+    JS_ThrowRangeError(ctx, "invalid canvas output '%s'", s->output);
+    goto fail;
+  }
+  // offscreen canvases have no renderer and stay with plutovg
+  s->geometry = s->geometry && !s->offscreen;
+  s->deferred = s->deferred || s->geometry;
+
+  /* using new_target to get the prototype is necessary when the
+   class is extended. */
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  if (JS_IsException(proto)) {
+    goto fail;
+  }
+  obj = JS_NewObjectProtoClass(ctx, proto, js_canvas_class_id);
+  JS_FreeValue(ctx, proto);
+  if (JS_IsException(obj)) {
+    goto fail;
+  }
+  if (canvas_initializer(s)) {
+    goto fail;
+  }
+  recorder_add_canvas(s);
+  JS_SetOpaque(obj, s);
+  return obj;
+fail:
+  canvas_finalizer(s);
+  js_free(ctx, s);
+  JS_FreeValue(ctx, obj);
+  return JS_EXCEPTION;
+}
+
+static JSValue js_canvas_ctor(JSContext *ctx, JSValueConst new_target, int argc,
+                              JSValueConst *argv) {
+  return js_canvas_create(ctx, new_target, argc, argv, false);
+}
+
+static JSValue js_offscreen_canvas_ctor(JSContext *ctx,
+                                        JSValueConst new_target, int argc,
+                                        JSValueConst *argv) {
+  return js_canvas_create(ctx, new_target, argc, argv, true);
+}
+
+static JSClassDef js_canvas_class = {
+    "Canvas",
+    .finalizer = js_canvas_finalizer,
+    .gc_mark = js_canvas_mark,
+};
+
+// Record layouts of the bulk draw calls, in floats. Colors use the same
+// 0-255 range as setFillColor().
+#define CANVAS_CIRCLE_RECORD 7 // x, y, radius, r, g, b, a
+#define CANVAS_RECT_RECORD 8   // x, y, width, height, r, g, b, a
+#define CANVAS_LINE_RECORD 9   // x0, y0, x1, y1, lineWidth, r, g, b, a
+
+// Returns the elements of a typed array whose elements are elem_size bytes
+// wide, or NULL with a pending exception.
+static void *js_get_typed_array(JSContext *ctx, JSValueConst val,
+                                size_t elem_size, const char *expected,
+                                size_t *plen) {
+  size_t byte_offset, byte_length, bytes_per_element;
+  JSValue buffer = JS_GetTypedArrayBuffer(ctx, val, &byte_offset,
+                                          &byte_length, &bytes_per_element);
+  if (JS_IsException(buffer)) {
+    return NULL;
+  }
+  size_t size;
+  uint8_t *data = JS_GetArrayBuffer(ctx, &size, buffer);
+  JS_FreeValue(ctx, buffer);
+  if (!data) {
+    return NULL;
+  }
+  if (bytes_per_element != elem_size) {
+    JS_ThrowTypeError(ctx, "expected %s", expected);
+    return NULL;
+  }
+  *plen = byte_length / elem_size;
+  return data + byte_offset;
+}
+
+static float *js_get_float32_array(JSContext *ctx, JSValueConst val,
+                                   size_t *plen) {
+  // an Int32Array or Uint32Array has the same width, but not float bits
+  if (JS_GetTypedArrayType(val) != JS_TYPED_ARRAY_FLOAT32) {
+    JS_ThrowTypeError(ctx, "expected a Float32Array");
+    return NULL;
+  }
+  return js_get_typed_array(ctx, val, sizeof(float), "a Float32Array", plen);
+}
+
+// Parses the (records, count?) arguments shared by the bulk draw calls and
+// returns the number of records to draw, or -1 with a pending exception.
+static int js_get_records(JSContext *ctx, int argc, JSValueConst *argv,
+                          int stride, float **precords) {
+  size_t len;
+  float *records = js_get_float32_array(ctx, argv[0], &len);
+  if (!records) {
+    return -1;
+  }
+  int64_t count = len / stride;
+  if (argc > 1 && !JS_IsUndefined(argv[1])) {
+    int64_t n;
+    if (JS_ToInt64(ctx, &n, argv[1])) {
+      return -1;
+    }
+    if (n < 0 || n > count) {
+      JS_ThrowRangeError(ctx, "record count %" PRId64 " out of range", n);
+      return -1;
+    }
+    count = n;
+  }
+  *precords = records;
+  return (int)count;
+}
+
+// Reads a transform given as [a, b, c, d, e, f], the order of
+// CanvasRenderingContext2D.transform(). Undefined leaves *has unset.
+static int js_get_matrix(JSContext *ctx, JSValueConst val,
+                         plutovg_matrix_t *m, bool *has) {
+  *has = false;
+  if (JS_IsUndefined(val)) {
+    return 0;
+  }
+  float v[6];
+  for (int i = 0; i < 6; i++) {
+    JSValue item = JS_GetPropertyUint32(ctx, val, i);
+    double d;
+    int ret = JS_ToFloat64(ctx, &d, item);
+    JS_FreeValue(ctx, item);
+    if (ret) {
+      return -1;
+    }
+    v[i] = d;
+  }
+  plutovg_matrix_init(m, v[0], v[1], v[2], v[3], v[4], v[5]);
+  *has = true;
+  return 0;
+}
+
+// Reads the (path, transform) arguments of fill() and stroke().
+static int js_get_path_args(JSContext *ctx, int argc, JSValueConst *argv,
+                            JSPath2D **path, plutovg_matrix_t *transform,
+                            bool *has_transform) {
+  *path = NULL;
+  *has_transform = false;
+  if (argc == 0) {
+    return 0;
+  }
+  *path = JS_GetOpaque2(ctx, argv[0], js_path2d_class_id);
+  if (!*path) {
+    return -1;
+  }
+  if (argc > 1 && js_get_matrix(ctx, argv[1], transform, has_transform)) {
+    return -1;
+  }
+  return 0;
+}
+
+// Sets the paint from a record's r, g, b, a, skipping repeated colors.
+static void canvas_set_record_color(JSCanvas *s, const float *rgba,
+                                    float *last) {
+  if (memcmp(rgba, last, 4 * sizeof(float)) == 0) {
+    return;
+  }
+  memcpy(last, rgba, 4 * sizeof(float));
+  canvas_set_paint(s, rgba[0] / 255.0f, rgba[1] / 255.0f, rgba[2] / 255.0f,
+                   rgba[3] / 255.0f);
+}
+
+static JSValue js_canvas_arc(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+  if (argc != 5 && argc != 6) {
+    fprintf(stderr, "canvas.arc() expected 5 or 6 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double x = 0, y = 0, radius = 0, start_angle = 0, end_angle = 0;
+  bool counterclockwise = (argc == 6) ? JS_ToBool(ctx, argv[5]) : false;
+  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
+      JS_ToFloat64(ctx, &radius, argv[2]) ||
+      JS_ToFloat64(ctx, &start_angle, argv[3]) ||
+      JS_ToFloat64(ctx, &end_angle, argv[4])) {
+    return JS_EXCEPTION;
+  }
+
+  plutovg_canvas_arc(s->plutovg_canvas, x, y, radius, start_angle, end_angle,
+                     counterclockwise);
+  s->path_is_circle =
+      s->path_empty && fabs(end_angle - start_angle) >= 2 * SDL_PI_D;
+  s->path_empty = false;
+  s->path_circle[0] = x;
+  s->path_circle[1] = y;
+  s->path_circle[2] = radius;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_begin_path(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  if (argc != 0) {
+    fprintf(stderr, "canvas.beginPath() expected 0 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+
+  plutovg_canvas_new_path(s->plutovg_canvas);
+  s->path_empty = true;
+  s->path_is_circle = false;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_clear(JSContext *ctx, JSValueConst this_val, int argc,
+                               JSValueConst *argv) {
+  if (argc != 0) {
+    fprintf(stderr, "canvas.clear() expected 0 arguments, but got %d\n", argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+
+  // show() redraws the whole window from the pixels, so the renderer does
+  // not need to be cleared
+  canvas_clear_all(s);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_clear_rect(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  if (argc != 4) {
+    fprintf(stderr, "canvas.clearRect() expected 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+
+  double x = 0, y = 0, width = 0, height = 0;
+  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
+      JS_ToFloat64(ctx, &width, argv[2]) ||
+      JS_ToFloat64(ctx, &height, argv[3])) {
+    return JS_EXCEPTION;
+  }
+  // Clear the pixel buffer itself: anything drawn on the renderer would be
+  // covered by the texture in show().
+  canvas_fill_rect(s, x, y, width, height, PLUTOVG_OPERATOR_CLEAR);
+  return JS_UNDEFINED;
+}
+
+// drawCanvas(layer, x, y, alpha = 1) draws another canvas, usually an
+// OffscreenCanvas, at (x, y) in its view size.
+static JSValue js_canvas_draw_canvas(JSContext *ctx, JSValueConst this_val,
+                                     int argc, JSValueConst *argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "canvas.drawCanvas() expected 3 or 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  JSCanvas *layer = JS_GetOpaque2(ctx, argv[0], js_canvas_class_id);
+  if (!layer) {
+    return JS_EXCEPTION;
+  }
+  if (layer == s) {
+    return JS_ThrowRangeError(ctx, "a canvas cannot be drawn into itself");
+  }
+  double x = 0, y = 0, alpha = 1;
+  if (JS_ToFloat64(ctx, &x, argv[1]) || JS_ToFloat64(ctx, &y, argv[2]) ||
+      (argc > 3 && JS_ToFloat64(ctx, &alpha, argv[3]))) {
+    return JS_EXCEPTION;
+  }
+  canvas_draw_layer(s, layer, x, y, alpha);
+  return JS_UNDEFINED;
+}
+
+// drawImage(image, dx, dy), drawImage(image, dx, dy, dw, dh) or
+// drawImage(image, sx, sy, sw, sh, dx, dy, dw, dh), as in the 2D context:
+// the source rectangle is in image pixels, the destination in canvas units.
+static JSValue js_canvas_draw_image(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  if (argc != 3 && argc != 5 && argc != 9) {
+    fprintf(stderr,
+            "canvas.drawImage() expected 3, 5 or 9 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  ImageEntry *image = JS_GetOpaque2(ctx, argv[0], js_image_class_id);
+  if (!image) {
+    return JS_EXCEPTION;
+  }
+  double v[8];
+  for (int i = 1; i < argc; i++) {
+    if (JS_ToFloat64(ctx, &v[i - 1], argv[i])) {
+      return JS_EXCEPTION;
+    }
+  }
+  plutovg_rect_t src = {.x = 0, .y = 0, .w = image->width, .h = image->height};
+  plutovg_rect_t dst = {.x = v[0], .y = v[1], .w = src.w, .h = src.h};
+  if (argc == 5) {
+    dst.w = v[2];
+    dst.h = v[3];
+  } else if (argc == 9) {
+    src = (plutovg_rect_t){.x = v[0], .y = v[1], .w = v[2], .h = v[3]};
+    dst = (plutovg_rect_t){.x = v[4], .y = v[5], .w = v[6], .h = v[7]};
+  }
+  canvas_draw_image(s, image, &src, &dst);
+  return JS_UNDEFINED;
+}
+
+// fade(alpha, r = 0, g = 0, b = 0) paints the whole canvas with a color
+// (0-255) at the given opacity (0-1), like a full-size fillRect().
+static JSValue js_canvas_fade(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+  if (argc != 1 && argc != 4) {
+    fprintf(stderr, "canvas.fade() expected 1 or 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double v[4] = {0, 0, 0, 0};
+  for (int i = 0; i < argc; i++) {
+    if (JS_ToFloat64(ctx, &v[i], argv[i])) {
+      return JS_EXCEPTION;
+    }
+  }
+  plutovg_color_t color = {v[1] / 255, v[2] / 255, v[3] / 255, 1};
+  canvas_blend_solid(s, canvas_premultiply(&color, v[0]));
+  return JS_UNDEFINED;
+}
+
+// fill() fills the current path, fill(path, transform) a Path2D.
+static JSValue js_canvas_fill(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+  if (argc > 2) {
+    fprintf(stderr, "canvas.fill() expected 0 to 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  JSPath2D *path;
+  plutovg_matrix_t transform;
+  bool has_transform;
+  if (js_get_path_args(ctx, argc, argv, &path, &transform, &has_transform)) {
+    return JS_EXCEPTION;
+  }
+  canvas_apply_fill_style(s);
+  if (path) {
+    canvas_draw_path2d(s, path, has_transform ? &transform : NULL, false);
+    return JS_UNDEFINED;
+  }
+  if (s->path_is_circle) {
+    // a lone dot, the most common path by far: takes the stamp fast path
+    canvas_fill_circle(s, s->path_circle[0], s->path_circle[1],
+                       s->path_circle[2]);
+    plutovg_canvas_new_path(s->plutovg_canvas);
+  } else {
+    canvas_fill_path(s);
+  }
+  // filling consumes the path, as plutovg_canvas_fill() does
+  s->path_empty = true;
+  s->path_is_circle = false;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_fill_circles(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv) {
+  if (argc != 1 && argc != 2) {
+    fprintf(stderr,
+            "canvas.fillCircles() expected 1 or 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  float *records;
+  int count = js_get_records(ctx, argc, argv, CANVAS_CIRCLE_RECORD, &records);
+  if (count < 0) {
+    return JS_EXCEPTION;
+  }
+
+  float last_color[4] = {-1, -1, -1, -1};
+  for (int i = 0; i < count; i++) {
+    const float *r = records + i * CANVAS_CIRCLE_RECORD;
+    if (r[2] <= 0 || r[6] <= 0) {
+      continue;
+    }
+    canvas_set_record_color(s, r + 3, last_color);
+    canvas_fill_circle(s, r[0], r[1], r[2]);
+  }
+  canvas_apply_fill_style(s);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_fill_rect(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv) {
+  if (argc != 4) {
+    fprintf(stderr, "canvas.fillRect() expected 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double x = 0, y = 0, width = 0, height = 0;
+  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
+      JS_ToFloat64(ctx, &width, argv[2]) ||
+      JS_ToFloat64(ctx, &height, argv[3])) {
+    return JS_EXCEPTION;
+  }
+  canvas_fill_rect(s, x, y, width, height, PLUTOVG_OPERATOR_SRC_OVER);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_fill_rects(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  if (argc != 1 && argc != 2) {
+    fprintf(stderr,
+            "canvas.fillRects() expected 1 or 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  float *records;
+  int count = js_get_records(ctx, argc, argv, CANVAS_RECT_RECORD, &records);
+  if (count < 0) {
+    return JS_EXCEPTION;
+  }
+
+  float last_color[4] = {-1, -1, -1, -1};
+  for (int i = 0; i < count; i++) {
+    const float *r = records + i * CANVAS_RECT_RECORD;
+    if (r[2] == 0 || r[3] == 0 || r[7] <= 0) {
+      continue;
+    }
+    canvas_set_record_color(s, r + 4, last_color);
+    canvas_fill_rect(s, r[0], r[1], r[2], r[3], PLUTOVG_OPERATOR_SRC_OVER);
+  }
+  canvas_apply_fill_style(s);
+  return JS_UNDEFINED;
+}
+
+// Clips the rectangle (x, y, w, h) to the canvas. Returns false when
+// nothing is left.
+static bool canvas_clip_rect(JSCanvas *s, int x, int y, int w, int h,
+                             SDL_Rect *clip) {
+  SDL_Rect rect = {.x = x, .y = y, .w = w, .h = h};
+  SDL_Rect bounds = {.x = 0, .y = 0, .w = s->width, .h = s->height};
+  return SDL_GetRectIntersection(&rect, &bounds, clip);
+}
+
+// The face and size of canvas.font, or -1 with a pending exception.
+static int js_canvas_font_face(JSContext *ctx, JSCanvas *s, float *size) {
+  if (!s->font_face) {
+    const char *font = s->font ? s->font : TEXT_DEFAULT_FONT;
+    const char *families = text_parse_font(font, &s->font_size);
+    int face = families ? text_find_families(families) : -1;
+    if (face < 0) {
+      JS_ThrowTypeError(ctx, "no font face for '%s', see Canvas.loadFont()",
+                        font);
+      return -1;
+    }
+    s->font_face = face + 1;
+  }
+  *size = s->font_size;
+  return s->font_face - 1;
+}
+
+// fillText(text, x, y) fills text with the current color, (x, y) being the
+// left end of its baseline.
+static JSValue js_canvas_fill_text(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv) {
+  if (argc != 3) {
+    fprintf(stderr, "canvas.fillText() expected 3 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  float size;
+  int face = js_canvas_font_face(ctx, s, &size);
+  if (face < 0) {
+    return JS_EXCEPTION;
+  }
+  double x = 0, y = 0;
+  if (JS_ToFloat64(ctx, &x, argv[1]) || JS_ToFloat64(ctx, &y, argv[2])) {
+    return JS_EXCEPTION;
+  }
+  size_t length;
+  const char *text = JS_ToCStringLen(ctx, &length, argv[0]);
+  if (!text) {
+    return JS_EXCEPTION;
+  }
+  canvas_fill_text(s, face, size, text, length, x, y);
+  JS_FreeCString(ctx, text);
+  return JS_UNDEFINED;
+}
+
+// measureText(text) returns { width, fontBoundingBoxAscent,
+// fontBoundingBoxDescent } in canvas units.
+static JSValue js_canvas_measure_text(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "canvas.measureText() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  float size;
+  int face = js_canvas_font_face(ctx, s, &size);
+  if (face < 0) {
+    return JS_EXCEPTION;
+  }
+  size_t length;
+  const char *text = JS_ToCStringLen(ctx, &length, argv[0]);
+  if (!text) {
+    return JS_EXCEPTION;
+  }
+  const TextRun *run = text_run_lookup(face, text, length);
+  JS_FreeCString(ctx, text);
+  if (!run) {
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  float ascent, descent;
+  plutovg_font_face_get_metrics(text_faces[face].face, size, &ascent,
+                                &descent, NULL, NULL);
+  JSValue metrics = JS_NewObject(ctx);
+  if (JS_IsException(metrics)) {
+    return metrics;
+  }
+  JS_SetPropertyStr(ctx, metrics, "width",
+                    JS_NewFloat64(ctx, run->width * size));
+  JS_SetPropertyStr(ctx, metrics, "fontBoundingBoxAscent",
+                    JS_NewFloat64(ctx, ascent));
+  JS_SetPropertyStr(ctx, metrics, "fontBoundingBoxDescent",
+                    JS_NewFloat64(ctx, fabsf(descent)));
+  return metrics;
+}
+
+// getImageData(x, y, w, h) copies pixels out as {width, height, data} with
+// straight-alpha RGBA bytes in a Uint8ClampedArray, like the web API. Pixels
+// outside the canvas are transparent black.
+static JSValue js_canvas_get_image_data(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  if (argc != 4) {
+    fprintf(stderr, "canvas.getImageData() expected 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  int32_t x, y, w, h;
+  if (JS_ToInt32(ctx, &x, argv[0]) || JS_ToInt32(ctx, &y, argv[1]) ||
+      JS_ToInt32(ctx, &w, argv[2]) || JS_ToInt32(ctx, &h, argv[3])) {
+    return JS_EXCEPTION;
+  }
+  if (w <= 0 || h <= 0 || (int64_t)w * h > INT32_MAX / 4) {
+    return JS_ThrowRangeError(ctx, "invalid image data size %dx%d", w, h);
+  }
+  JSValue len = JS_NewInt32(ctx, w * h * 4);
+  JSValue data = JS_NewTypedArray(ctx, 1, &len, JS_TYPED_ARRAY_UINT8C);
+  if (JS_IsException(data)) {
+    return data;
+  }
+  size_t size;
+  uint8_t *dst = js_get_typed_array(ctx, data, 1, "bytes", &size);
+  if (!dst) {
+    JS_FreeValue(ctx, data);
+    return JS_EXCEPTION;
+  }
+
+  canvas_flush(s);
+  SDL_Rect clip;
+  if (canvas_clip_rect(s, x, y, w, h, &clip)) {
+    const uint8_t *src = s->pixels;
+    int stride = s->width * 4;
+    for (int row = clip.y; row < clip.y + clip.h; row++) {
+      plutovg_convert_argb_to_rgba(
+          dst + ((size_t)(row - y) * w + (clip.x - x)) * 4,
+          src + (size_t)row * stride + clip.x * 4, clip.w, 1, clip.w * 4);
+    }
+  }
+
+  JSValue obj = JS_NewObject(ctx);
+  if (JS_IsException(obj)) {
+    JS_FreeValue(ctx, data);
+    return obj;
+  }
+  JS_DefinePropertyValueStr(ctx, obj, "width", JS_NewInt32(ctx, w),
+                            JS_PROP_C_W_E);
+  JS_DefinePropertyValueStr(ctx, obj, "height", JS_NewInt32(ctx, h),
+                            JS_PROP_C_W_E);
+  JS_DefinePropertyValueStr(ctx, obj, "data", data, JS_PROP_C_W_E);
+  return obj;
+}
+
+// canvas.pixels is an ArrayBuffer over the pixel memory itself: premultiplied
+// ARGB32, one native-endian uint32 0xAARRGGBB per pixel, pixelWidth * 4 bytes
+// per row. Reading the property finishes pending deferred drawing and marks
+// the whole canvas as damaged, so read it again every frame it is written to.
+// A resize detaches it.
+static JSValue js_canvas_get_pixels(JSContext *ctx, JSValueConst this_val) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  if (JS_IsUndefined(s->pixels_buffer)) {
+    CanvasPixels *store = s->pixel_store;
+    JSValue buffer = JS_NewArrayBuffer(
+        ctx, store->data, (size_t)s->width * s->height * 4,
+        canvas_pixels_free_buffer, store, FALSE);
+    if (JS_IsException(buffer)) {
+      return buffer;
+    }
+    store->refcount++;
+    s->pixels_buffer = buffer;
+  }
+  canvas_flush(s);
+  canvas_invalidate_all(s);
+  s->geometry_upload = s->geometry;
+  s->record_pixels = s->record_id != 0;
+  return JS_DupValue(ctx, s->pixels_buffer);
+}
+
+// width and height are the view size, pixelWidth and pixelHeight the size
+// of the pixels, which getImageData(), putImageData() and canvas.pixels use.
+static JSValue js_canvas_get_wh(JSContext *ctx, JSValueConst this_val,
+                                int magic) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s)
+    return JS_EXCEPTION;
+  switch (magic) {
+  case 0:
+    return JS_NewInt32(ctx, s->view_width);
+  case 1:
+    return JS_NewInt32(ctx, s->view_height);
+  case 2:
+    return JS_NewInt32(ctx, s->width);
+  default:
+    return JS_NewInt32(ctx, s->height);
+  }
+}
+
+static JSValue js_canvas_get_resolution_scale(JSContext *ctx,
+                                              JSValueConst this_val) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  return JS_NewFloat64(ctx, s->resolution_scale);
+}
+
+// Pixels per view unit, in (0, 1]. With targetFrameTime the controller
+// keeps adjusting it from there.
+static JSValue js_canvas_set_resolution_scale(JSContext *ctx,
+                                              JSValueConst this_val,
+                                              JSValueConst val) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double scale;
+  if (JS_ToFloat64(ctx, &scale, val)) {
+    return JS_EXCEPTION;
+  }
+  if (!(scale > 0 && scale <= 1)) {
+    return JS_ThrowRangeError(ctx, "resolution scale %g out of range", scale);
+  }
+  if (js_canvas_resize(ctx, s, s->view_width, s->view_height, scale)) {
+    return JS_EXCEPTION;
+  }
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_get_font(JSContext *ctx, JSValueConst this_val) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  return JS_NewString(ctx, s->font ? s->font : TEXT_DEFAULT_FONT);
+}
+
+// "[style...] <size>px <family>[, <family>...]" like CSS. Families are
+// names given to Canvas.loadFont(), sans-serif, serif, monospace or font
+// file paths. As in browsers, values without a size are ignored.
+static JSValue js_canvas_set_font(JSContext *ctx, JSValueConst this_val,
+                                  JSValueConst val) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  const char *font = JS_ToCString(ctx, val);
+  if (!font) {
+    return JS_EXCEPTION;
+  }
+  float size;
+  char *copy = text_parse_font(font, &size) ? strdup(font) : NULL;
+  JS_FreeCString(ctx, font);
+  if (copy) {
+    free(s->font);
+    s->font = copy;
+    s->font_face = 0;
+  }
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_invalidate_all(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  canvas_invalidate_all(s);
+  return JS_UNDEFINED;
+}
+
+// multiply(r, g, b, a) scales every pixel by a tint, with factors in 0-1.
+// The color factors are applied on top of a, which keeps the pixels valid
+// premultiplied colors.
+static JSValue js_canvas_multiply(JSContext *ctx, JSValueConst this_val,
+                                  int argc, JSValueConst *argv) {
+  if (argc != 4) {
+    fprintf(stderr, "canvas.multiply() expected 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double v[4];
+  for (int i = 0; i < 4; i++) {
+    if (JS_ToFloat64(ctx, &v[i], argv[i])) {
+      return JS_EXCEPTION;
+    }
+  }
+  plutovg_color_t tint = {v[0], v[1], v[2], 1};
+  canvas_mul_add(s, 0, canvas_premultiply(&tint, v[3]));
+  return JS_UNDEFINED;
+}
+
+// Lets the canvas react to window events before the script sees them, and
+// maps pointer positions to view coordinates.
+static int canvas_handle_event(JSContext *ctx, JSCanvas *s, SDL_Event *event) {
+  TRACE_COUNT(events, 1);
+  if (event->type == SDL_EVENT_WINDOW_EXPOSED) {
+    canvas_invalidate_all(s);
+  } else if (event->type == SDL_EVENT_WINDOW_RESIZED && s->resize) {
+    if (js_canvas_resize(ctx, s, event->window.data1, event->window.data2,
+                         s->resolution_scale)) {
+      return -1;
+    }
+  }
+  if (s->renderer) {
+    SDL_ConvertEventToRenderCoordinates(s->renderer, event);
+  }
+  return 0;
+}
+
+static JSValue js_canvas_poll_event(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+
+  SDL_Event event;
+  if (SDL_PollEvent(&event)) {
+    if (canvas_handle_event(ctx, s, &event)) {
+      return JS_EXCEPTION;
+    }
+    JSValue event_obj = JS_NewObjectClass(ctx, js_event_class_id);
+    if (JS_IsException(event_obj)) {
+      return JS_EXCEPTION;
+    }
+    SDL_Event *event_data = js_mallocz(ctx, sizeof(SDL_Event));
+    if (!event_data) {
+      JS_FreeValue(ctx, event_obj);
+      return JS_EXCEPTION;
+    }
+    *event_data = event;
+    JS_SetOpaque(event_obj, event_data);
+    return event_obj;
+  } else {
+    return JS_UNDEFINED;
+  }
+}
+
+// Int32 fields per record written by pollEvents(). Every record starts with
+// the SDL event type:
+//   key down/up:       type, key, mod, repeat
+//   mouse motion:      type, x, y, xrel, yrel, button state
+//   mouse button:      type, button, x, y, clicks
+//   mouse wheel:       type, x, y, mouseX, mouseY
+//   anything else:     type
+#define CANVAS_EVENT_STRIDE 6
+
+static void canvas_write_event(int32_t *r, const SDL_Event *event) {
+  memset(r, 0, CANVAS_EVENT_STRIDE * sizeof(int32_t));
+  r[0] = event->type;
+  switch (event->type) {
+  case SDL_EVENT_KEY_DOWN:
+  case SDL_EVENT_KEY_UP:
+    r[1] = event->key.key;
+    r[2] = event->key.mod;
+    r[3] = event->key.repeat;
+    break;
+  case SDL_EVENT_MOUSE_MOTION:
+    r[1] = event->motion.x;
+    r[2] = event->motion.y;
+    r[3] = (int32_t)lroundf(event->motion.xrel);
+    r[4] = (int32_t)lroundf(event->motion.yrel);
+    r[5] = event->motion.state;
+    break;
+  case SDL_EVENT_MOUSE_BUTTON_DOWN:
+  case SDL_EVENT_MOUSE_BUTTON_UP:
+    r[1] = event->button.button;
+    r[2] = event->button.x;
+    r[3] = event->button.y;
+    r[4] = event->button.clicks;
+    break;
+  case SDL_EVENT_MOUSE_WHEEL:
+    r[1] = event->wheel.x;
+    r[2] = event->wheel.y;
+    r[3] = event->wheel.mouse_x;
+    r[4] = event->wheel.mouse_y;
+    break;
+  }
+}
+
+// pollEvents(buffer: Int32Array, coalesceMotion = true): drains the event
+// queue into buffer and returns the number of records written. Events that
+// do not fit stay queued. With coalesceMotion, consecutive mouse motion
+// events collapse into one record with the latest position and the summed
+// relative motion.
+static JSValue js_canvas_poll_events(JSContext *ctx, JSValueConst this_val,
+                                     int argc, JSValueConst *argv) {
+  if (argc != 1 && argc != 2) {
+    fprintf(stderr,
+            "canvas.pollEvents() expected 1 or 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  // a Uint32Array or Float32Array has the same width, but other values;
+  // only an Int32Array holds the records as written
+  if (JS_GetTypedArrayType(argv[0]) != JS_TYPED_ARRAY_INT32) {
+    return JS_ThrowTypeError(ctx, "expected an Int32Array");
+  }
+  size_t len;
+  int32_t *records =
+      js_get_typed_array(ctx, argv[0], sizeof(int32_t), "an Int32Array", &len);
+  if (!records) {
+    return JS_EXCEPTION;
+  }
+  bool coalesce =
+      argc < 2 || JS_IsUndefined(argv[1]) || JS_ToBool(ctx, argv[1]);
+
+  size_t capacity = len / CANVAS_EVENT_STRIDE;
+  size_t count = 0;
+  int32_t *last = NULL;
+  // relative motion of the coalesced record, summed before rounding so that
+  // sub-pixel steps of precise mice and touchpads add up
+  float xrel = 0, yrel = 0;
+  SDL_Event event;
+  while (count < capacity && SDL_PollEvent(&event)) {
+    if (canvas_handle_event(ctx, s, &event)) {
+      return JS_EXCEPTION;
+    }
+    if (coalesce && event.type == SDL_EVENT_MOUSE_MOTION && last &&
+        last[0] == SDL_EVENT_MOUSE_MOTION) {
+      xrel += event.motion.xrel;
+      yrel += event.motion.yrel;
+      last[1] = event.motion.x;
+      last[2] = event.motion.y;
+      last[3] = (int32_t)lroundf(xrel);
+      last[4] = (int32_t)lroundf(yrel);
+      last[5] = event.motion.state;
+      continue;
+    }
+    last = records + count * CANVAS_EVENT_STRIDE;
+    canvas_write_event(last, &event);
+    if (event.type == SDL_EVENT_MOUSE_MOTION) {
+      xrel = event.motion.xrel;
+      yrel = event.motion.yrel;
+    }
+    count++;
+  }
+  return JS_NewInt64(ctx, count);
+}
+
+// putImageData(imageData, x, y) copies straight-alpha RGBA bytes from any
+// {width, height, data} object back into the canvas, ignoring the matrix,
+// the alpha and the paint, like the web API.
+static JSValue js_canvas_put_image_data(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  if (argc != 3) {
+    fprintf(stderr, "canvas.putImageData() expected 3 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  int32_t x, y, w = 0, h = 0;
+  if (JS_ToInt32(ctx, &x, argv[1]) || JS_ToInt32(ctx, &y, argv[2])) {
+    return JS_EXCEPTION;
+  }
+  JSValue val = JS_GetPropertyStr(ctx, argv[0], "width");
+  int ret = JS_ToInt32(ctx, &w, val);
+  JS_FreeValue(ctx, val);
+  if (ret) {
+    return JS_EXCEPTION;
+  }
+  val = JS_GetPropertyStr(ctx, argv[0], "height");
+  ret = JS_ToInt32(ctx, &h, val);
+  JS_FreeValue(ctx, val);
+  if (ret) {
+    return JS_EXCEPTION;
+  }
+  val = JS_GetPropertyStr(ctx, argv[0], "data");
+  if (JS_IsException(val)) {
+    return val;
+  }
+  // val holds the only reference when data is a getter that returns a new
+  // array, so it stays alive until the copy is done
+  size_t size;
+  const uint8_t *src =
+      js_get_typed_array(ctx, val, 1, "a Uint8ClampedArray", &size);
+  if (!src) {
+    JS_FreeValue(ctx, val);
+    return JS_EXCEPTION;
+  }
+  if (w <= 0 || h <= 0 || (uint64_t)w * h * 4 > size) {
+    JS_FreeValue(ctx, val);
+    return JS_ThrowRangeError(ctx, "image data does not hold %dx%d pixels", w,
+                              h);
+  }
+
+  // everything drawn before must land first
+  canvas_flush(s);
+  SDL_Rect clip;
+  if (!canvas_clip_rect(s, x, y, w, h, &clip)) {
+    JS_FreeValue(ctx, val);
+    return JS_UNDEFINED;
+  }
+  uint8_t *dst = s->pixels;
+  int stride = s->width * 4;
+  for (int row = clip.y; row < clip.y + clip.h; row++) {
+    plutovg_convert_rgba_to_argb(
+        dst + (size_t)row * stride + clip.x * 4,
+        src + ((size_t)(row - y) * w + (clip.x - x)) * 4, clip.w, 1,
+        clip.w * 4);
+  }
+  JS_FreeValue(ctx, val);
+  canvas_add_damage(s, clip.x, clip.y, clip.x + clip.w, clip.y + clip.h);
+  s->geometry_upload = s->geometry;
+  if (canvas_record(s, RECORD_PIXELS)) {
+    recorder_pixels(s, &clip);
+  }
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_quit(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_set_fill_color(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "canvas.setFillColor() expected 3 or 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  int32_t r = 0, g = 0, b = 0, a = 255;
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+
+  if (JS_ToInt32(ctx, &r, argv[0]) || JS_ToInt32(ctx, &g, argv[1]) ||
+      JS_ToInt32(ctx, &b, argv[2]) ||
+      (argc == 4 && JS_ToInt32(ctx, &a, argv[3]))) {
+    return JS_EXCEPTION;
+  }
+  SDL_Color color = (SDL_Color){.r = r, .g = g, .b = b, .a = a};
+
+  s->fill_style.color = color;
+  canvas_apply_fill_style(s);
+  return JS_UNDEFINED;
+}
+
+// h in degrees, s and l in 0..1, or in percent when above 1. Rounds like
+// the hslToRgb() that main.js used to carry.
+static SDL_Color color_from_hsl(double h, double s, double l, int32_t a) {
+  h = isfinite(h) ? fmod(fmod(h, 360) + 360, 360) : 0;
+  if (s > 1) {
+    s /= 100;
+  }
+  if (l > 1) {
+    l /= 100;
+  }
+  double c = (1 - fabs(2 * l - 1)) * s;
+  double hh = h / 60;
+  double x = c * (1 - fabs(fmod(hh, 2) - 1));
+  double m = l - c / 2;
+  double rgb[6][3] = {{c, x, 0}, {x, c, 0}, {0, c, x},
+                      {0, x, c}, {x, 0, c}, {c, 0, x}};
+  const double *t = rgb[SDL_clamp((int)hh, 0, 5)];
+  return (SDL_Color){
+      .r = SDL_clamp(lround((t[0] + m) * 255), 0, 255),
+      .g = SDL_clamp(lround((t[1] + m) * 255), 0, 255),
+      .b = SDL_clamp(lround((t[2] + m) * 255), 0, 255),
+      .a = a,
+  };
+}
+
+// 0xRRGGBBAA, the order of the CSS #rrggbbaa notation
+static SDL_Color color_from_packed(uint32_t rgba) {
+  return (SDL_Color){.r = rgba >> 24,
+                     .g = rgba >> 16 & 0xFF,
+                     .b = rgba >> 8 & 0xFF,
+                     .a = rgba & 0xFF};
+}
+
+// Reads the h, s, l and optional alpha arguments of setFillColorHSL() and
+// Canvas.hsl().
+static int js_get_hsl_args(JSContext *ctx, int argc, JSValueConst *argv,
+                           SDL_Color *color) {
+  double h, sat, l;
+  int32_t a = 255;
+  if (JS_ToFloat64(ctx, &h, argv[0]) || JS_ToFloat64(ctx, &sat, argv[1]) ||
+      JS_ToFloat64(ctx, &l, argv[2]) ||
+      (argc == 4 && JS_ToInt32(ctx, &a, argv[3]))) {
+    return -1;
+  }
+  *color = color_from_hsl(h, sat, l, a);
+  return 0;
+}
+
+static JSValue js_canvas_set_fill_color_hsl(JSContext *ctx,
+                                            JSValueConst this_val, int argc,
+                                            JSValueConst *argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "canvas.setFillColorHSL() expected 3 or 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  if (js_get_hsl_args(ctx, argc, argv, &s->fill_style.color)) {
+    return JS_EXCEPTION;
+  }
+  canvas_apply_fill_style(s);
+  return JS_UNDEFINED;
+}
+
+// One argument instead of four, e.g. a color from Canvas.hsl().
+static JSValue js_canvas_set_fill_color_packed(JSContext *ctx,
+                                               JSValueConst this_val, int argc,
+                                               JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr,
+            "canvas.setFillColorPacked() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  int32_t rgba;
+  // ToInt32 wraps modulo 2^32, so 0xFF0000FF arrives intact
+  if (JS_ToInt32(ctx, &rgba, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  s->fill_style.color = color_from_packed((uint32_t)rgba);
+  canvas_apply_fill_style(s);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_set_global_alpha(JSContext *ctx, JSValueConst this_val,
+                                          int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "canvas.setGlobalAlpha() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double alpha = 1.0;
+  if (JS_ToFloat64(ctx, &alpha, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  plutovg_canvas_set_opacity(s->plutovg_canvas, alpha);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_set_line_width(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "canvas.setLineWidth() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double width = 1.0;
+  if (JS_ToFloat64(ctx, &width, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  plutovg_canvas_set_line_width(s->plutovg_canvas, width);
+  return JS_UNDEFINED;
+}
+
+// Writes the current pixels of an offscreen canvas to its output, either as
+// one PNG per frame or appended to a raw stream of straight RGBA frames.
+static int canvas_write_frame(JSCanvas *s) {
+  if (canvas_output_is_png(s->output)) {
+    char path[4096];
+    snprintf(path, sizeof(path), s->output, s->frame_index);
+    if (!plutovg_surface_write_to_png(s->plutovg_surface, path)) {
+      fprintf(stderr, "PlutoVG could not write %s!\n", path);
+      return 1;
+    }
+    s->frame_index++;
+    return 0;
+  }
+
+  size_t size = (size_t)s->width * s->height * 4;
+  if (s->output_file == NULL) {
+    if (!strcmp(s->output, "-")) {
+      s->output_file = stdout;
+    } else {
+      s->output_file = fopen(s->output, "wb");
+    }
+    if (s->output_file == NULL) {
+      perror(s->output);
+      return 1;
+    }
+  }
+  if (s->output_rgba == NULL) {
+    s->output_rgba = malloc(size);
+    if (s->output_rgba == NULL) {
+      fprintf(stderr, "Could not allocate the output frame!\n");
+      return 1;
+    }
+  }
+  plutovg_convert_argb_to_rgba(s->output_rgba, s->pixels, s->width, s->height,
+                               s->width * 4);
+  if (fwrite(s->output_rgba, size, 1, s->output_file) != 1) {
+    perror(s->output);
+    return 1;
+  }
+  s->frame_index++;
+  return 0;
+}
+
+// Copies the damage from s->pixels into the texture. The texture is
+// write-only and its contents are undefined after a lock, so plutovg keeps
+// drawing into s->pixels (the trail effect reads it back) and only the
+// damaged rectangles are copied.
+static int canvas_upload(JSCanvas *s) {
+  if (canvas_ensure_texture(s)) {
+    return -1;
+  }
+  BENCH_BEGIN(BENCH_UPLOAD);
+  int pitch = s->width * 4;
+  if (s->dirty_all) {
+    if (!SDL_UpdateTexture(s->texture, NULL, s->pixels, pitch)) {
+      fprintf(stderr, "SDL could not update texture! SDL_Error: %s\n",
+              SDL_GetError());
+      return -1;
+    }
+  } else {
+    for (int i = 0; i < s->dirty_count; i++) {
+      const SDL_Rect *rect = &s->dirty_rects[i];
+      const uint8_t *src =
+          (const uint8_t *)s->pixels + rect->y * pitch + rect->x * 4;
+      if (!SDL_UpdateTexture(s->texture, rect, src, pitch)) {
+        fprintf(stderr, "SDL could not update texture! SDL_Error: %s\n",
+                SDL_GetError());
+        return -1;
+      }
+    }
+  }
+  BENCH_END(BENCH_UPLOAD);
+  return 0;
+}
+
+// Ends a frame: offscreen canvases write it to their output, the others
+// upload the damage and present. Returns 1 after a present, with the time
+// the frame took until then in *work_ns, 0 when there was nothing to present
+// and -1 on errors.
+static int canvas_show(JSCanvas *s, uint64_t *work_ns) {
+  if (canvas_record(s, RECORD_FRAME)) {
+    recorder_u64(SDL_GetTicksNS() - recorder.start_ns);
+    recorder_flush();
+  }
+  if (s->geometry) {
+    // drawn straight into the texture, nothing to upload
+    int ret = geometry_render(s);
+    canvas_discard_commands(s);
+    if (ret) {
+      return -1;
+    }
+  } else {
+    canvas_flush(s);
+  }
+  if (s->offscreen) {
+    // every show() is a frame of the output, drawn or not
+    s->dirty_all = false;
+    s->dirty_count = 0;
+    if (s->output && canvas_write_frame(s)) {
+      return -1;
+    }
+    return 0;
+  }
+  // Nothing was drawn since the last present, the window still shows it.
+  if (!s->dirty_all && s->dirty_count == 0) {
+    return 0;
+  }
+  if (!s->geometry && canvas_upload(s)) {
+    return -1;
+  }
+  s->dirty_all = false;
+  s->dirty_count = 0;
+
+  // the frame so far, without requestAnimationFrame it started at the
+  // previous present; the present itself waits for the display
+  uint64_t start = SDL_max(frame_scheduler.frame_start_ns, s->last_present_ns);
+  *work_ns = start ? SDL_GetTicksNS() - start : 0;
+
+  BENCH_BEGIN(BENCH_PRESENT);
+  SDL_Renderer *renderer = s->renderer;
+  // clears the letterbox bars, the texture covers the whole view
+  SDL_RenderClear(renderer);
+  if (!SDL_RenderTexture(renderer, s->texture, NULL, NULL)) {
+    fprintf(stderr, "SDL could not render texture! SDL_Error: %s\n",
+            SDL_GetError());
+    return -1;
+  }
+
+  if (!SDL_RenderPresent(renderer)) {
+    fprintf(stderr, "SDL could not present window! SDL_Error: %s\n",
+            SDL_GetError());
+    return -1;
+  }
+  BENCH_END(BENCH_PRESENT);
+  frame_scheduler.presented = true;
+  s->last_present_ns = SDL_GetTicksNS();
+  return 1;
+}
+
+static JSValue js_canvas_show(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  uint64_t work_ns;
+  int ret = canvas_show(s, &work_ns);
+  if (ret < 0) {
+    return JS_EXCEPTION;
+  }
+  if (ret > 0 && s->target_frame_ns &&
+      canvas_update_resolution(ctx, s, work_ns)) {
+    return JS_EXCEPTION;
+  }
+  return JS_UNDEFINED;
+}
+
+// stroke() strokes the current path, stroke(path, transform) a Path2D, with
+// the fill color and the width set by setLineWidth().
+static JSValue js_canvas_stroke(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv) {
+  if (argc > 2) {
+    fprintf(stderr, "canvas.stroke() expected 0 to 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  JSPath2D *path;
+  plutovg_matrix_t transform;
+  bool has_transform;
+  if (js_get_path_args(ctx, argc, argv, &path, &transform, &has_transform)) {
+    return JS_EXCEPTION;
+  }
+  canvas_apply_fill_style(s);
+  if (path) {
+    canvas_draw_path2d(s, path, has_transform ? &transform : NULL, true);
+    return JS_UNDEFINED;
+  }
+  canvas_stroke_path(s);
+  s->path_empty = true;
+  s->path_is_circle = false;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_stroke_lines(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv) {
+  if (argc != 1 && argc != 2) {
+    fprintf(stderr,
+            "canvas.strokeLines() expected 1 or 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  float *records;
+  int count = js_get_records(ctx, argc, argv, CANVAS_LINE_RECORD, &records);
+  if (count < 0) {
+    return JS_EXCEPTION;
+  }
+
+  float line_width = plutovg_canvas_get_line_width(s->plutovg_canvas);
+  float last_color[4] = {-1, -1, -1, -1};
+  for (int i = 0; i < count; i++) {
+    const float *r = records + i * CANVAS_LINE_RECORD;
+    if (r[4] <= 0 || r[8] <= 0) {
+      continue;
+    }
+    canvas_set_record_color(s, r + 5, last_color);
+    canvas_stroke_line(s, r[0], r[1], r[2], r[3], r[4]);
+  }
+  plutovg_canvas_set_line_width(s->plutovg_canvas, line_width);
+  canvas_apply_fill_style(s);
+  return JS_UNDEFINED;
+}
+
+// Wraps a Canvas method in a trace span named after it. Methods that draw
+// also count as draw calls.
+#define TRACE_CANVAS_METHOD(func, name, draws)                                 \
+  static JSValue func##_traced(JSContext *ctx, JSValueConst this_val,          \
+                               int argc, JSValueConst *argv) {                 \
+    if (!trace_enabled) {                                                      \
+      return func(ctx, this_val, argc, argv);                                  \
+    }                                                                          \
+    uint64_t start = SDL_GetTicksNS();                                         \
+    JSValue ret = func(ctx, this_val, argc, argv);                             \
+    trace_span("Canvas." name, start);                                         \
+    trace.draw_calls += draws;                                                 \
+    return ret;                                                                \
+  }
+
+TRACE_CANVAS_METHOD(js_canvas_arc, "arc", true)
+TRACE_CANVAS_METHOD(js_canvas_begin_path, "beginPath", false)
+TRACE_CANVAS_METHOD(js_canvas_clear, "clear", true)
+TRACE_CANVAS_METHOD(js_canvas_clear_rect, "clearRect", true)
+TRACE_CANVAS_METHOD(js_canvas_draw_canvas, "drawCanvas", true)
+TRACE_CANVAS_METHOD(js_canvas_draw_image, "drawImage", true)
+TRACE_CANVAS_METHOD(js_canvas_fade, "fade", true)
+TRACE_CANVAS_METHOD(js_canvas_fill, "fill", true)
+TRACE_CANVAS_METHOD(js_canvas_fill_circles, "fillCircles", true)
+TRACE_CANVAS_METHOD(js_canvas_fill_rect, "fillRect", true)
+TRACE_CANVAS_METHOD(js_canvas_fill_rects, "fillRects", true)
+TRACE_CANVAS_METHOD(js_canvas_fill_text, "fillText", true)
+TRACE_CANVAS_METHOD(js_canvas_get_image_data, "getImageData", false)
+TRACE_CANVAS_METHOD(js_canvas_invalidate_all, "invalidateAll", false)
+TRACE_CANVAS_METHOD(js_canvas_measure_text, "measureText", false)
+TRACE_CANVAS_METHOD(js_canvas_multiply, "multiply", true)
+TRACE_CANVAS_METHOD(js_canvas_poll_event, "pollEvent", false)
+TRACE_CANVAS_METHOD(js_canvas_poll_events, "pollEvents", false)
+TRACE_CANVAS_METHOD(js_canvas_put_image_data, "putImageData", true)
+TRACE_CANVAS_METHOD(js_canvas_quit, "quit", false)
+TRACE_CANVAS_METHOD(js_canvas_set_fill_color, "setFillColor", false)
+TRACE_CANVAS_METHOD(js_canvas_set_fill_color_hsl, "setFillColorHSL", false)
+TRACE_CANVAS_METHOD(js_canvas_set_fill_color_packed, "setFillColorPacked",
+                    false)
+TRACE_CANVAS_METHOD(js_canvas_set_global_alpha, "setGlobalAlpha", false)
+TRACE_CANVAS_METHOD(js_canvas_set_line_width, "setLineWidth", false)
+TRACE_CANVAS_METHOD(js_canvas_show, "show", false)
+TRACE_CANVAS_METHOD(js_canvas_stroke, "stroke", true)
+TRACE_CANVAS_METHOD(js_canvas_stroke_lines, "strokeLines", true)
+
+static const JSCFunctionListEntry js_canvas_proto_funcs[] = {
+    JS_CGETSET_MAGIC_DEF("width", js_canvas_get_wh, NULL, 0),
+    JS_CGETSET_MAGIC_DEF("height", js_canvas_get_wh, NULL, 1),
+    JS_CGETSET_MAGIC_DEF("pixelWidth", js_canvas_get_wh, NULL, 2),
+    JS_CGETSET_MAGIC_DEF("pixelHeight", js_canvas_get_wh, NULL, 3),
+    JS_CGETSET_DEF("pixels", js_canvas_get_pixels, NULL),
+    JS_CGETSET_DEF("resolutionScale", js_canvas_get_resolution_scale,
+                   js_canvas_set_resolution_scale),
+    JS_CGETSET_DEF("font", js_canvas_get_font, js_canvas_set_font),
+
+    JS_CFUNC_DEF("arc", 6, js_canvas_arc_traced),
+    JS_CFUNC_DEF("beginPath", 0, js_canvas_begin_path_traced),
+    JS_CFUNC_DEF("clear", 0, js_canvas_clear_traced),
+    JS_CFUNC_DEF("clearRect", 4, js_canvas_clear_rect_traced),
+    JS_CFUNC_DEF("drawCanvas", 4, js_canvas_draw_canvas_traced),
+    JS_CFUNC_DEF("drawImage", 9, js_canvas_draw_image_traced),
+    JS_CFUNC_DEF("fade", 4, js_canvas_fade_traced),
+    JS_CFUNC_DEF("fill", 2, js_canvas_fill_traced),
+    JS_CFUNC_DEF("fillCircles", 2, js_canvas_fill_circles_traced),
+    JS_CFUNC_DEF("fillRect", 4, js_canvas_fill_rect_traced),
+    JS_CFUNC_DEF("fillRects", 2, js_canvas_fill_rects_traced),
+    JS_CFUNC_DEF("fillText", 3, js_canvas_fill_text_traced),
+    JS_CFUNC_DEF("getImageData", 4, js_canvas_get_image_data_traced),
+    JS_CFUNC_DEF("invalidateAll", 0, js_canvas_invalidate_all_traced),
+    JS_CFUNC_DEF("measureText", 1, js_canvas_measure_text_traced),
+    JS_CFUNC_DEF("multiply", 4, js_canvas_multiply_traced),
+    JS_CFUNC_DEF("pollEvent", 0, js_canvas_poll_event_traced),
+    JS_CFUNC_DEF("pollEvents", 2, js_canvas_poll_events_traced),
+    JS_CFUNC_DEF("putImageData", 3, js_canvas_put_image_data_traced),
+    JS_CFUNC_DEF("quit", 0, js_canvas_quit_traced),
+    JS_CFUNC_DEF("setFillColor", 4, js_canvas_set_fill_color_traced),
+    JS_CFUNC_DEF("setFillColorHSL", 4, js_canvas_set_fill_color_hsl_traced),
+    JS_CFUNC_DEF("setFillColorPacked", 1,
+                 js_canvas_set_fill_color_packed_traced),
+    JS_CFUNC_DEF("setGlobalAlpha", 1, js_canvas_set_global_alpha_traced),
+    JS_CFUNC_DEF("setLineWidth", 1, js_canvas_set_line_width_traced),
+    JS_CFUNC_DEF("show", 0, js_canvas_show_traced),
+    JS_CFUNC_DEF("stroke", 2, js_canvas_stroke_traced),
+    JS_CFUNC_DEF("strokeLines", 2, js_canvas_stroke_lines_traced),
+};
+
+// Canvas.loadFont(family, path) loads a TrueType or OpenType file for
+// canvas.font to use under the family name.
+static JSValue js_canvas_load_font(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Canvas.loadFont() expected 2 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  const char *family = JS_ToCString(ctx, argv[0]);
+  if (!family) {
+    return JS_EXCEPTION;
+  }
+  const char *path = JS_ToCString(ctx, argv[1]);
+  if (!path) {
+    JS_FreeCString(ctx, family);
+    return JS_EXCEPTION;
+  }
+  JSValue ret = JS_UNDEFINED;
+  if (text_face_load(family, path) < 0) {
+    ret = JS_ThrowTypeError(ctx, "could not load font '%s'", path);
+  }
+  JS_FreeCString(ctx, family);
+  JS_FreeCString(ctx, path);
+  return ret;
+}
+
+// Canvas.hsl(h, s, l, a = 255) packs an HSL color for setFillColorPacked()
+// or a record batch without allocating an array.
+static JSValue js_canvas_hsl(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Canvas.hsl() expected 3 or 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  SDL_Color c;
+  if (js_get_hsl_args(ctx, argc, argv, &c)) {
+    return JS_EXCEPTION;
+  }
+  return JS_NewUint32(ctx, (uint32_t)c.r << 24 | c.g << 16 | c.b << 8 | c.a);
+}
+
+static const JSCFunctionListEntry js_canvas_static_funcs[] = {
+    JS_PROP_INT32_DEF("EVENT_STRIDE", CANVAS_EVENT_STRIDE, 0),
+    JS_CFUNC_DEF("hsl", 4, js_canvas_hsl),
+    JS_CFUNC_DEF("loadFont", 2, js_canvas_load_font),
+};
+
+static int js_canvas_init(JSContext *ctx) {
+  JSValue canvas_proto, canvas_class, layer_proto, layer_class;
+
+  JS_NewClassID(&js_canvas_class_id);
+  JS_NewClass(JS_GetRuntime(ctx), js_canvas_class_id, &js_canvas_class);
+  pixel_kernels_init();
+
+  canvas_proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, canvas_proto, js_canvas_proto_funcs,
+                             countof(js_canvas_proto_funcs));
+
+  canvas_class = JS_NewCFunction2(ctx, js_canvas_ctor, "Canvas", 2,
+                                  JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, canvas_class, canvas_proto);
+  JS_SetClassProto(ctx, js_canvas_class_id, canvas_proto);
+  JS_SetPropertyFunctionList(ctx, canvas_class, js_canvas_static_funcs,
+                             countof(js_canvas_static_funcs));
+
+  // OffscreenCanvas shares the Canvas class and inherits its methods
+  layer_proto = JS_NewObjectProto(ctx, canvas_proto);
+  layer_class = JS_NewCFunction2(ctx, js_offscreen_canvas_ctor,
+                                 "OffscreenCanvas", 2, JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, layer_class, layer_proto);
+  JS_FreeValue(ctx, layer_proto);
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyStr(ctx, global, "Canvas", canvas_class);
+  JS_SetPropertyStr(ctx, global, "OffscreenCanvas", layer_class);
+  JS_FreeValue(ctx, global);
+
+  return 0;
+}
+
+// #endregion
+
+// #region replay
+//
+// --replay FILE plays a --record stream back through the drawing core,
+// without any JS. Frames follow each other as fast as the canvases allow,
+// --headless and --output behave as they do for scripts, --frames stops
+// early and --raster immediate|deferred|geometry overrides how the recorded
+// canvases render. yanhua_bench reports the timings of a replay like a
+// script's.
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool error;
+  // pixels of the IMAGE records so far
+  plutovg_surface_t **images;
+  uint32_t image_count;
+} ReplayReader;
+
+static const void *replay_read(ReplayReader *r, size_t size) {
+  if (r->error || (size_t)(r->end - r->p) < size) {
+    r->error = true;
+    return NULL;
+  }
+  const void *data = r->p;
+  r->p += size;
+  return data;
+}
+
+static uint8_t replay_u8(ReplayReader *r) {
+  const uint8_t *p = replay_read(r, 1);
+  return p ? *p : 0;
+}
+
+static int32_t replay_i32(ReplayReader *r) {
+  int32_t v = 0;
+  const void *p = replay_read(r, sizeof(v));
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+static uint32_t replay_u32(ReplayReader *r) {
+  uint32_t v = 0;
+  const void *p = replay_read(r, sizeof(v));
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+static uint64_t replay_u64(ReplayReader *r) {
+  uint64_t v = 0;
+  const void *p = replay_read(r, sizeof(v));
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+static float replay_f32(ReplayReader *r) {
+  float v = 0;
+  const void *p = replay_read(r, sizeof(v));
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+// A recorded string, NUL-terminated, to be freed by the caller. Returns NULL
+// on errors.
+static char *replay_string(ReplayReader *r, size_t *plen) {
+  uint32_t len = replay_u32(r);
+  *plen = len;
+  const char *data = replay_read(r, len);
+  char *s = data ? malloc((size_t)len + 1) : NULL;
+  if (s) {
+    memcpy(s, data, len);
+    s[len] = '\0';
+  }
+  return s;
+}
+
+static plutovg_path_t *replay_path(ReplayReader *r, bool *has_curves) {
+  plutovg_path_t *path = plutovg_path_create();
+  uint32_t count = replay_u32(r);
+  *has_curves = false;
+  for (uint32_t i = 0; i < count && !r->error; i++) {
+    uint8_t command = replay_u8(r);
+    uint8_t npoints = replay_u8(r);
+    float v[6] = {0};
+    for (int j = 0; j < npoints; j++) {
+      float x = replay_f32(r);
+      float y = replay_f32(r);
+      if (j < 3) {
+        v[j * 2] = x;
+        v[j * 2 + 1] = y;
+      }
+    }
+    switch (command) {
+    case PLUTOVG_PATH_COMMAND_MOVE_TO:
+      plutovg_path_move_to(path, v[0], v[1]);
+      break;
+    case PLUTOVG_PATH_COMMAND_LINE_TO:
+      plutovg_path_line_to(path, v[0], v[1]);
+      break;
+    case PLUTOVG_PATH_COMMAND_CUBIC_TO:
+      plutovg_path_cubic_to(path, v[0], v[1], v[2], v[3], v[4], v[5]);
+      *has_curves = true;
+      break;
+    case PLUTOVG_PATH_COMMAND_CLOSE:
+      plutovg_path_close(path);
+      break;
+    default:
+      r->error = true;
+      break;
+    }
+  }
+  return path;
+}
+
+static void replay_free_canvas(JSCanvas *s) {
+  canvas_finalizer(s);
+  free(s);
+}
+
+static JSCanvas *replay_create_canvas(ReplayReader *r) {
+  JSCanvas *s = calloc(1, sizeof(JSCanvas));
+  if (!s) {
+    return NULL;
+  }
+  s->fill_style.color = (SDL_Color){.r = 0, .g = 0, .b = 0, .a = 255};
+  s->pixels_buffer = JS_UNDEFINED;
+  s->path_empty = true;
+  s->view_width = replay_i32(r);
+  s->view_height = replay_i32(r);
+  s->resolution_scale = replay_f32(r);
+  s->min_scale = 0.5f;
+  uint8_t flags = replay_u8(r);
+  s->thread_count = replay_i32(r);
+  if (r->error || s->view_width <= 0 || s->view_height <= 0 ||
+      !(s->resolution_scale > 0 && s->resolution_scale <= 1)) {
+    r->error = true;
+    free(s);
+    return NULL;
+  }
+  s->deferred = flags & RECORD_DEFERRED;
+  s->geometry = flags & RECORD_GEOMETRY;
+  if (app_options.raster) {
+    s->geometry = !strcmp(app_options.raster, "geometry");
+    s->deferred = s->geometry || !strcmp(app_options.raster, "deferred");
+  }
+  s->layer = flags & RECORD_LAYER;
+  s->offscreen = (flags & RECORD_OFFSCREEN) || app_options.headless;
+  // as in the constructor, offscreen canvases stay with plutovg
+  s->geometry = s->geometry && !s->offscreen;
+  if (app_options.headless && app_options.output && !s->layer) {
+    s->output = strdup(app_options.output);
+  }
+  if (canvas_initializer(s)) {
+    replay_free_canvas(s);
+    return NULL;
+  }
+  return s;
+}
+
+// Copies recorded pixels into the canvas, clipped to it.
+static void replay_pixels(ReplayReader *r, JSCanvas *s) {
+  SDL_Rect rect;
+  rect.x = replay_i32(r);
+  rect.y = replay_i32(r);
+  rect.w = replay_i32(r);
+  rect.h = replay_i32(r);
+  if (rect.w < 0 || rect.h < 0) {
+    r->error = true;
+    return;
+  }
+  const uint8_t *src = replay_read(r, (size_t)rect.w * rect.h * 4);
+  SDL_Rect clip;
+  if (!src || !canvas_clip_rect(s, rect.x, rect.y, rect.w, rect.h, &clip)) {
+    return;
+  }
+  canvas_flush(s);
+  for (int row = clip.y; row < clip.y + clip.h; row++) {
+    memcpy((uint8_t *)s->pixels + ((size_t)row * s->width + clip.x) * 4,
+           src + ((size_t)(row - rect.y) * rect.w + (clip.x - rect.x)) * 4,
+           (size_t)clip.w * 4);
+  }
+  canvas_add_damage(s, clip.x, clip.y, clip.x + clip.w, clip.y + clip.h);
+  s->geometry_upload = s->geometry;
+}
+
+// Keeps the pixels of an IMAGE record for the DRAW_IMAGE records.
+static int replay_image(ReplayReader *r) {
+  uint32_t id = replay_u32(r);
+  int32_t width = replay_i32(r);
+  int32_t height = replay_i32(r);
+  if (id != r->image_count + 1 || width <= 0 || height <= 0) {
+    r->error = true;
+    return -1;
+  }
+  const uint8_t *src = replay_read(r, (size_t)width * height * 4);
+  if (!src) {
+    return -1;
+  }
+  plutovg_surface_t **images =
+      realloc(r->images, id * sizeof(plutovg_surface_t *));
+  if (!images) {
+    return -1;
+  }
+  r->images = images;
+  // copied, the stream gives no alignment
+  plutovg_surface_t *surface = plutovg_surface_create(width, height);
+  if (!surface) {
+    return -1;
+  }
+  uint8_t *data = plutovg_surface_get_data(surface);
+  int stride = plutovg_surface_get_stride(surface);
+  for (int y = 0; y < height; y++) {
+    memcpy(data + (size_t)y * stride, src + (size_t)y * width * 4,
+           (size_t)width * 4);
+  }
+  images[id - 1] = surface;
+  r->image_count = id;
+  return 0;
+}
+
+// Runs one record. Returns -1 on errors, 1 after a frame marker.
+static int replay_record(ReplayReader *r, JSCanvas ***canvases,
+                         uint32_t *canvas_count, JSCanvas **target) {
+  RecordOp op = replay_u8(r);
+  JSCanvas *s = *target;
+  if (op != RECORD_CANVAS && op != RECORD_TARGET && op != RECORD_FONT &&
+      op != RECORD_IMAGE && !s) {
+    r->error = true;
+    return -1;
+  }
+  switch (op) {
+  case RECORD_CANVAS: {
+    uint32_t id = replay_u32(r);
+    if (id != *canvas_count + 1) {
+      r->error = true;
+      return -1;
+    }
+    JSCanvas **list = realloc(*canvases, id * sizeof(JSCanvas *));
+    if (!list) {
+      return -1;
+    }
+    *canvases = list;
+    list[id - 1] = replay_create_canvas(r);
+    if (!list[id - 1]) {
+      return -1;
+    }
+    *canvas_count = id;
+    *target = list[id - 1];
+    break;
+  }
+  case RECORD_TARGET: {
+    uint32_t id = replay_u32(r);
+    if (id == 0 || id > *canvas_count) {
+      r->error = true;
+      return -1;
+    }
+    *target = (*canvases)[id - 1];
+    break;
+  }
+  case RECORD_FRAME: {
+    replay_u64(r);
+    uint64_t work_ns;
+    if (canvas_show(s, &work_ns) < 0) {
+      return -1;
+    }
+    return 1;
+  }
+  case RECORD_PAINT: {
+    float c[4];
+    for (int i = 0; i < 4; i++) {
+      c[i] = replay_f32(r);
+    }
+    canvas_set_paint(s, c[0], c[1], c[2], c[3]);
+    break;
+  }
+  case RECORD_OPACITY:
+    plutovg_canvas_set_opacity(s->plutovg_canvas, replay_f32(r));
+    break;
+  case RECORD_LINE_WIDTH:
+    plutovg_canvas_set_line_width(s->plutovg_canvas, replay_f32(r));
+    break;
+  case RECORD_CLEAR:
+    canvas_clear_all(s);
+    break;
+  case RECORD_MUL_ADD: {
+    uint32_t add = replay_u32(r);
+    uint32_t factors = replay_u32(r);
+    canvas_mul_add(s, add, factors);
+    break;
+  }
+  case RECORD_CIRCLE: {
+    float x = replay_f32(r);
+    float y = replay_f32(r);
+    float radius = replay_f32(r);
+    canvas_fill_circle(s, x, y, radius);
+    break;
+  }
+  case RECORD_RECT: {
+    float v[4];
+    for (int i = 0; i < 4; i++) {
+      v[i] = replay_f32(r);
+    }
+    // fillRect() and clearRect() are the only rectangles recorded
+    uint8_t rect_op = replay_u8(r);
+    if (rect_op != PLUTOVG_OPERATOR_SRC_OVER &&
+        rect_op != PLUTOVG_OPERATOR_CLEAR) {
+      r->error = true;
+      return -1;
+    }
+    canvas_fill_rect(s, v[0], v[1], v[2], v[3], rect_op);
+    break;
+  }
+  case RECORD_LINE: {
+    float v[5];
+    for (int i = 0; i < 5; i++) {
+      v[i] = replay_f32(r);
+    }
+    canvas_stroke_line(s, v[0], v[1], v[2], v[3], v[4]);
+    break;
+  }
+  case RECORD_FILL:
+  case RECORD_STROKE: {
+    bool has_curves;
+    plutovg_path_t *path = replay_path(r, &has_curves);
+    plutovg_canvas_new_path(s->plutovg_canvas);
+    plutovg_canvas_add_path(s->plutovg_canvas, path);
+    plutovg_path_destroy(path);
+    if (op == RECORD_FILL) {
+      canvas_fill_path(s);
+    } else {
+      canvas_stroke_path(s);
+    }
+    break;
+  }
+  case RECORD_FILL_PATH2D:
+  case RECORD_STROKE_PATH2D: {
+    plutovg_matrix_t transform;
+    bool has_transform = replay_u8(r);
+    if (has_transform) {
+      transform.a = replay_f32(r);
+      transform.b = replay_f32(r);
+      transform.c = replay_f32(r);
+      transform.d = replay_f32(r);
+      transform.e = replay_f32(r);
+      transform.f = replay_f32(r);
+    }
+    JSPath2D p = {0};
+    p.path = replay_path(r, &p.has_curves);
+    canvas_draw_path2d(s, &p, has_transform ? &transform : NULL,
+                       op == RECORD_STROKE_PATH2D);
+    path2d_invalidate(&p);
+    plutovg_path_destroy(p.path);
+    break;
+  }
+  case RECORD_PIXELS:
+    replay_pixels(r, s);
+    break;
+  case RECORD_RESIZE: {
+    int32_t width = replay_i32(r);
+    int32_t height = replay_i32(r);
+    float scale = replay_f32(r);
+    if (width <= 0 || height <= 0 || !(scale > 0 && scale <= 1)) {
+      r->error = true;
+      return -1;
+    }
+    if (canvas_resize(s, width, height, scale)) {
+      return -1;
+    }
+    break;
+  }
+  case RECORD_DRAW_CANVAS: {
+    uint32_t id = replay_u32(r);
+    float x = replay_f32(r);
+    float y = replay_f32(r);
+    float alpha = replay_f32(r);
+    if (id == 0 || id > *canvas_count || (*canvases)[id - 1] == s) {
+      r->error = true;
+      return -1;
+    }
+    canvas_draw_layer(s, (*canvases)[id - 1], x, y, alpha);
+    break;
+  }
+  case RECORD_FONT: {
+    uint32_t index = replay_u32(r);
+    size_t len;
+    char *path = replay_string(r, &len);
+    if (!path) {
+      return -1;
+    }
+    int face = text_face_load(path, path);
+    if (face < 0) {
+      fprintf(stderr, "could not load font '%s'\n", path);
+    }
+    free(path);
+    if (face < 0 || (uint32_t)face != index) {
+      r->error = true;
+      return -1;
+    }
+    break;
+  }
+  case RECORD_IMAGE:
+    return replay_image(r);
+  case RECORD_DRAW_IMAGE: {
+    uint32_t id = replay_u32(r);
+    float v[8];
+    for (int i = 0; i < 8; i++) {
+      v[i] = replay_f32(r);
+    }
+    if (id == 0 || id > r->image_count) {
+      r->error = true;
+      return -1;
+    }
+    plutovg_rect_t src = {.x = v[0], .y = v[1], .w = v[2], .h = v[3]};
+    plutovg_rect_t dst = {.x = v[4], .y = v[5], .w = v[6], .h = v[7]};
+    canvas_draw_surface(s, r->images[id - 1], &src, &dst, 1);
+    break;
+  }
+  case RECORD_TEXT: {
+    uint32_t face = replay_u32(r);
+    float size = replay_f32(r);
+    float x = replay_f32(r);
+    float y = replay_f32(r);
+    size_t len;
+    char *text = replay_string(r, &len);
+    if (!text) {
+      return -1;
+    }
+    if (face < (uint32_t)text_face_count && size > 0) {
+      canvas_fill_text(s, face, size, text, len, x, y);
+    } else {
+      r->error = true;
+    }
+    free(text);
+    break;
+  }
+  default:
+    r->error = true;
+    return -1;
+  }
+  return r->error ? -1 : 0;
+}
+
+static int replay_run(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    fprintf(stderr, "%s: empty recording\n", path);
+    close(fd);
+    return 1;
+  }
+  const uint8_t *data =
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return 1;
+  }
+  ReplayReader r = {.p = data, .end = data + st.st_size};
+  const char *magic = replay_read(&r, 4);
+  if (!magic || memcmp(magic, RECORD_MAGIC, 4) ||
+      replay_u32(&r) != RECORD_VERSION) {
+    fprintf(stderr, "%s: not a recording of this version\n", path);
+    munmap((void *)data, st.st_size);
+    return 1;
+  }
+
+  JSCanvas **canvases = NULL;
+  uint32_t canvas_count = 0;
+  JSCanvas *target = NULL;
+  int frame = 0;
+  int status = 0;
+  bool quit = false;
+#ifdef YANHUA_BENCH
+  bench_frame_begin(frame);
+#endif
+  uint64_t frame_start = SDL_GetTicksNS();
+  while (r.p < r.end && !quit) {
+    int ret = replay_record(&r, &canvases, &canvas_count, &target);
+    if (ret < 0) {
+      if (r.error) {
+        fprintf(stderr, "%s: corrupt record at offset %td\n", path,
+                r.p - data);
+      }
+      status = 1;
+      break;
+    }
+    if (ret == 0) {
+      continue;
+    }
+#ifdef YANHUA_BENCH
+    bench_frame_end(SDL_GetTicksNS() - frame_start);
+#endif
+    trace_frame_end(NULL, frame_start);
+    frame_start = SDL_GetTicksNS();
+    frame++;
+    if (app_options.frames > 0 && frame >= app_options.frames) {
+      break;
+    }
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+      quit = quit || event.type == SDL_EVENT_QUIT;
+    }
+#ifdef YANHUA_BENCH
+    bench_frame_begin(frame);
+#endif
+  }
+
+  for (uint32_t i = 0; i < canvas_count; i++) {
+    replay_free_canvas(canvases[i]);
+  }
+  free(canvases);
+  for (uint32_t i = 0; i < r.image_count; i++) {
+    plutovg_surface_destroy(r.images[i]);
+  }
+  free(r.images);
+  munmap((void *)data, st.st_size);
+  return status;
+}
+
+// #endregion
+
+// #region ParticleSystem
+
+// Particles are stored as structure-of-arrays so that step() runs as plain
+// loops over contiguous floats, which the compiler vectorizes.
+typedef struct {
+  int count;
+  int capacity;
+  float *x;
+  float *y;
+  float *vx;
+  float *vy;
+  float *alpha;
+  float *decay;
+  float *r;
+  float *g;
+  float *b;
+
+  float gravity;
+  float damping;
+  float radius;
+  uint64_t rng;
+} JSParticleSystem;
+
+// Upper bound of the particle count, so that capacities and byte sizes stay
+// far from overflowing.
+#define PARTICLE_SYSTEM_MAX_COUNT (1 << 26)
+
+static JSClassID js_particle_system_class_id;
+
+static void particle_system_finalizer(JSParticleSystem *s) {
+  free(s->x);
+  free(s->y);
+  free(s->vx);
+  free(s->vy);
+  free(s->alpha);
+  free(s->decay);
+  free(s->r);
+  free(s->g);
+  free(s->b);
+}
+
+static void js_particle_system_finalizer(JSRuntime *rt, JSValue val) {
+  JSParticleSystem *s = JS_GetOpaque(val, js_particle_system_class_id);
+  if (s) {
+    particle_system_finalizer(s);
+  }
+  js_free_rt(rt, s);
+}
+
+// capacity is at most PARTICLE_SYSTEM_MAX_COUNT.
+static int particle_system_reserve(JSParticleSystem *s, int capacity) {
+  if (capacity <= s->capacity) {
+    return 0;
+  }
+  size_t new_capacity = SDL_max((size_t)s->capacity * 2, 1024);
+  while (new_capacity < (size_t)capacity) {
+    new_capacity *= 2;
+  }
+  new_capacity = SDL_min(new_capacity, PARTICLE_SYSTEM_MAX_COUNT);
+  float **arrays[] = {&s->x,     &s->y,     &s->vx, &s->vy, &s->alpha,
+                      &s->decay, &s->r,     &s->g,  &s->b};
+  for (size_t i = 0; i < countof(arrays); i++) {
+    float *p = realloc(*arrays[i], new_capacity * sizeof(float));
+    if (!p) {
+      return -1;
+    }
+    *arrays[i] = p;
+  }
+  s->capacity = (int)new_capacity;
+  return 0;
+}
+
+// Moves particle `from` into slot `to`.
+static void particle_system_move(JSParticleSystem *s, int to, int from) {
+  s->x[to] = s->x[from];
+  s->y[to] = s->y[from];
+  s->vx[to] = s->vx[from];
+  s->vy[to] = s->vy[from];
+  s->alpha[to] = s->alpha[from];
+  s->decay[to] = s->decay[from];
+  s->r[to] = s->r[from];
+  s->g[to] = s->g[from];
+  s->b[to] = s->b[from];
+}
+
+// Advances all particles by dt frames (1 = one 60 Hz frame) and removes the
+// ones that faded out by swapping the last particle into their slot.
+static void particle_system_step(JSParticleSystem *s, float dt) {
+  int n = s->count;
+  float *restrict x = s->x;
+  float *restrict y = s->y;
+  float *restrict vx = s->vx;
+  float *restrict vy = s->vy;
+  float *restrict alpha = s->alpha;
+  const float *restrict decay = s->decay;
+  float damping = powf(s->damping, dt);
+  float gravity = s->gravity * dt;
+
+  for (int i = 0; i < n; i++) {
+    vx[i] *= damping;
+    vy[i] = vy[i] * damping + gravity;
+    x[i] += vx[i] * dt;
+    y[i] += vy[i] * dt;
+    alpha[i] -= decay[i] * dt;
+  }
+
+  for (int i = 0; i < n;) {
+    if (alpha[i] > 0) {
+      i++;
+      continue;
+    }
+    n--;
+    if (i != n) {
+      particle_system_move(s, i, n);
+    }
+  }
+  s->count = n;
+}
+
+static JSValue js_particle_system_ctor(JSContext *ctx, JSValueConst new_target,
+                                       int argc, JSValueConst *argv) {
+  JSParticleSystem *s;
+  JSValue obj = JS_UNDEFINED;
+  JSValue proto;
+
+  s = js_mallocz(ctx, sizeof(*s));
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  s->gravity = 0.05f;
+  s->damping = 0.98f;
+  s->radius = 2;
+  xorshift64_seed(&s->rng, SDL_GetPerformanceCounter());
+
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  if (JS_IsException(proto)) {
+    goto fail;
+  }
+  obj = JS_NewObjectProtoClass(ctx, proto, js_particle_system_class_id);
+  JS_FreeValue(ctx, proto);
+  if (JS_IsException(obj)) {
+    goto fail;
+  }
+  JS_SetOpaque(obj, s);
+  return obj;
+fail:
+  js_free(ctx, s);
+  JS_FreeValue(ctx, obj);
+  return JS_EXCEPTION;
+}
+
+static JSClassDef js_particle_system_class = {
+    "ParticleSystem",
+    .finalizer = js_particle_system_finalizer,
+};
+
+// Reads an optional numeric property, keeping *pres when it is undefined.
+static int js_get_float_prop(JSContext *ctx, JSValueConst obj,
+                             const char *name, float *pres) {
+  if (!JS_IsObject(obj)) {
+    return 0;
+  }
+  JSValue val = JS_GetPropertyStr(ctx, obj, name);
+  if (JS_IsException(val)) {
+    return -1;
+  }
+  int ret = 0;
+  if (!JS_IsUndefined(val)) {
+    double d;
+    ret = JS_ToFloat64(ctx, &d, val);
+    if (ret == 0) {
+      *pres = d;
+    }
+  }
+  JS_FreeValue(ctx, val);
+  return ret;
+}
+
+static JSValue js_particle_system_emit(JSContext *ctx, JSValueConst this_val,
+                                       int argc, JSValueConst *argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "particles.emit() expected 3 or 4 arguments, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double x = 0, y = 0;
+  int64_t count = 0;
+  // ToInt64 saturates where ToInt32 would wrap a huge count around
+  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
+      JS_ToInt64(ctx, &count, argv[2])) {
+    return JS_EXCEPTION;
+  }
+  if (count <= 0) {
+    return JS_UNDEFINED;
+  }
+  if (count > PARTICLE_SYSTEM_MAX_COUNT - s->count) {
+    return JS_ThrowRangeError(
+        ctx, "emitting %" PRId64 " particles exceeds the limit of %d", count,
+        PARTICLE_SYSTEM_MAX_COUNT);
+  }
+
+  // params: {speedMin, speedMax, decayMin, decayMax, color: [r, g, b]}
+  JSValueConst params = argc == 4 ? argv[3] : JS_UNDEFINED;
+  float speed_min = 1, speed_max = 5;
+  float decay_min = 0.003f, decay_max = 0.018f;
+  float color[3] = {-1, -1, -1};
+  if (js_get_float_prop(ctx, params, "speedMin", &speed_min) ||
+      js_get_float_prop(ctx, params, "speedMax", &speed_max) ||
+      js_get_float_prop(ctx, params, "decayMin", &decay_min) ||
+      js_get_float_prop(ctx, params, "decayMax", &decay_max)) {
+    return JS_EXCEPTION;
+  }
+  if (JS_IsObject(params)) {
+    JSValue c = JS_GetPropertyStr(ctx, params, "color");
+    if (JS_IsException(c)) {
+      return JS_EXCEPTION;
+    }
+    for (int i = 0; i < 3 && !JS_IsUndefined(c); i++) {
+      JSValue v = JS_GetPropertyUint32(ctx, c, i);
+      double d = 0;
+      int ret = JS_ToFloat64(ctx, &d, v);
+      JS_FreeValue(ctx, v);
+      if (ret) {
+        JS_FreeValue(ctx, c);
+        return JS_EXCEPTION;
+      }
+      color[i] = d;
+    }
+    JS_FreeValue(ctx, c);
+  }
+
+  int end = s->count + (int)count;
+  if (particle_system_reserve(s, end)) {
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  uint64_t *rng = &s->rng;
+  for (int i = s->count; i < end; i++) {
+    float speed = speed_min + xorshift64_float(rng) * (speed_max - speed_min);
+    float angle = xorshift64_float(rng) * 2 * SDL_PI_F;
+    s->x[i] = x;
+    s->y[i] = y;
+    s->vx[i] = cosf(angle) * speed;
+    s->vy[i] = sinf(angle) * speed;
+    s->alpha[i] = 1;
+    s->decay[i] = decay_min + xorshift64_float(rng) * (decay_max - decay_min);
+    s->r[i] = color[0] >= 0 ? color[0] : floorf(xorshift64_float(rng) * 255);
+    s->g[i] = color[1] >= 0 ? color[1] : floorf(xorshift64_float(rng) * 255);
+    s->b[i] = color[2] >= 0 ? color[2] : floorf(xorshift64_float(rng) * 255);
+  }
+  s->count = end;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_particle_system_get_attr(JSContext *ctx,
+                                           JSValueConst this_val, int magic) {
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  switch (magic) {
+  case 0:
+    return JS_NewInt32(ctx, s->count);
+  case 1:
+    return JS_NewFloat64(ctx, s->gravity);
+  case 2:
+    return JS_NewFloat64(ctx, s->damping);
+  case 3:
+    return JS_NewFloat64(ctx, s->radius);
+  default:
+    return JS_UNDEFINED;
+  }
+}
+
+static JSValue js_particle_system_set_attr(JSContext *ctx,
+                                           JSValueConst this_val,
+                                           JSValueConst val, int magic) {
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double d;
+  if (JS_ToFloat64(ctx, &d, val)) {
+    return JS_EXCEPTION;
+  }
+  switch (magic) {
+  case 1:
+    s->gravity = d;
+    break;
+  case 2:
+    s->damping = d;
+    break;
+  case 3:
+    s->radius = d;
+    break;
+  }
+  return JS_UNDEFINED;
+}
+
+static JSValue js_particle_system_clear(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  s->count = 0;
+  return JS_UNDEFINED;
+}
+
+static JSValue js_particle_system_render(JSContext *ctx, JSValueConst this_val,
+                                         int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "particles.render() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  JSCanvas *canvas = JS_GetOpaque2(ctx, argv[0], js_canvas_class_id);
+  if (!canvas) {
+    return JS_EXCEPTION;
+  }
+
+  for (int i = 0; i < s->count; i++) {
+    canvas_set_paint(canvas, s->r[i] / 255.0f, s->g[i] / 255.0f,
+                     s->b[i] / 255.0f, s->alpha[i]);
+    canvas_fill_circle(canvas, s->x[i], s->y[i], s->radius);
+  }
+  canvas_apply_fill_style(canvas);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_particle_system_seed(JSContext *ctx, JSValueConst this_val,
+                                       int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "particles.seed() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  int64_t seed;
+  if (JS_ToInt64(ctx, &seed, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  xorshift64_seed(&s->rng, seed);
+  return JS_UNDEFINED;
+}
+
+static JSValue js_particle_system_step(JSContext *ctx, JSValueConst this_val,
+                                       int argc, JSValueConst *argv) {
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  double dt = 1;
+  if (argc > 0 && !JS_IsUndefined(argv[0]) &&
+      JS_ToFloat64(ctx, &dt, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  particle_system_step(s, dt);
+  return JS_UNDEFINED;
+}
+
+// Writes the particles as fillCircles() records, which is how a worker hands
+// its simulation to the main thread. Returns the number of records written.
+static JSValue js_particle_system_write_circles(JSContext *ctx,
+                                                JSValueConst this_val,
+                                                int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr,
+            "particles.writeCircles() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSParticleSystem *s =
+      JS_GetOpaque2(ctx, this_val, js_particle_system_class_id);
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  size_t len;
+  float *records = js_get_float32_array(ctx, argv[0], &len);
+  if (!records) {
+    return JS_EXCEPTION;
+  }
+  int count = SDL_min(s->count, (int)(len / CANVAS_CIRCLE_RECORD));
+  for (int i = 0; i < count; i++) {
+    float *r = records + i * CANVAS_CIRCLE_RECORD;
+    r[0] = s->x[i];
+    r[1] = s->y[i];
+    r[2] = s->radius;
+    r[3] = s->r[i];
+    r[4] = s->g[i];
+    r[5] = s->b[i];
+    r[6] = s->alpha[i] * 255.0f;
+  }
+  return JS_NewInt32(ctx, count);
+}
+
+static const JSCFunctionListEntry js_particle_system_proto_funcs[] = {
+    JS_CGETSET_MAGIC_DEF("count", js_particle_system_get_attr, NULL, 0),
+    JS_CGETSET_MAGIC_DEF("gravity", js_particle_system_get_attr,
+                         js_particle_system_set_attr, 1),
+    JS_CGETSET_MAGIC_DEF("damping", js_particle_system_get_attr,
+                         js_particle_system_set_attr, 2),
+    JS_CGETSET_MAGIC_DEF("radius", js_particle_system_get_attr,
+                         js_particle_system_set_attr, 3),
+
+    JS_CFUNC_DEF("clear", 0, js_particle_system_clear),
+    JS_CFUNC_DEF("emit", 4, js_particle_system_emit),
+    JS_CFUNC_DEF("render", 1, js_particle_system_render),
+    JS_CFUNC_DEF("seed", 1, js_particle_system_seed),
+    JS_CFUNC_DEF("step", 1, js_particle_system_step),
+    JS_CFUNC_DEF("writeCircles", 1, js_particle_system_write_circles),
+};
+
+static int js_particle_system_init(JSContext *ctx) {
+  JSValue proto, class;
+  JSRuntime *rt = JS_GetRuntime(ctx);
+
+  JS_NewClassID(&js_particle_system_class_id);
+  if (!JS_IsRegisteredClass(rt, js_particle_system_class_id)) {
+    JS_NewClass(rt, js_particle_system_class_id, &js_particle_system_class);
+  }
+
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, js_particle_system_proto_funcs,
+                             countof(js_particle_system_proto_funcs));
+
+  class = JS_NewCFunction2(ctx, js_particle_system_ctor, "ParticleSystem", 0,
+                           JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, class, proto);
+  JS_SetClassProto(ctx, js_particle_system_class_id, proto);
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyStr(ctx, global, "ParticleSystem", class);
+  JS_FreeValue(ctx, global);
+
+  return 0;
+}
+
+// #endregion
+
+// #region SharedFrames
+
+// A lock-free triple buffer over a SharedArrayBuffer, so a simulation worker
+// can publish whole frames while the main thread renders the latest one.
+// The writer owns one slot, the reader owns another and the third is parked
+// in the header; publish() and acquire() swap a slot with the parked one,
+// so neither side ever sees a frame that is half written.
+//
+// Layout: a 64 byte header, then three slots of SHARED_FRAMES_SLOT_HEADER
+// bytes (sequence, count) followed by the frame data, 16 byte aligned.
+#define SHARED_FRAMES_MAGIC 0x59534646 // "YSFF"
+#define SHARED_FRAMES_HEADER 64
+#define SHARED_FRAMES_SLOT_HEADER 16
+#define SHARED_FRAMES_SLOTS 3
+#define SHARED_FRAMES_FRESH 4 // set on the parked slot when it is newer
+
+typedef struct {
+  int32_t magic;
+  int32_t slot_bytes;
+  SDL_AtomicInt parked;
+  int32_t sequence;
+} SharedFramesHeader;
+
+typedef struct {
+  uint32_t sequence;
+  int32_t count;
+} SharedFramesSlot;
+
+typedef struct {
+  JSValue buffer;
+  uint8_t *data;
+  int slot_bytes;
+  int slot_stride;
+  // each side keeps its own slot index, the parked one lives in the header
+  int write_slot;
+  int read_slot;
+} JSSharedFrames;
+
+static JSClassID js_shared_frames_class_id;
+
+static void js_shared_frames_finalizer(JSRuntime *rt, JSValue val) {
+  JSSharedFrames *s = JS_GetOpaque(val, js_shared_frames_class_id);
+  if (s) {
+    JS_FreeValueRT(rt, s->buffer);
+  }
+  js_free_rt(rt, s);
+}
+
+static void js_shared_frames_mark(JSRuntime *rt, JSValueConst val,
+                                  JS_MarkFunc *mark_func) {
+  JSSharedFrames *s = JS_GetOpaque(val, js_shared_frames_class_id);
+  if (s) {
+    JS_MarkValue(rt, s->buffer, mark_func);
+  }
+}
+
+static JSClassDef js_shared_frames_class = {
+    "SharedFrames",
+    .finalizer = js_shared_frames_finalizer,
+    .gc_mark = js_shared_frames_mark,
+};
+
+static inline SharedFramesHeader *shared_frames_header(JSSharedFrames *s) {
+  return (SharedFramesHeader *)s->data;
+}
+
+static inline int shared_frames_offset(JSSharedFrames *s, int slot) {
+  return SHARED_FRAMES_HEADER + slot * s->slot_stride +
+         SHARED_FRAMES_SLOT_HEADER;
+}
+
+static inline SharedFramesSlot *shared_frames_slot(JSSharedFrames *s,
+                                                   int slot) {
+  return (SharedFramesSlot *)(s->data + shared_frames_offset(s, slot) -
+                              SHARED_FRAMES_SLOT_HEADER);
+}
+
+// The SharedArrayBuffer is created through the JS constructor so that its
+// memory comes from the SharedArrayBuffer allocator js_std_init_handlers()
+// installs, which is what lets it survive postMessage() to a worker.
+static JSValue shared_frames_new_buffer(JSContext *ctx, int64_t size) {
+  JSValue global = JS_GetGlobalObject(ctx);
+  JSValue ctor = JS_GetPropertyStr(ctx, global, "SharedArrayBuffer");
+  JS_FreeValue(ctx, global);
+  JSValue len = JS_NewInt64(ctx, size);
+  JSValue buffer = JS_CallConstructor(ctx, ctor, 1, &len);
+  JS_FreeValue(ctx, ctor);
+  return buffer;
+}
+
+static JSValue js_shared_frames_ctor(JSContext *ctx, JSValueConst new_target,
+                                     int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "new SharedFrames() expected 1 argument, but got %d\n",
+            argc);
+    return JS_EXCEPTION;
+  }
+  JSValue obj = JS_UNDEFINED;
+  JSValue proto;
+  JSSharedFrames *s;
+
+  s = js_mallocz(ctx, sizeof(*s));
+  if (!s) {
+    return JS_EXCEPTION;
+  }
+  s->buffer = JS_UNDEFINED;
+
+  bool create = JS_IsNumber(argv[0]);
+  if (create) {
+    int32_t slot_bytes;
+    if (JS_ToInt32(ctx, &slot_bytes, argv[0])) {
+      goto fail;
+    }
+    if (slot_bytes <= 0 || slot_bytes > INT32_MAX / 4) {
+      JS_ThrowRangeError(ctx, "invalid slot size %d", slot_bytes);
+      goto fail;
+    }
+    s->slot_bytes = slot_bytes;
+    s->slot_stride = (SHARED_FRAMES_SLOT_HEADER + slot_bytes + 15) & ~15;
+    s->buffer = shared_frames_new_buffer(
+        ctx, SHARED_FRAMES_HEADER +
+                 (int64_t)SHARED_FRAMES_SLOTS * s->slot_stride);
+    if (JS_IsException(s->buffer)) {
+      goto fail;
+    }
+  } else {
+    s->buffer = JS_DupValue(ctx, argv[0]);
+  }
+
+  size_t size;
+  s->data = JS_GetArrayBuffer(ctx, &size, s->buffer);
+  if (!s->data) {
+    goto fail;
+  }
+  SharedFramesHeader *h = shared_frames_header(s);
+  if (create) {
+    // slot 0 is written first, slot 1 is parked and slot 2 is read
+    h->magic = SHARED_FRAMES_MAGIC;
+    h->slot_bytes = s->slot_bytes;
+    SDL_SetAtomicInt(&h->parked, 1);
+    h->sequence = 0;
+  } else {
+    if (size < SHARED_FRAMES_HEADER || h->magic != SHARED_FRAMES_MAGIC) {
+      JS_ThrowTypeError(ctx, "not a SharedFrames buffer");
+      goto fail;
+    }
+    // read once: the header is shared and checked like a size from JS
+    int32_t slot_bytes = h->slot_bytes;
+    if (slot_bytes <= 0 || slot_bytes > INT32_MAX / 4) {
+      JS_ThrowTypeError(ctx, "not a SharedFrames buffer");
+      goto fail;
+    }
+    s->slot_bytes = slot_bytes;
+    s->slot_stride = (SHARED_FRAMES_SLOT_HEADER + slot_bytes + 15) & ~15;
+    if (size < SHARED_FRAMES_HEADER +
+                   (size_t)SHARED_FRAMES_SLOTS * s->slot_stride) {
+      JS_ThrowTypeError(ctx, "not a SharedFrames buffer");
+      goto fail;
+    }
+  }
+  s->write_slot = 0;
+  s->read_slot = 2;
+
+  proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+  if (JS_IsException(proto)) {
+    goto fail;
+  }
+  obj = JS_NewObjectProtoClass(ctx, proto, js_shared_frames_class_id);
+  JS_FreeValue(ctx, proto);
+  if (JS_IsException(obj)) {
+    goto fail;
   }
+  JS_SetOpaque(obj, s);
+  return obj;
 
-  SDL_Renderer *renderer = s->renderer;
-  if (!SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0)) {
-    fprintf(stderr, "SDL could not set draw color! SDL_Error: %s\n",
-            SDL_GetError());
+fail:
+  JS_FreeValue(ctx, s->buffer);
+  js_free(ctx, s);
+  JS_FreeValue(ctx, obj);
+  return JS_EXCEPTION;
+}
+
+enum {
+  SHARED_FRAMES_BUFFER,
+  SHARED_FRAMES_SLOT_BYTES,
+  SHARED_FRAMES_WRITE_SLOT,
+  SHARED_FRAMES_READ_SLOT,
+  SHARED_FRAMES_COUNT,
+  SHARED_FRAMES_SEQUENCE,
+};
+
+static JSValue js_shared_frames_get_attr(JSContext *ctx,
+                                         JSValueConst this_val, int magic) {
+  JSSharedFrames *s = JS_GetOpaque2(ctx, this_val, js_shared_frames_class_id);
+  if (!s) {
     return JS_EXCEPTION;
   }
-  if (!SDL_RenderClear(renderer)) {
-    fprintf(stderr, "SDL could not clear window! SDL_Error: %s\n",
-            SDL_GetError());
-    return JS_EXCEPTION;
+  switch (magic) {
+  case SHARED_FRAMES_BUFFER:
+    return JS_DupValue(ctx, s->buffer);
+  case SHARED_FRAMES_SLOT_BYTES:
+    return JS_NewInt32(ctx, s->slot_bytes);
+  case SHARED_FRAMES_WRITE_SLOT:
+    return JS_NewInt32(ctx, s->write_slot);
+  case SHARED_FRAMES_READ_SLOT:
+    return JS_NewInt32(ctx, s->read_slot);
+  case SHARED_FRAMES_COUNT:
+    return JS_NewInt32(ctx, shared_frames_slot(s, s->read_slot)->count);
+  case SHARED_FRAMES_SEQUENCE:
+    return JS_NewUint32(ctx, shared_frames_slot(s, s->read_slot)->sequence);
   }
-  plutovg_color_t color = {0, 0, 0, 0};
-  plutovg_surface_clear(s->plutovg_surface, &color);
   return JS_UNDEFINED;
 }
 
-static JSValue js_canvas_clear_rect(JSContext *ctx, JSValueConst this_val,
-                                    int argc, JSValueConst *argv) {
-  if (argc != 4) {
-    fprintf(stderr, "canvas.clearRect() expected 4 arguments, but got %d\n",
-            argc);
-    return JS_EXCEPTION;
-  }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+// Swaps the parked slot for the read slot when a newer frame was published.
+// Returns false, keeping the current frame, when nothing new arrived.
+static JSValue js_shared_frames_acquire(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  JSSharedFrames *s = JS_GetOpaque2(ctx, this_val, js_shared_frames_class_id);
   if (!s) {
     return JS_EXCEPTION;
   }
-
-  double x = 0, y = 0, width = 0, height = 0;
-  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
-      JS_ToFloat64(ctx, &width, argv[2]) ||
-      JS_ToFloat64(ctx, &height, argv[3])) {
-    return JS_EXCEPTION;
-  }
-  SDL_Renderer *renderer = s->renderer;
-  if (!SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0)) {
-    fprintf(stderr, "SDL could not set draw color! SDL_Error: %s\n",
-            SDL_GetError());
-    return JS_EXCEPTION;
-  }
-  SDL_FRect rect = {.x = x, .y = y, .w = width, .h = height};
-  if (!SDL_RenderFillRect(renderer, &rect)) {
-    fprintf(stderr, "SDL could not fill rect! SDL_Error: %s\n", SDL_GetError());
-    return JS_EXCEPTION;
+  SharedFramesHeader *h = shared_frames_header(s);
+  if (!(SDL_GetAtomicInt(&h->parked) & SHARED_FRAMES_FRESH)) {
+    return JS_NewBool(ctx, false);
   }
-  return JS_UNDEFINED;
+  int parked = SDL_SetAtomicInt(&h->parked, s->read_slot);
+  SDL_MemoryBarrierAcquire();
+  s->read_slot = parked & ~SHARED_FRAMES_FRESH;
+  return JS_NewBool(ctx, true);
 }
 
-static JSValue js_canvas_fill(JSContext *ctx, JSValueConst this_val, int argc,
-                              JSValueConst *argv) {
-  if (argc != 0) {
-    fprintf(stderr, "canvas.fill() expected 0 arguments, but got %d\n", argc);
+static JSValue js_shared_frames_offset_of(JSContext *ctx,
+                                          JSValueConst this_val, int argc,
+                                          JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr,
+            "frames.offsetOf() expected 1 argument, but got %d\n", argc);
     return JS_EXCEPTION;
   }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  JSSharedFrames *s = JS_GetOpaque2(ctx, this_val, js_shared_frames_class_id);
   if (!s) {
     return JS_EXCEPTION;
   }
-  SDL_Color color = s->fill_style.color;
-  plutovg_canvas_set_rgba(s->plutovg_canvas, color.r / 255.0, color.g / 255.0,
-                          color.b / 255.0, color.a / 255.0);
-  plutovg_canvas_fill(s->plutovg_canvas);
-  return JS_UNDEFINED;
+  int32_t slot;
+  if (JS_ToInt32(ctx, &slot, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  if (slot < 0 || slot >= SHARED_FRAMES_SLOTS) {
+    return JS_ThrowRangeError(ctx, "slot %d out of range", slot);
+  }
+  return JS_NewInt32(ctx, shared_frames_offset(s, slot));
 }
 
-static JSValue js_canvas_fill_rect(JSContext *ctx, JSValueConst this_val,
-                                   int argc, JSValueConst *argv) {
-  if (argc != 4) {
-    fprintf(stderr, "canvas.fillRect() expected 4 arguments, but got %d\n",
+// Stamps the write slot and hands it over, taking the parked slot in return.
+static JSValue js_shared_frames_publish(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "frames.publish() expected 1 argument, but got %d\n",
             argc);
     return JS_EXCEPTION;
   }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
+  JSSharedFrames *s = JS_GetOpaque2(ctx, this_val, js_shared_frames_class_id);
   if (!s) {
     return JS_EXCEPTION;
   }
-  double x = 0, y = 0, width = 0, height = 0;
-  if (JS_ToFloat64(ctx, &x, argv[0]) || JS_ToFloat64(ctx, &y, argv[1]) ||
-      JS_ToFloat64(ctx, &width, argv[2]) ||
-      JS_ToFloat64(ctx, &height, argv[3])) {
+  int32_t count;
+  if (JS_ToInt32(ctx, &count, argv[0])) {
     return JS_EXCEPTION;
   }
-  plutovg_canvas_fill_rect(s->plutovg_canvas, x, y, width, height);
-  return JS_UNDEFINED;
+  SharedFramesHeader *h = shared_frames_header(s);
+  SharedFramesSlot *slot = shared_frames_slot(s, s->write_slot);
+  slot->sequence = ++h->sequence;
+  slot->count = count;
+  SDL_MemoryBarrierRelease();
+  int parked = SDL_SetAtomicInt(&h->parked,
+                                s->write_slot | SHARED_FRAMES_FRESH);
+  s->write_slot = parked & ~SHARED_FRAMES_FRESH;
+  return JS_NewUint32(ctx, slot->sequence);
 }
 
-static JSValue js_canvas_get_wh(JSContext *ctx, JSValueConst this_val,
-                                int magic) {
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s)
-    return JS_EXCEPTION;
-  if (magic == 0)
-    return JS_NewInt32(ctx, s->width);
-  else
-    return JS_NewInt32(ctx, s->height);
-}
+static const JSCFunctionListEntry js_shared_frames_proto_funcs[] = {
+    JS_CGETSET_MAGIC_DEF("buffer", js_shared_frames_get_attr, NULL,
+                         SHARED_FRAMES_BUFFER),
+    JS_CGETSET_MAGIC_DEF("slotBytes", js_shared_frames_get_attr, NULL,
+                         SHARED_FRAMES_SLOT_BYTES),
+    JS_CGETSET_MAGIC_DEF("writeSlot", js_shared_frames_get_attr, NULL,
+                         SHARED_FRAMES_WRITE_SLOT),
+    JS_CGETSET_MAGIC_DEF("readSlot", js_shared_frames_get_attr, NULL,
+                         SHARED_FRAMES_READ_SLOT),
+    JS_CGETSET_MAGIC_DEF("count", js_shared_frames_get_attr, NULL,
+                         SHARED_FRAMES_COUNT),
+    JS_CGETSET_MAGIC_DEF("sequence", js_shared_frames_get_attr, NULL,
+                         SHARED_FRAMES_SEQUENCE),
 
-static JSValue js_canvas_poll_event(JSContext *ctx, JSValueConst this_val,
-                                    int argc, JSValueConst *argv) {
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
-    return JS_EXCEPTION;
-  }
+    JS_CFUNC_DEF("acquire", 0, js_shared_frames_acquire),
+    JS_CFUNC_DEF("offsetOf", 1, js_shared_frames_offset_of),
+    JS_CFUNC_DEF("publish", 1, js_shared_frames_publish),
+};
 
-  SDL_Event event;
-  if (SDL_PollEvent(&event)) {
-    JSValue event_obj = JS_NewObjectClass(ctx, js_event_class_id);
-    if (JS_IsException(event_obj)) {
-      return JS_EXCEPTION;
-    }
-    SDL_Event *event_data = js_mallocz(ctx, sizeof(SDL_Event));
-    if (!event_data) {
-      JS_FreeValue(ctx, event_obj);
-      return JS_EXCEPTION;
-    }
-    *event_data = event;
-    JS_SetOpaque(event_obj, event_data);
-    return event_obj;
-  } else {
-    return JS_UNDEFINED;
+static int js_shared_frames_init(JSContext *ctx) {
+  JSValue proto, class;
+  JSRuntime *rt = JS_GetRuntime(ctx);
+
+  // class ids are process wide, workers only register the class again
+  JS_NewClassID(&js_shared_frames_class_id);
+  if (!JS_IsRegisteredClass(rt, js_shared_frames_class_id)) {
+    JS_NewClass(rt, js_shared_frames_class_id, &js_shared_frames_class);
   }
-}
 
-static JSValue js_canvas_quit(JSContext *ctx, JSValueConst this_val, int argc,
-                              JSValueConst *argv) {
-  return JS_UNDEFINED;
+  proto = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, proto, js_shared_frames_proto_funcs,
+                             countof(js_shared_frames_proto_funcs));
+
+  class = JS_NewCFunction2(ctx, js_shared_frames_ctor, "SharedFrames", 1,
+                           JS_CFUNC_constructor, 0);
+  JS_SetConstructor(ctx, class, proto);
+  JS_SetClassProto(ctx, js_shared_frames_class_id, proto);
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  JS_SetPropertyStr(ctx, global, "SharedFrames", class);
+  JS_FreeValue(ctx, global);
+
+  return 0;
 }
 
-static JSValue js_canvas_set_fill_color(JSContext *ctx, JSValueConst this_val,
-                                        int argc, JSValueConst *argv) {
-  if (argc != 3 && argc != 4) {
-    fprintf(stderr,
-            "canvas.setFillColor() expected 3 or 4 arguments, but got %d\n",
-            argc);
-    return JS_EXCEPTION;
-  }
-  int32_t r = 0, g = 0, b = 0, a = 255;
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
-    return JS_EXCEPTION;
-  }
+// #endregion
 
-  if (JS_ToInt32(ctx, &r, argv[0]) || JS_ToInt32(ctx, &g, argv[1]) ||
-      JS_ToInt32(ctx, &b, argv[2]) ||
-      (argc == 4 && JS_ToInt32(ctx, &a, argv[3]))) {
-    return JS_EXCEPTION;
+// #region rand
+//
+// import * as rand from 'rand' gives scripts the xorshift generator without
+// going through Math.random. Every thread has its own state, so workers
+// that import it never share one.
+
+static _Thread_local uint64_t rand_state;
+
+static uint64_t rand_next(void) {
+  if (!rand_state) {
+#ifdef YANHUA_BENCH
+    // the same sequence on every run, like Math.random in a benchmark
+    xorshift64_seed(&rand_state, app_options.seed ? app_options.seed : 1);
+#else
+    xorshift64_seed(&rand_state, SDL_GetPerformanceCounter() ^
+                                     (uint64_t)SDL_GetCurrentThreadID());
+#endif
   }
-  SDL_Color color = (SDL_Color){.r = r, .g = g, .b = b, .a = a};
+  return xorshift64_next(&rand_state);
+}
 
-  s->fill_style.color = color;
-  plutovg_canvas_set_rgba(s->plutovg_canvas, color.r / 255.0, color.g / 255.0,
-                          color.b / 255.0, color.a / 255.0);
-  return JS_UNDEFINED;
+// rand.random() returns a float in [0, 1) with 53 random bits.
+static JSValue js_rand_random(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+  return JS_NewFloat64(ctx, (rand_next() >> 11) * 0x1.0p-53);
 }
 
-static JSValue js_canvas_set_global_alpha(JSContext *ctx, JSValueConst this_val,
-                                          int argc, JSValueConst *argv) {
+// rand.int(n) returns an integer in [0, n), 0 when n is not positive.
+static JSValue js_rand_int(JSContext *ctx, JSValueConst this_val, int argc,
+                           JSValueConst *argv) {
   if (argc != 1) {
-    fprintf(stderr, "canvas.setGlobalAlpha() expected 1 argument, but got %d\n",
-            argc);
+    fprintf(stderr, "rand.int() expected 1 argument, but got %d\n", argc);
     return JS_EXCEPTION;
   }
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
+  int32_t n;
+  if (JS_ToInt32(ctx, &n, argv[0])) {
     return JS_EXCEPTION;
   }
-  double alpha = 1.0;
-  if (JS_ToFloat64(ctx, &alpha, argv[0])) {
-    return JS_EXCEPTION;
+  if (n <= 0) {
+    return JS_NewInt32(ctx, 0);
   }
-  plutovg_canvas_set_opacity(s->plutovg_canvas, alpha);
-  return JS_UNDEFINED;
+  // multiply and shift instead of a modulo
+  return JS_NewInt32(ctx, (int32_t)((rand_next() >> 32) * (uint32_t)n >> 32));
 }
 
-static JSValue js_canvas_show(JSContext *ctx, JSValueConst this_val, int argc,
-                              JSValueConst *argv) {
-  JSCanvas *s = JS_GetOpaque2(ctx, this_val, js_canvas_class_id);
-  if (!s) {
+// rand.range(min, max) returns a float in [min, max).
+static JSValue js_rand_range(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+  if (argc != 2) {
+    fprintf(stderr, "rand.range() expected 2 arguments, but got %d\n", argc);
     return JS_EXCEPTION;
   }
-  SDL_Texture *texture = SDL_CreateTextureFromSurface(s->renderer, s->surface);
-  SDL_FRect srcrect = {.x = 0, .y = 0, .w = s->width, .h = s->height};
-  SDL_FRect dstrect = {.x = 0, .y = 0, .w = s->width, .h = s->height};
-  SDL_Renderer *renderer = s->renderer;
-  if (!SDL_RenderTexture(renderer, texture, &srcrect, &dstrect)) {
-    SDL_DestroyTexture(texture);
-    fprintf(stderr, "SDL could not render texture! SDL_Error: %s\n",
-            SDL_GetError());
+  double min, max;
+  if (JS_ToFloat64(ctx, &min, argv[0]) || JS_ToFloat64(ctx, &max, argv[1])) {
     return JS_EXCEPTION;
   }
-  SDL_DestroyTexture(texture);
+  double t = (rand_next() >> 11) * 0x1.0p-53;
+  return JS_NewFloat64(ctx, min + t * (max - min));
+}
 
-  if (!SDL_RenderPresent(renderer)) {
-    fprintf(stderr, "SDL could not present window! SDL_Error: %s\n",
-            SDL_GetError());
+// rand.seed(n) restarts the sequence of this thread.
+static JSValue js_rand_seed(JSContext *ctx, JSValueConst this_val, int argc,
+                            JSValueConst *argv) {
+  if (argc != 1) {
+    fprintf(stderr, "rand.seed() expected 1 argument, but got %d\n", argc);
     return JS_EXCEPTION;
   }
+  int64_t seed;
+  if (JS_ToInt64(ctx, &seed, argv[0])) {
+    return JS_EXCEPTION;
+  }
+  xorshift64_seed(&rand_state, (uint64_t)seed);
   return JS_UNDEFINED;
 }
 
-static const JSCFunctionListEntry js_canvas_proto_funcs[] = {
-    JS_CGETSET_MAGIC_DEF("width", js_canvas_get_wh, NULL, 0),
-    JS_CGETSET_MAGIC_DEF("height", js_canvas_get_wh, NULL, 1),
-
-    JS_CFUNC_DEF("arc", 6, js_canvas_arc),
-    JS_CFUNC_DEF("beginPath", 0, js_canvas_begin_path),
-    JS_CFUNC_DEF("clear", 0, js_canvas_clear),
-    JS_CFUNC_DEF("clearRect", 4, js_canvas_clear_rect),
-    JS_CFUNC_DEF("fill", 0, js_canvas_fill),
-    JS_CFUNC_DEF("fillRect", 4, js_canvas_fill_rect),
-    JS_CFUNC_DEF("pollEvent", 0, js_canvas_poll_event),
-    JS_CFUNC_DEF("quit", 0, js_canvas_quit),
-    JS_CFUNC_DEF("setFillColor", 4, js_canvas_set_fill_color),
-    JS_CFUNC_DEF("setGlobalAlpha", 1, js_canvas_set_global_alpha),
-    JS_CFUNC_DEF("show", 0, js_canvas_show),
+static const JSCFunctionListEntry js_rand_funcs[] = {
+    JS_CFUNC_DEF("int", 1, js_rand_int),
+    JS_CFUNC_DEF("random", 0, js_rand_random),
+    JS_CFUNC_DEF("range", 2, js_rand_range),
+    JS_CFUNC_DEF("seed", 1, js_rand_seed),
 };
 
-static int js_canvas_init(JSContext *ctx) {
-  JSValue canvas_proto, canvas_class;
-
-  JS_NewClassID(&js_canvas_class_id);
-  JS_NewClass(JS_GetRuntime(ctx), js_canvas_class_id, &js_canvas_class);
-
-  canvas_proto = JS_NewObject(ctx);
-  JS_SetPropertyFunctionList(ctx, canvas_proto, js_canvas_proto_funcs,
-                             countof(js_canvas_proto_funcs));
-
-  canvas_class = JS_NewCFunction2(ctx, js_canvas_ctor, "Canvas", 2,
-                                  JS_CFUNC_constructor, 0);
-  JS_SetConstructor(ctx, canvas_class, canvas_proto);
-  JS_SetClassProto(ctx, js_canvas_class_id, canvas_proto);
-
-  JSValue global = JS_GetGlobalObject(ctx);
-  JS_SetPropertyStr(ctx, global, "Canvas", canvas_class);
-  JS_FreeValue(ctx, global);
+static int js_rand_module_init(JSContext *ctx, JSModuleDef *m) {
+  return JS_SetModuleExportList(ctx, m, js_rand_funcs, countof(js_rand_funcs));
+}
 
-  return 0;
+static JSModuleDef *js_init_module_rand(JSContext *ctx,
+                                        const char *module_name) {
+  JSModuleDef *m = JS_NewCModule(ctx, module_name, js_rand_module_init);
+  if (!m) {
+    return NULL;
+  }
+  JS_AddModuleExportList(ctx, m, js_rand_funcs, countof(js_rand_funcs));
+  return m;
 }
 
 // #endregion
 
 // #region quickjs
 
+#ifdef YANHUA_EMBED_BYTECODE
+// generated by qjsc -c -N yanhua_main_bytecode main.js
+extern const uint32_t yanhua_main_bytecode_size;
+extern const uint8_t yanhua_main_bytecode[];
+#endif
+
 static int eval_buf(JSContext *ctx, const void *buf, int buf_len,
                     const char *filename, int eval_flags) {
   JSValue val;
@@ -589,6 +8334,198 @@ static int eval_buf(JSContext *ctx, const void *buf, int buf_len,
   return ret;
 }
 
+// Bytecode cache: compiled scripts and modules are written next to their
+// source as <file>c (main.js -> main.jsc) and reused while the source, the
+// eval flags and the engine stay the same. Any mismatch recompiles and
+// rewrites the file; failing to write it is not an error.
+
+#define BYTECODE_CACHE_MAGIC 0x63626879 // "yhbc"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t eval_flags;
+  uint64_t engine_hash; // QuickJS version and ABI
+  uint64_t source_hash; // also covers the file name baked into the bytecode
+  uint64_t source_size;
+} BytecodeCacheHeader;
+
+#define FNV1A64_OFFSET 0xcbf29ce484222325ULL
+
+static uint64_t fnv1a64(const void *data, size_t len, uint64_t hash) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t bytecode_engine_hash(void) {
+  static const char version[] = QUICKJS_VERSION;
+  uint8_t abi[] = {sizeof(void *), sizeof(double), JS_TAG_MODULE & 0xff};
+  uint64_t hash = fnv1a64(version, sizeof(version), FNV1A64_OFFSET);
+  return fnv1a64(abi, sizeof(abi), hash);
+}
+
+static void bytecode_cache_header(BytecodeCacheHeader *h, const uint8_t *buf,
+                                  size_t buf_len, const char *filename,
+                                  int eval_flags) {
+  SDL_memset(h, 0, sizeof(*h));
+  h->magic = BYTECODE_CACHE_MAGIC;
+  h->eval_flags = eval_flags;
+  h->engine_hash = bytecode_engine_hash();
+  uint64_t hash = fnv1a64(buf, buf_len, FNV1A64_OFFSET);
+  h->source_hash = fnv1a64(filename, strlen(filename), hash);
+  h->source_size = buf_len;
+}
+
+static char *bytecode_cache_path(const char *filename) {
+  size_t len = strlen(filename);
+  char *path = malloc(len + 2);
+  if (path) {
+    memcpy(path, filename, len);
+    path[len] = 'c';
+    path[len + 1] = '\0';
+  }
+  return path;
+}
+
+// Returns the cached compiled object, or JS_UNDEFINED when there is none.
+static JSValue bytecode_cache_load(JSContext *ctx, const char *path,
+                                   const BytecodeCacheHeader *expected) {
+  size_t len;
+  uint8_t *data = js_load_file(ctx, &len, path);
+  if (!data) {
+    return JS_UNDEFINED;
+  }
+  JSValue obj = JS_UNDEFINED;
+  if (len > sizeof(*expected) && !memcmp(data, expected, sizeof(*expected))) {
+    obj = JS_ReadObject(ctx, data + sizeof(*expected), len - sizeof(*expected),
+                        JS_READ_OBJ_BYTECODE);
+    if (JS_IsException(obj)) {
+      // a damaged cache is recompiled, not reported
+      JS_FreeValue(ctx, JS_GetException(ctx));
+      obj = JS_UNDEFINED;
+    }
+  }
+  js_free(ctx, data);
+  return obj;
+}
+
+static void bytecode_cache_store(JSContext *ctx, const char *path,
+                                 const BytecodeCacheHeader *header,
+                                 JSValueConst obj) {
+  size_t len;
+  uint8_t *data = JS_WriteObject(ctx, &len, obj, JS_WRITE_OBJ_BYTECODE);
+  if (!data) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    return;
+  }
+  // written aside and renamed, so readers never see a partial file
+  size_t path_len = strlen(path);
+  char *tmp = malloc(path_len + 5);
+  if (tmp) {
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", 5);
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+      bool ok = fwrite(header, sizeof(*header), 1, f) == 1 &&
+                fwrite(data, len, 1, f) == 1;
+      ok = fclose(f) == 0 && ok;
+      if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+      }
+    }
+    free(tmp);
+  }
+  js_free(ctx, data);
+}
+
+// Compiles a script or module without running it, going through the
+// bytecode cache of filename.
+static JSValue compile_cached(JSContext *ctx, const uint8_t *buf,
+                              size_t buf_len, const char *filename,
+                              int eval_flags) {
+  char *path = app_options.no_cache ? NULL : bytecode_cache_path(filename);
+  BytecodeCacheHeader header;
+  JSValue obj = JS_UNDEFINED;
+  if (path) {
+    bytecode_cache_header(&header, buf, buf_len, filename, eval_flags);
+    obj = bytecode_cache_load(ctx, path, &header);
+  }
+  if (JS_IsUndefined(obj)) {
+    // JS_Eval needs a NUL terminated buffer, which js_load_file provides
+    obj = JS_Eval(ctx, (const char *)buf, buf_len, filename,
+                  eval_flags | JS_EVAL_FLAG_COMPILE_ONLY);
+    if (path && !JS_IsException(obj)) {
+      bytecode_cache_store(ctx, path, &header, obj);
+    }
+  }
+  free(path);
+  return obj;
+}
+
+// Runs an object from compile_cached() or JS_ReadObject().
+static int eval_compiled(JSContext *ctx, JSValue obj) {
+  JSValue val = obj;
+  if (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE) {
+    if (JS_ResolveModule(ctx, obj) < 0) {
+      JS_FreeValue(ctx, obj);
+      js_std_dump_error(ctx);
+      return -1;
+    }
+    js_module_set_import_meta(ctx, obj, TRUE, TRUE);
+    val = js_std_await(ctx, JS_EvalFunction(ctx, obj));
+  } else if (!JS_IsException(obj)) {
+    val = JS_EvalFunction(ctx, obj);
+  }
+  if (JS_IsException(val)) {
+    js_std_dump_error(ctx);
+    return -1;
+  }
+  JS_FreeValue(ctx, val);
+  return 0;
+}
+
+// Module loader going through the bytecode cache. Native and JSON modules
+// are left to the stock loader.
+static JSModuleDef *js_cached_module_loader(JSContext *ctx,
+                                            const char *module_name,
+                                            void *opaque,
+                                            JSValueConst attributes) {
+  bool plain =
+      has_suffix(module_name, ".js") || has_suffix(module_name, ".mjs");
+  if (plain && JS_IsObject(attributes)) {
+    JSValue type = JS_GetPropertyStr(ctx, attributes, "type");
+    plain = JS_IsUndefined(type);
+    JS_FreeValue(ctx, type);
+  }
+  if (!plain || app_options.no_cache) {
+    return js_module_loader(ctx, module_name, opaque, attributes);
+  }
+
+  size_t buf_len;
+  uint8_t *buf = js_load_file(ctx, &buf_len, module_name);
+  if (!buf) {
+    JS_ThrowReferenceError(ctx, "could not load module filename '%s'",
+                           module_name);
+    return NULL;
+  }
+  JSValue func_val = compile_cached(ctx, buf, buf_len, module_name,
+                                    JS_EVAL_TYPE_MODULE);
+  js_free(ctx, buf);
+  if (JS_IsException(func_val)) {
+    return NULL;
+  }
+  if (js_module_set_import_meta(ctx, func_val, TRUE, FALSE) < 0) {
+    JS_FreeValue(ctx, func_val);
+    return NULL;
+  }
+  /* the module is already referenced, so we must free it */
+  JSModuleDef *m = JS_VALUE_GET_PTR(func_val);
+  JS_FreeValue(ctx, func_val);
+  return m;
+}
+
 static int eval_file(JSContext *ctx, const char *filename, int module,
                      int strict) {
   uint8_t *buf;
@@ -612,11 +8549,25 @@ static int eval_file(JSContext *ctx, const char *filename, int module,
     if (strict)
       eval_flags |= JS_EVAL_FLAG_STRICT;
   }
-  ret = eval_buf(ctx, buf, buf_len, filename, eval_flags);
+  ret = eval_compiled(ctx,
+                      compile_cached(ctx, buf, buf_len, filename, eval_flags));
   js_free(ctx, buf);
   return ret;
 }
 
+// Runs the script given on the command line, main.js by default.
+static int eval_main(JSContext *ctx) {
+#ifdef YANHUA_EMBED_BYTECODE
+  // main.js compiled into the executable by qjsc, unless a script is given
+  if (app_options.script_argc == 0) {
+    return eval_compiled(ctx, JS_ReadObject(ctx, yanhua_main_bytecode,
+                                            yanhua_main_bytecode_size,
+                                            JS_READ_OBJ_BYTECODE));
+  }
+#endif
+  return eval_file(ctx, app_options.script, -1, 0);
+}
+
 /* also used to initialize the worker context */
 static JSContext *JS_NewCustomContext(JSRuntime *rt) {
   JSContext *ctx;
@@ -626,12 +8577,30 @@ static JSContext *JS_NewCustomContext(JSRuntime *rt) {
   /* system modules */
   js_init_module_std(ctx, "std");
   js_init_module_os(ctx, "os");
+  js_init_module_rand(ctx, "rand");
+  /* classes that do not need the window, so workers can simulate */
+  js_particle_system_init(ctx);
+  js_shared_frames_init(ctx);
   return ctx;
 }
 
 // #endregion
 
 int main(int argc, char *argv[]) {
+  if (parse_options(&app_options, argc, argv)) {
+    usage(argv[0]);
+    exit(1);
+  }
+#ifdef YANHUA_BENCH
+  if (app_options.frames <= 0) {
+    app_options.frames = 600;
+  }
+#endif
+  if (app_options.headless) {
+    // events still work, but nothing needs a display
+    SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "dummy");
+  }
+
   if (!SDL_SetAppMetadata("Canvas", "0.0.1", "com.quickjs.canvas")) {
     fprintf(stderr, "SDL could not to set app metadata! SDL_Error: %s\n",
             SDL_GetError());
@@ -644,7 +8613,31 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  JSRuntime *rt = JS_NewRuntime();
+  trace_init();
+  if (app_options.replay) {
+    // the bench report names the recording instead of a script
+    app_options.script = app_options.replay;
+    int status = replay_run(app_options.replay);
+    if (trace_close()) {
+      status = 1;
+    }
+#ifdef YANHUA_BENCH
+    if (!status) {
+      status = bench_report();
+    }
+    bench_free();
+#endif
+    canvas_stamps_free();
+    text_free();
+    SDL_Quit();
+    return status;
+  }
+  if (app_options.record && recorder_open(app_options.record)) {
+    SDL_Quit();
+    exit(1);
+  }
+
+  JSRuntime *rt = JS_NewRuntime2(&js_pool_malloc_funcs, &js_pool);
   js_std_set_worker_new_context_func(JS_NewCustomContext);
   js_std_init_handlers(rt);
   JSContext *ctx = JS_NewCustomContext(rt);
@@ -654,13 +8647,21 @@ int main(int argc, char *argv[]) {
   }
 
   /* loader for ES6 modules */
-  JS_SetModuleLoaderFunc2(rt, NULL, js_module_loader,
+  JS_SetModuleLoaderFunc2(rt, NULL, js_cached_module_loader,
                           js_module_check_attributes, NULL);
 
-  js_std_add_helpers(ctx, 0, NULL);
+  js_std_add_helpers(ctx, app_options.script_argc, app_options.script_argv);
 
   js_canvas_init(ctx);
+  js_image_init(ctx);
+  js_path2d_init(ctx);
   js_event_init(ctx);
+  js_frame_scheduler_init(ctx);
+  js_gc_init(ctx);
+  js_trace_init(ctx);
+#ifdef YANHUA_BENCH
+  js_bench_init(ctx);
+#endif
 
   /* make 'std' and 'os' visible to non module code */
   const char *str = "import * as std from 'std';\n"
@@ -668,22 +8669,47 @@ int main(int argc, char *argv[]) {
                     "globalThis.std = std;\n"
                     "globalThis.os = os;\n";
   eval_buf(ctx, str, strlen(str), "<input>", JS_EVAL_TYPE_MODULE);
-  if (eval_file(ctx, "main.js", -1, 0)) {
+  if (eval_main(ctx)) {
     goto fail;
   }
   js_std_loop(ctx);
 
+  int status = 0;
+#ifdef YANHUA_BENCH
+  status = bench_report();
+  bench_free();
+#endif
+  js_frame_scheduler_free(ctx);
+  js_image_free(ctx);
   js_std_free_handlers(rt);
   JS_FreeContext(ctx);
   JS_FreeRuntime(rt);
+  pool_free(&js_pool);
+  image_cache_free();
+  canvas_stamps_free();
+  text_free();
+  if (recorder_close()) {
+    status = 1;
+  }
+  if (trace_close()) {
+    status = 1;
+  }
 
   SDL_Quit();
 
-  return 0;
+  return status;
 fail:
+  js_frame_scheduler_free(ctx);
+  js_image_free(ctx);
   js_std_free_handlers(rt);
   JS_FreeContext(ctx);
   JS_FreeRuntime(rt);
+  pool_free(&js_pool);
+  image_cache_free();
+  canvas_stamps_free();
+  text_free();
+  recorder_close();
+  trace_close();
 
   SDL_Quit();
 
@@ -1,5 +1,29 @@
+import * as rand from 'rand'
+
 let fireworks = []
-let particles = []
+const particles = new ParticleSystem()
+
+// x, y, radius, r, g, b, a records drawn by one canvas.fillCircles() call
+const CIRCLE_RECORD = 7
+let circles = new Float32Array(1024 * CIRCLE_RECORD)
+let circleCount = 0
+
+function pushCircle(x, y, radius, r, g, b, a) {
+    if ((circleCount + 1) * CIRCLE_RECORD > circles.length) {
+        const grown = new Float32Array(circles.length * 2)
+        grown.set(circles)
+        circles = grown
+    }
+    const i = circleCount * CIRCLE_RECORD
+    circles[i] = x
+    circles[i + 1] = y
+    circles[i + 2] = radius
+    circles[i + 3] = r
+    circles[i + 4] = g
+    circles[i + 5] = b
+    circles[i + 6] = a
+    circleCount++
+}
 
 const EventType = {
     QUIT: 0x100,
@@ -10,32 +34,6 @@ const EventType = {
     MouseButtonUp: 0x402,
 }
 
-function hslToRgb(h, s, l) {
-    // Accept h in degrees, s and l as 0..1
-    h = ((h % 360) + 360) % 360;
-    if (s > 1) s /= 100;
-    if (l > 1) l /= 100;
-
-    const c = (1 - Math.abs(2 * l - 1)) * s;
-    const hh = h / 60;
-    const x = c * (1 - Math.abs((hh % 2) - 1));
-
-    let r1 = 0, g1 = 0, b1 = 0;
-    if (hh >= 0 && hh < 1) { r1 = c; g1 = x; b1 = 0; }
-    else if (hh < 2) { r1 = x; g1 = c; b1 = 0; }
-    else if (hh < 3) { r1 = 0; g1 = c; b1 = x; }
-    else if (hh < 4) { r1 = 0; g1 = x; b1 = c; }
-    else if (hh < 5) { r1 = x; g1 = 0; b1 = c; }
-    else { r1 = c; g1 = 0; b1 = x; }
-
-    const m = l - c / 2;
-    const r = Math.round((r1 + m) * 255);
-    const g = Math.round((g1 + m) * 255);
-    const b = Math.round((b1 + m) * 255);
-
-    return [r, g, b];
-}
-
 class Firework {
     constructor(canvas, x, y, targetX, targetY) {
         this.canvas = canvas
@@ -53,15 +51,13 @@ class Firework {
     }
 
     explode() {
-        for (let i = 0; i < 60; i++) {
-            particles.push(new Particle(this.canvas, this.x, this.y))
-        }
+        particles.emit(this.x, this.y, 60)
     }
 
-    update() {
-        this.x += this.vx
-        this.y += this.vy
-        this.distanceTraveled += this.speed
+    update(dt) {
+        this.x += this.vx * dt
+        this.y += this.vy * dt
+        this.distanceTraveled += this.speed * dt
         if (this.distanceTraveled >= this.distanceToTarget) {
             this.dead = true
             this.explode()
@@ -69,67 +65,21 @@ class Firework {
     }
 
     draw() {
-        const rgb = hslToRgb(Math.floor(Math.random() * 360), 1, Math.random())
-        const canvas = this.canvas
-        canvas.beginPath()
-        canvas.arc(this.x, this.y, 2, 0, Math.PI * 2)
-        canvas.setFillColor(rgb[0], rgb[1], rgb[2])
-        canvas.fill()
+        // 原生 HSL 转换，颜色打包成 0xRRGGBBAA 一个数，不分配数组
+        const c = Canvas.hsl(rand.int(360), 1, rand.random())
+        pushCircle(this.x, this.y, 2, c >>> 24, (c >>> 16) & 255, (c >>> 8) & 255, 255)
     }
 }
 
-class Particle {
-    constructor(canvas, x, y) {
-        this.canvas = canvas
-        this.x = x
-        this.y = y
-        this.speed = Math.random() * 4 + 1
-        this.angle = Math.random() * Math.PI * 2
-        this.vx = Math.cos(this.angle) * this.speed
-        this.vy = Math.sin(this.angle) * this.speed
-        this.gravity = 0.05
-
-        this.alpha = 1
-        this.decay = Math.random() * 0.015 + 0.003
-        this.dead = false
-        this.rgb = [
-            Math.floor(Math.random() * 255),
-            Math.floor(Math.random() * 255),
-            Math.floor(Math.random() * 255),
-        ]
-    }
-
-    update() {
-        this.vx *= 0.98
-        this.vy *= 0.98
-        this.vy += this.gravity
-        this.x += this.vx
-        this.y += this.vy
-        this.alpha -= this.decay
-        if (this.alpha <= 0) {
-            this.dead = true
-        }
-    }
-
-    draw() {
-        const canvas = this.canvas
-        canvas.setGlobalAlpha(this.alpha)
-        canvas.beginPath()
-        canvas.arc(this.x, this.y, 2, 0, Math.PI * 2)
-        canvas.setFillColor(this.rgb[0], this.rgb[1], this.rgb[2])
-        canvas.fill()
-        canvas.setGlobalAlpha(1)  // 重置全局透明度
-    }
-}
-
-function draw(canvas) {
-    // 覆盖一层半透明的黑色，制造拖尾效果
-    canvas.setFillColor(0, 0, 0, 100)
-    canvas.fillRect(0, 0, canvas.width, canvas.height)
+// dt 以 60 FPS 的一帧为单位
+function draw(canvas, dt) {
+    // 覆盖一层半透明的黑色，制造拖尾效果（整屏 SIMD 内核，不走路径填充）
+    canvas.fade(100 / 255)
 
+    circleCount = 0
     let aliveFireworks = []
     for (let firework of fireworks) {
-        firework.update()
+        firework.update(dt)
         firework.draw()
         if (!firework.dead) {
             aliveFireworks.push(firework)
@@ -137,49 +87,55 @@ function draw(canvas) {
     }
     fireworks = aliveFireworks
 
-    let aliveParticles = []
-    for (let particle of particles) {
-        particle.update()
-        particle.draw()
-        if (!particle.dead) {
-            aliveParticles.push(particle)
-        }
-    }
-    particles = aliveParticles
-}
+    // 所有烟花一次性绘制
+    canvas.fillCircles(circles, circleCount)
 
-function get_events(canvas) {
-    let events = []
-    while (true) {
-        let event = canvas.pollEvent()
-        if (!event) break
-        events.push(event)
-    }
-    return events
+    particles.step(dt)
+    particles.render(canvas)
 }
 
+// 没有烟花和粒子之后再画这么多帧，拖尾褪尽就停止绘制，调度器随之进入空闲等待
+const FADE_OUT_FRAMES = 60
+
 function main() {
     const canvas = new Canvas(800, 600)
-
-    while (true) {
-        let events = get_events(canvas)
-        for (let event of events) {
-            if (event.type === EventType.QUIT) {
+    // 事件记录缓冲区，每帧复用，不产生分配
+    const events = new Int32Array(256 * Canvas.EVENT_STRIDE)
+    let lastTime = 0
+    let quietFrames = 0
+
+    function frame(time) {
+        // 帧间隔换算成 60 FPS 帧数，卡顿时最多补 4 帧
+        const dt = lastTime ? Math.min((time - lastTime) / (1000 / 60), 4) : 1
+        lastTime = time
+
+        const count = canvas.pollEvents(events)
+        for (let i = 0; i < count * Canvas.EVENT_STRIDE; i += Canvas.EVENT_STRIDE) {
+            const type = events[i]
+            if (type === EventType.QUIT) {
                 canvas.quit()
                 return
             }
-            else if (event.type === EventType.MouseButtonDown) {
-                let x = event.x
-                let y = event.y
+            else if (type === EventType.MouseButtonDown) {
+                // button, x, y, clicks
+                let x = events[i + 2]
+                let y = events[i + 3]
                 let startX = canvas.width / 2
                 let startY = canvas.height
                 fireworks.push(new Firework(canvas, startX, startY, x, y))
             }
         }
-        draw(canvas)
+        quietFrames = fireworks.length > 0 || particles.count > 0 ? 0 : quietFrames + 1
+        if (quietFrames < FADE_OUT_FRAMES) {
+            draw(canvas, dt)
+        }
+        // 没画任何东西时 show() 不会提交，窗口被遮挡或缩放后仍会重绘
         canvas.show()
-        os.sleep(1000 / 60)  // 60 FPS
+        requestAnimationFrame(frame)
     }
+
+    // 帧由 requestAnimationFrame 驱动，帧间隙 js_std_loop 可以处理定时器和 Promise
+    requestAnimationFrame(frame)
 }
 
 main()